@@ -0,0 +1,328 @@
+#include "vec.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Micro-benchmarks of vec.h, built and run by `make bench`
+//
+//   ./benchfile [-o out.json] [-c old.json] [-f filter] [-m max_bytes] [-p]
+//
+// Every case runs over arrays of 16 KB (L1), 256 KB (L2), 4 MB (L3) and
+//   64 MB (DRAM on most machines), up to max_bytes, and reports the best
+//   of three timings as ns per element and as GB/s of the bytes it reads
+//   and writes. -o writes the results as JSON with one result per line,
+//   -c prints the speedup against such a file from another build, -f
+//   keeps the cases whose name contains `filter` and -p makes
+//   vec_exec::par the default policy.
+
+typedef std::chrono::steady_clock bench_clock;
+
+volatile double bench_sink;
+
+struct bench_result {
+    std::string name, type;
+    long bytes;
+    int n;
+    double ns, gbs;
+};
+
+struct bench_options {
+    const char* out;
+    const char* compare;
+    const char* filter;
+    long max_bytes;
+};
+
+// The arrays every case of one element type works on
+template <typename T>
+struct bench_data {
+    vec<T> a, b, out;
+    vec<bool> flags;
+    vec_mask mask;
+};
+
+// Values in [0.01, 0.99] for floats, [1, 1000] for integers, so that
+//   every function is in its domain and nothing divides by zero
+template <typename T>
+T bench_value(int i, int seed)
+{
+    const double u = std::fmod((i + 1) * 0.6180339887498949 + seed * 0.31, 1.0);
+    return std::is_floating_point<T>::value ? static_cast<T>(0.01 + 0.98 * u)
+        : static_cast<T>(1 + static_cast<int>(u * 1000));
+}
+
+template <typename T>
+struct bench_case {
+    const char* name;
+    int traffic;                    // Bytes read and written per element
+    void (*run)(bench_data<T>& d);
+};
+
+// Best time of a call to `fn` in seconds. Each timing repeats the call
+//   for at least 10 ms
+template <typename Fn>
+double bench_time(const Fn& fn)
+{
+    fn();
+    double best = 1e300;
+    for (int r = 0; r < 3; r++) {
+        int calls = 0;
+        double elapsed;
+        const bench_clock::time_point start = bench_clock::now();
+        do {
+            fn();
+            calls++;
+            elapsed = std::chrono::duration<double>(
+                bench_clock::now() - start).count();
+        } while (elapsed < 0.01);
+        best = std::min(best, elapsed / calls);
+    }
+    return best;
+}
+
+template <typename T>
+void bench_type(const char* type, const std::vector<bench_case<T>>& cases,
+    const bench_options& opt, std::vector<bench_result>& results)
+{
+    for (long bytes = 16 << 10; bytes <= opt.max_bytes && bytes <= (64l << 20);
+            bytes *= 16) {
+        const int n = static_cast<int>(bytes / sizeof(T));
+        bench_data<T> d;
+        bool ready = false;
+        for (const bench_case<T>& c : cases) {
+            if (opt.filter && !std::strstr(c.name, opt.filter))
+                continue;
+            if (!ready) {
+                for (int i = 0; i < n; i++) {
+                    d.a.append(bench_value<T>(i, 0));
+                    d.b.append(bench_value<T>(i, 1));
+                }
+                d.out = d.a;
+                d.flags = d.a < d.b;
+                d.mask = vec_mask(d.a < d.b);
+                ready = true;
+            }
+
+            const double s = bench_time([&]() {c.run(d);});
+            bench_result r = {c.name, type, bytes, n, s * 1e9 / n,
+                double(c.traffic) * n / s / 1e9};
+            results.push_back(r);
+            std::printf("%-16s %-7s %9ld KB %9.3f ns/elem %8.2f GB/s\n",
+                r.name.c_str(), type, bytes >> 10, r.ns, r.gbs);
+            std::fflush(stdout);
+        }
+    }
+}
+
+// Cases on doubles, float and int. Results go to `out` so that nothing is
+//   optimized away; each assignment allocates like it would in real code
+#define BENCH_EXPR(NAME, TRAFFIC, EXPR) \
+    {NAME, TRAFFIC, [](bench_data<T>& d) {d.out = EXPR;}}
+#define BENCH_FLAGS(NAME, TRAFFIC, EXPR) \
+    {NAME, TRAFFIC, [](bench_data<T>& d) {d.flags = EXPR;}}
+#define BENCH_SINK(NAME, TRAFFIC, EXPR) \
+    {NAME, TRAFFIC, [](bench_data<T>& d) {bench_sink = EXPR;}}
+#define BENCH_FN(FN) BENCH_EXPR(#FN, 2 * sizeof(T), FN(d.a))
+#define BENCH_FAST(FN) {"fast_" #FN, 2 * sizeof(T), [](bench_data<T>& d) { \
+    vec_math_mode() = vec_math::fast;                                   \
+    d.out = FN(d.a);                                                    \
+    vec_math_mode() = vec_math::exact;}}
+
+template <typename T>
+std::vector<bench_case<T>> bench_float_cases()
+{
+    const int s = sizeof(T);
+    return {
+        // Operators
+        BENCH_EXPR("add", 3 * s, d.a + d.b),
+        BENCH_EXPR("sub", 3 * s, d.a - d.b),
+        BENCH_EXPR("mul", 3 * s, d.a * d.b),
+        BENCH_EXPR("div", 3 * s, d.a / d.b),
+        BENCH_EXPR("add_atom", 2 * s, d.a + T(1)),
+        BENCH_EXPR("fused", 3 * s, d.a * d.b + d.a / T(2)),
+        {"add_assign", 3 * s, [](bench_data<T>& d) {d.out += d.a;}},
+        BENCH_FLAGS("lt", 2 * s + 1, d.a < d.b),
+        BENCH_FLAGS("eq", 2 * s + 1, d.a == d.b),
+        BENCH_FLAGS("and", s + 2, d.flags && d.a > T(0.5)),
+
+        // VECTORIZE_FN functions, with libm and with the SIMD kernels
+        BENCH_FN(sin), BENCH_FN(cos), BENCH_FN(tan), BENCH_FN(acos),
+        BENCH_FN(asin), BENCH_FN(atan), BENCH_FN(cosh), BENCH_FN(sinh),
+        BENCH_FN(tanh), BENCH_EXPR("acosh", 2 * s, acosh(d.a + T(1))),
+        BENCH_FN(asinh), BENCH_FN(atanh), BENCH_FN(exp), BENCH_FN(log),
+        BENCH_FN(log10), BENCH_FN(log2), BENCH_FN(sqrt), BENCH_FN(cbrt),
+        BENCH_FN(ceil), BENCH_FN(floor), BENCH_FN(abs),
+        BENCH_FAST(sin), BENCH_FAST(cos), BENCH_FAST(tan), BENCH_FAST(atan),
+        BENCH_FAST(tanh), BENCH_FAST(exp), BENCH_FAST(log),
+        BENCH_FAST(log10), BENCH_FAST(log2), BENCH_FAST(cbrt),
+
+        // Reductions
+        BENCH_SINK("sum", s, sum(d.a)),
+        BENCH_SINK("prod", s, prod(d.a)),
+        BENCH_SINK("max", s, max(d.a)),
+        BENCH_SINK("min", s, min(d.a)),
+        BENCH_SINK("argmax", s, argmax(d.a)),
+        BENCH_SINK("sum_expr", 2 * s, sum(d.a * d.b)),
+        BENCH_SINK("dot", 2 * s, dot(d.a, d.b)),
+        BENCH_SINK("norm2", s, norm2(d.a)),
+        BENCH_SINK("mean", s, mean(d.a)),
+        BENCH_SINK("var", s, var(d.a)),
+        BENCH_SINK("corr", 2 * s, corr(d.a, d.b)),
+        {"cumsum", 4 * s, [](bench_data<T>& d) {d.out = d.a; d.out.cumsum();}},
+
+        // Filters and generators
+        BENCH_EXPR("take_expr", 2 * s + s / 2, d.a.take(d.a < d.b)),
+        BENCH_EXPR("take_mask", s + s / 2, d.a.take(d.mask)),
+        {"range", s, [](bench_data<T>& d) {d.out = vec<T>::range(T(d.a.size()));}},
+        {"append", s, [](bench_data<T>& d) {
+            vec<T> v;
+            for (int i = 0; i < d.a.size(); i++)
+                v.append(T(i));
+            bench_sink = v[-1];}},
+    };
+}
+
+template <typename T>
+std::vector<bench_case<T>> bench_int_cases()
+{
+    const int s = sizeof(T);
+    return {
+        BENCH_EXPR("add", 3 * s, d.a + d.b),
+        BENCH_EXPR("mul", 3 * s, d.a * d.b),
+        BENCH_EXPR("div", 3 * s, d.a / d.b),
+        BENCH_EXPR("mod", 3 * s, d.a % d.b),
+        BENCH_EXPR("bitand", 3 * s, d.a & d.b),
+        BENCH_EXPR("bitor", 3 * s, d.a | d.b),
+        BENCH_FLAGS("lt", 2 * s + 1, d.a < d.b),
+        BENCH_SINK("sum", s, sum(d.a)),
+        BENCH_SINK("max", s, max(d.a)),
+        BENCH_SINK("argmin", s, argmin(d.a)),
+        BENCH_EXPR("take_expr", 2 * s + s / 2, d.a.take(d.a % 2 == 0)),
+        {"range", s, [](bench_data<T>& d) {d.out = vec<T>::range(d.a.size());}},
+        {"append", s, [](bench_data<T>& d) {
+            vec<T> v;
+            for (int i = 0; i < d.a.size(); i++)
+                v.append(T(i));
+            bench_sink = v[-1];}},
+    };
+}
+
+template <typename T>
+std::vector<bench_case<T>> bench_float32_cases()
+{
+    const int s = sizeof(T);
+    return {
+        BENCH_EXPR("add", 3 * s, d.a + d.b),
+        BENCH_EXPR("mul", 3 * s, d.a * d.b),
+        BENCH_FN(sin), BENCH_FN(exp),
+        BENCH_FAST(sin), BENCH_FAST(exp),
+        BENCH_SINK("sum", s, sum(d.a)),
+        BENCH_SINK("dot", 2 * s, dot(d.a, d.b)),
+    };
+}
+
+// The value of `"key": value` in a line of our own JSON
+std::string bench_field(const std::string& line, const char* key)
+{
+    const std::string k = std::string("\"") + key + "\": ";
+    size_t at = line.find(k);
+    if (at == std::string::npos)
+        return "";
+    at += k.size();
+    size_t end = line.find_first_of(",}", at);
+    std::string v = line.substr(at, end - at);
+    if (!v.empty() && v[0] == '"')
+        v = v.substr(1, v.size() - 2);
+    return v;
+}
+
+void bench_compare(const char* file, const std::vector<bench_result>& results)
+{
+    std::ifstream in(file);
+    if (!in) {
+        std::fprintf(stderr, "cannot read %s\n", file);
+        return;
+    }
+    std::map<std::string, double> old;
+    std::string line;
+    while (std::getline(in, line))
+        if (line.find("\"ns_per_elem\"") != std::string::npos)
+            old[bench_field(line, "name") + " " + bench_field(line, "type")
+                + " " + bench_field(line, "bytes")] =
+                std::atof(bench_field(line, "ns_per_elem").c_str());
+
+    std::printf("\n%-16s %-7s %12s %9s %9s %8s\n", "case", "type", "size",
+        "old ns", "new ns", "speedup");
+    for (const bench_result& r : results) {
+        auto it = old.find(r.name + " " + r.type + " "
+            + std::to_string(r.bytes));
+        if (it == old.end())
+            continue;
+        std::printf("%-16s %-7s %9ld KB %9.3f %9.3f %7.2fx\n", r.name.c_str(),
+            r.type.c_str(), r.bytes >> 10, it->second, r.ns, it->second / r.ns);
+    }
+}
+
+void bench_write(const char* file, const std::vector<bench_result>& results)
+{
+    static const char* isas[] = {"scalar", "sse2", "avx2", "avx512"};
+    FILE* f = std::fopen(file, "w");
+    if (!f) {
+        std::fprintf(stderr, "cannot write %s\n", file);
+        return;
+    }
+    std::fprintf(f, "{\n  \"isa\": \"%s\",\n  \"compiler\": \"%s\",\n"
+        "  \"policy\": \"%s\",\n  \"threads\": %d,\n  \"results\": [\n",
+        isas[vec_simd_isa()], __VERSION__,
+        vec_exec_default() == vec_exec::par ? "par" : "seq",
+        vec_par_threads());
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result& r = results[i];
+        std::fprintf(f, "    {\"name\": \"%s\", \"type\": \"%s\", "
+            "\"bytes\": %ld, \"n\": %d, \"ns_per_elem\": %.4f, "
+            "\"gb_per_s\": %.3f}%s\n", r.name.c_str(), r.type.c_str(),
+            r.bytes, r.n, r.ns, r.gbs, i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(f, "  ]\n}\n");
+    std::fclose(f);
+}
+
+int main(int argc, char** argv)
+{
+    bench_options opt = {nullptr, nullptr, nullptr, 64l << 20};
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "-p")
+            vec_exec_default() = vec_exec::par;
+        else if (i + 1 < argc && arg == "-o")
+            opt.out = argv[++i];
+        else if (i + 1 < argc && arg == "-c")
+            opt.compare = argv[++i];
+        else if (i + 1 < argc && arg == "-f")
+            opt.filter = argv[++i];
+        else if (i + 1 < argc && arg == "-m")
+            opt.max_bytes = std::atol(argv[++i]);
+        else {
+            std::fprintf(stderr, "usage: %s [-o out.json] [-c old.json] "
+                "[-f filter] [-m max_bytes] [-p]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<bench_result> results;
+    bench_type<double>("double", bench_float_cases<double>(), opt, results);
+    bench_type<float>("float", bench_float32_cases<float>(), opt, results);
+    bench_type<int>("int", bench_int_cases<int>(), opt, results);
+
+    if (opt.out)
+        bench_write(opt.out, results);
+    if (opt.compare)
+        bench_compare(opt.compare, results);
+    return 0;
+}
@@ -2,12 +2,35 @@
 
 #include <assert.h>
 #include <complex.h>
+#include <locale.h>
 
 template <typename T>
 void print(T n) {std::cout << n << std::endl;};
 
 void run_tests();
 
+#ifdef VEC_INSTRUMENT
+const bool vec_instrumented = true;
+#else
+const bool vec_instrumented = false;
+#endif
+
+#ifdef VEC_PROFILE
+const bool vec_profiled = true;
+#else
+const bool vec_profiled = false;
+#endif
+
+// Switch LC_NUMERIC to a locale with a decimal comma, false if none is
+//   installed
+bool set_comma_locale()
+{
+    for (const char* name : {"de_DE.UTF-8", "fr_FR.UTF-8", "de_DE", "fr_FR"})
+        if (setlocale(LC_NUMERIC, name))
+            return true;
+    return false;
+}
+
 int main()
 {
 
@@ -77,6 +100,46 @@ void run_tests()
     vi.append(vi3);
     assert(vi.str() == "<5, 4, 4, 9, 8>");
 
+    // Capacity
+    vi3.reserve(10);
+    assert(vi3.capacity() == 10 && vi3.size() == 0);
+    for (int i = 0; i < 100; i++)
+        vi3.append(i);
+    assert(vi3.size() == 100 && vi3.capacity() >= 100);
+    assert(sum(vi3) == 4950);
+    vi3.shrink_to_fit();
+    assert(vi3.capacity() == 100 && vi3[-1] == 99);
+    assert(vi3.emplace(7) == 7 && vi3.size() == 101);
+    vec<float, vec_aligned_allocator<float>> va{1, 2, 3};
+    assert(reinterpret_cast<uintptr_t>(va.data()) % 64 == 0);
+    const vec<float, vec_aligned_allocator<float>>& vaconst = va;
+    assert(vaconst.data() == va.data() && vaconst[2] == 3);
+    vec<double, vec_hugepage_allocator<double>> vhsmall{1};
+    assert(reinterpret_cast<uintptr_t>(vhsmall.data()) % 64 == 0);
+    for (int i = 0; i < 1000; i++)
+        va.append(i);
+    assert(reinterpret_cast<uintptr_t>(va.data()) % 64 == 0);
+    vec<float> vsum = va + vec<float>(va * 2);
+    assert(sum(vsum) == 3 * sum(va) && va.take(va < 2.5f).size() == 5);
+    vec<double, vec_hugepage_allocator<double>> vh = vec<double>::range(1 << 19);
+    vh.append(1);
+    assert(reinterpret_cast<uintptr_t>(vh.data()) % 64 == 0);
+    assert(sum(vh) == 137438691329.0 && vh.capacity() == (1 << 20));
+    vec<int> vsmall{0, 1};
+    assert(vsmall.capacity() == vec_inline_capacity<int>::value);
+    vec<int> vmoved(std::move(vsmall));
+    assert(vmoved.str() == "<0, 1>" && vsmall.size() == 0);
+    for (int i = 2; i < 20; i++)
+        vmoved.append(i);
+    vsmall = vmoved.head(3);
+    vmoved.pop(17);
+    vmoved.shrink_to_fit();
+    assert(vsmall.str() == "<0, 1, 2>" && vmoved.str() == "<0, 1, 2>");
+    vec<vec<int>> vvi;
+    vvi.emplace(vec<int>{1, 2});
+    vvi.emplace(3);
+    assert(vvi.str() == "<<1, 2>, <>>");
+
     // Indexing
     assert(vi[0] == 5);
     assert(vi[-1] == 8);
@@ -106,6 +169,8 @@ void run_tests()
     auto square = [](int i){return i*i;};
     vi.apply(square);
     assert(vi.str() == "<4, 16, 36>");
+    assert(&vi.apply(square) == &vi && vi[0] == 16);
+
 
 
     // Operators
@@ -120,6 +185,50 @@ void run_tests()
 
     // Vectorized functions
     assert(abs(vec<int>{-1, 0, 1}).str() == "<1, 0, 1>");
+    vec<double> vmath = (vec<double>::range(1000) - 500) * 0.037;
+    vec<float> vmf = vmath;
+    vec<double> vexact[] = {exp(vmath), log(abs(vmath)), sin(vmath), tan(vmath), tanh(vmath), atan(vmath), cbrt(vmath)};
+    vec<float> vexactf[] = {exp(vmf), log(abs(vmf)), sin(vmf), tan(vmf), tanh(vmf), atan(vmf), cbrt(vmf)};
+    vec_math_mode() = vec_math::fast;
+    vec<double> vfast[] = {exp(vmath), log(abs(vmath)), sin(vmath), tan(vmath), tanh(vmath), atan(vmath), cbrt(vmath)};
+    vec<float> vfastf[] = {exp(vmf), log(abs(vmf)), sin(vmf), tan(vmf), tanh(vmf), atan(vmf), cbrt(vmf)};
+    for (int i = 0; i < 7; i++) {
+        assert(max(abs(vfast[i] - vexact[i]) / (abs(vexact[i]) + 1e-300)) < 1e-15);
+        assert(max(abs(vfastf[i] - vexactf[i]) / (abs(vexactf[i]) + 1e-30f)) < 1e-6f);
+    }
+    vec<double> vnear;                  // Items next to n pi/2, where r cancels
+    vec<float> vnearf;
+    for (int k = 1; k < 667000; k += 7)
+        for (int j = -1; j <= 1; j++) {
+            const double x = k * 1.5707963267948966;
+            vnear.append(j ? std::nextafter(x, j * INFINITY) : x);
+            if (k < 652)
+                vnearf.append(j ? std::nextafter(float(x), j * INFINITY) : float(x));
+        }
+    const int math_isa = vec_simd_isa();
+    for (int isa = VEC_ISA_SSE2; isa <= math_isa; isa++) {
+        vec_simd_isa() = isa;
+        vec_math_mode() = vec_math::exact;
+        vec<double> vnexact[] = {sin(vnear), cos(vnear), tan(vnear)};
+        vec<float> vnexactf[] = {sin(vnearf), cos(vnearf), tan(vnearf)};
+        vec_math_mode() = vec_math::fast;
+        vec<double> vnfast[] = {sin(vnear), cos(vnear), tan(vnear)};
+        vec<float> vnfastf[] = {sin(vnearf), cos(vnearf), tan(vnearf)};
+        for (int i = 0; i < 3; i++) {
+            assert(max(abs(vnfast[i] - vnexact[i]) / abs(vnexact[i])) < 1e-15);
+            assert(max(abs(vnfastf[i] - vnexactf[i]) / abs(vnexactf[i])) < 1e-6f);
+        }
+    }
+    vec_simd_isa() = math_isa;
+    vec<double> vspecial{0.0, -0.0, INFINITY, -INFINITY, 1e-310, 1e300};
+    vec<double> vlog = log(vspecial), vsin = sin(vspecial);
+    assert(exp(vspecial).str() == "<1, 1, inf, 0, 1, inf>");
+    assert(vlog[0] == -INFINITY && std::isnan(vlog[3]));
+    assert(vlog[-2] == std::log(1e-310) && vlog[-1] == std::log(1e300));
+    assert(std::signbit(vsin[1]) && std::isnan(vsin[2]));
+    assert(vsin[4] == 1e-310 && vsin[5] == std::sin(1e300));
+    assert(sqrt(vec<float>{4, 2}).str() == "<2, 1.41421>");
+    vec_math_mode() = vec_math::exact;
 
     // For Loop
     int count = 0;
@@ -218,6 +327,485 @@ void run_tests()
     assert(min(vi) == 1);
     assert(max(vf) == 3.5f);
     assert(min(vf) == -53.0f);
+    assert(argmax(vi) == 3);
+    assert(argmin(vf) == 2);
+    assert(argmax(vec<int>{3, 7, 1, 7}) == 1);
+    assert(argmin(vi * -1) == 3);
+
+    // Parallel execution
+    vec_par_threads() = 4;
+    vec_par_threshold() = 1000;
+    vec<int> vp = vec<int>::range(100000) % 1000 - 500;
+    vec<int> vp2(vec_exec::par, vp * 3 + 1);
+    assert(vp2.str() == vec<int>(vp * 3 + 1).str());
+    assert(sum(vec_exec::par, vp2) == sum(vp2));
+    assert(argmin(vec_exec::par, vp2) == argmin(vp2));
+    assert(vp.take(vec_exec::par, vp % 7 == 0).str() == vp.take(vp % 7 == 0).str());
+    vp2.apply(vec_exec::par, [](int i){return i / 2;});
+    assert(max(vec_exec::par, vp2) == 749);
+
+    // Scans
+    vec<int> vsc{3, 1, 4, 1, 5};
+    vec<double> vsp{1, 2, 3, 4};
+    assert(vsc.cumsum().str() == "<3, 4, 8, 9, 14>");
+    assert(vsp.cumprod().str() == "<1, 2, 6, 24>");
+    assert(vsc.exclusive_scan(10, vec_op_add()).str() == "<10, 13, 14, 18, 19>");
+    assert(vsc.scan([](int a, int b) {return a > b ? a : b;}).str() == "<3, 3, 4, 4, 5>");
+    assert(vec<float>().cumsum().size() == 0 && vsp.head(1).cumsum().str() == "<1>");
+    vec<int64_t> vs = vec<int64_t>::range(1, 300001);
+    vec<int64_t> vscan = vs.cumsum(vec_exec::par);
+    assert(vscan.str() == vs.cumsum().str() && vscan[-1] == 45000450001LL);
+    vec<int64_t> vex = vs.exclusive_scan(vec_exec::par, int64_t(5), vec_op_add());
+    assert(vex[0] == 5 && vex[-1] == vscan[-2] + 5 && vex[12345] == vscan[12344] + 5);
+    vec<int> vsi = vec<int>::range(200000) % 7;
+    vec<int> vsmax = vsi.scan(vec_exec::par, [](int a, int b) {return (a ^ b);});
+    assert(vsmax.str() == vsi.scan([](int a, int b) {return (a ^ b);}).str());
+    vec<double> vsd = vec<double>::range(100001) * 0.5;
+    assert(vsd.cumsum(vec_exec::par)[-1] == vsd.cumsum()[-1] && vsd.cumsum()[-1] == 2500025000.0);
+    vec<double> vsdx = vsd.exclusive_scan(vec_exec::par, 1.0, vec_op_add());
+    assert(vsdx[0] == 1 && vsdx[3] == 2.5 && vsdx[-1] == 2499975001.0);
+
+    // Widened sums
+    vec<int> vbig = vec<int>::range(1000) * 0 + 2000000000;
+    assert(sum<int64_t>(vbig) == 2000000000000LL);
+    assert(sum(vec<int>::range(5000)) == 12497500);
+
+    // Expressions
+    vi = vec<int>{1, 2, 3};
+    vi = vi * vi + vi;
+    assert(vi.str() == "<2, 6, 12>");
+    assert(sum(vi * 2 - 1) == 37);
+    assert(max(vi - 20) == -8);
+    assert(vi.take(vi % 4 == 2 && vi > 2).str() == "<6>");
+    vec<double> vd = sqrt(vec<double>{4, 9}) * 2;
+    assert(vd.str() == "<4, 6>");
+    vec<float> vfi = vec<int>{1, 2} + 1;
+    assert(vfi.str() == "<2, 3>");
+    bool threw = false;
+    try { sum(vi + vec<int>{1}); } catch (std::out_of_range&) { threw = true; }
+    assert(threw);
+
+    // Pipelines
+    vec<int> vq = vec<int>::range(1, 100);
+    auto vpipe = vq.pipe().map(square).filter([](int x) {return x % 2 == 0;});
+    assert(vpipe.sum() == 171700 && vpipe.count() == 50);
+    assert(vpipe.map([](int x) {return x / 4.0;}).collect().head(3).str() == "<1, 4, 9>");
+    assert(vq.pipe().reduce(1.0, std::multiplies<double>()) > 9.3e157 && vq.pipe().reduce(std::plus<int>()) == 5050);
+    assert(vq.pipe().filter([](int x) {return x > 100;}).reduce(int64_t(1), std::multiplies<int64_t>()) == 1);
+    assert((vq * 2).pipe().map([](int x) {return x + 0.5;}).sum() == 10150);
+    threw = false;
+    try { vq.pipe().filter([](int x) {return x > 100;}).reduce(std::plus<int>()); } catch (std::out_of_range&) { threw = true; }
+    assert(threw);
+    vec<double> vpbig = vec<double>::range(200000);
+    auto vpbigpipe = vpbig.pipe(vec_exec::par).filter([](double x) {return int(x) % 3 == 0;});
+    assert(vpbigpipe.count() == 66667 && vpbigpipe.sum() == 6666633333.0);
+    assert(vpbigpipe.reduce(-1.0, [](double a, double b) {return a > b ? a : b;}) == 199998);
+    vec<double> vpcol = vpbigpipe.map([](double x) {return -x;}).collect();
+    assert(vpcol.size() == 66667 && vpcol[1] == -3 && vpcol[-1] == -199998);
+    std::atomic<int> vpseen(0);
+    vpbigpipe.for_each([&](double) {vpseen++;});
+    assert(vpseen == 66667);
+
+    // Sorting
+    vec<int> vso{5, -3, 9, 0, -3, 7};
+    assert(vso.argsort().str() == "<1, 4, 3, 0, 5, 2>");
+    assert(vso.sort().str() == "<-3, -3, 0, 5, 7, 9>");
+    vec<double> vsod{2.5, -0.0, -INFINITY, 1e-300, -1e300, 0.0};
+    assert(vsod.sort().str() == "<-inf, -1e+300, -0, 0, 1e-300, 2.5>");
+    vec<std::string> vsos{"pear", "apple", "fig", "apple"};
+    assert(vsos.argsort(vec_exec::seq, vec_sort::stable).str() == "<1, 3, 2, 0>");
+    assert(vsos.sort().str() == "<apple, apple, fig, pear>");
+    vec<int> vsok{3, 1, 2};
+    vec<double> vsov{30, 10, 20};
+    assert(vsov.sort_by_key(vsok).str() == "<10, 20, 30>" && vsok.str() == "<3, 1, 2>");
+    assert(vsov.gather(vec<int>{2, -1, 0}).str() == "<30, 30, 10>");
+    threw = false;
+    try { vsov.gather(vec<int>{3}); } catch (std::out_of_range&) { threw = true; }
+    assert(threw);
+    vec<int64_t> vsobig = (vec<int64_t>::range(200000) * 7919) % 100003 - 50000;
+    vec<int> vsoidx = vsobig.argsort(vec_exec::par);
+    vec<int64_t> vsosorted = vsobig.gather(vsoidx);
+    for (int i = 1; i < vsosorted.size(); i++)
+        assert(vsosorted[i-1] < vsosorted[i] || (vsosorted[i-1] == vsosorted[i] && vsoidx[i-1] < vsoidx[i]));
+    assert(vsobig.sort(vec_exec::par).str() == vsosorted.str());
+    vec<float> vsof = sin(vec<float>::range(100000));
+    vec<float> vsof2 = vsof;
+    vsof.sort(vec_exec::par);
+    std::sort(vsof2.data(), vsof2.data() + vsof2.size());
+    assert(vsof.str() == vsof2.str());
+    vec<std::string> vsosbig;
+    for (int i = 0; i < 50000; i++)
+        vsosbig.append(std::to_string(i * 7 % 1000));
+    vec<int> vsosi = vsosbig.argsort(vec_exec::par, vec_sort::stable);
+    for (int i = 1; i < vsosi.size(); i++)
+        assert(vsosbig[vsosi[i-1]] < vsosbig[vsosi[i]] || vsosi[i-1] < vsosi[i]);
+    vsosbig.sort(vec_exec::par);
+    assert(vsosbig[0] == "0" && vsosbig[-1] == "999" && vsosbig[49] == "0" && vsosbig[50] == "1");
+
+    // Statistics
+    vec<double> vst{2, 4, 4, 4, 5, 5, 7, 9};
+    assert(mean(vst) == 5 && var(vst) == 4 && stddev(vst) == 2);
+    assert(std::fabs(skew(vst) - 0.65625) < 1e-12);
+    assert(median(vst) == 4.5 && quantile(vst, 0.25) == 4 && quantile(vst, 1) == 9);
+    assert(mode(vst) == 4 && mode(vst * 2) == 8 && median(vst + 1) == 5.5);
+    vec<int> vsti{3, 1, 3, 1, 2};
+    assert(mode(vsti) == 3 && median(vsti) == 2 && mean(vsti) == 2);
+    vec<double> vbigmean = vec<int>::range(100000) % 10 + 1e9;
+    assert(std::fabs(var(vec_exec::par, vbigmean) - 8.25) < 1e-6 && std::fabs(var(vbigmean) - 8.25) < 1e-6);
+    vec<int> vmodes = vec<int>::range(300000) % 100000;
+    vmodes.append(77777);
+    assert(mode(vmodes) == 77777 && mode(vmodes.head(300000)) == 0);
+    vec_stats vdesc = describe(vec_exec::par, vbigmean);
+    assert(vdesc.count == 100000 && vdesc.min == 1e9 && vdesc.max == 1e9 + 9);
+    assert(vdesc.median == 1e9 + 4.5 && vdesc.q25 == 1e9 + 2 && vdesc.q75 == 1e9 + 7);
+    assert(vdesc.mode == 1e9 && std::fabs(vdesc.skew) < 1e-9 && std::fabs(vdesc.mean - mean(vbigmean)) < 1e-6);
+    assert((std::isnan(median(vec<double>{1, NAN, 3})) && mode(vec<double>{NAN, -0.0, 0.0, 1}) == 0));
+    threw = false;
+    try { mean(vec<int>()); } catch (std::out_of_range&) { threw = true; }
+    assert(threw);
+    threw = false;
+    try { quantile(vst, 1.5); } catch (std::invalid_argument&) { threw = true; }
+    assert(threw);
+    vec<double> vrx{1, 2, 3, 4, 5}, vry{2, 4, 5, 4, 5};
+    vec_fit vfit = regression(vrx, vry);
+    assert(std::fabs(vfit.slope - 0.6) < 1e-12 && std::fabs(vfit.intercept - 2.2) < 1e-12 && std::fabs(vfit.r2 - 0.6) < 1e-12);
+    assert(std::fabs(cov(vrx, vry) - 1.2) < 1e-12 && std::fabs(corr(vrx, vry) - std::sqrt(0.6)) < 1e-12);
+    assert(cov(vrx, vrx) == var(vrx) && corr(vrx, vrx * -2 + 1) == -1 && std::isnan(regression(vry * 0, vrx).slope));
+    vec<int> vrbig = vec<int>::range(300000);
+    vec_fit vfbig = regression(vec_exec::par, vrbig, vrbig * 3.0 + 1e9 + vrbig % 2);
+    assert(std::fabs(vfbig.slope - 3) < 1e-9 && std::fabs(vfbig.intercept - 1e9 - 0.5) < 1e-3 && vfbig.r2 > 0.999999);
+    assert(std::fabs(cov(vec_exec::par, vrbig, vrbig % 2) - cov(vrbig, vrbig % 2)) < 1e-9);
+    threw = false;
+    try { corr(vrx, vry.head(3)); } catch (std::out_of_range&) { threw = true; }
+    assert(threw);
+
+    // Linear algebra, exact on small integers for every instruction set
+    vec<double> vla = vec<double>::range(-50, 53), vlb = vla * 2 - 7;
+    vec<float> vlf = vec<float>::range(-50, 53);
+    vec<int> vli{3, -4};
+    const int la_isa = vec_simd_isa();
+    for (int isa = VEC_ISA_SCALAR; isa <= la_isa; isa++) {
+        vec_simd_isa() = isa;
+        assert(dot(vla, vlb) == 186836 && dot(vlf, vlf) == 93964 && dot(vla, vlb + 0) == 186836);
+        assert(norm1(vla) == 2706 && norm1(vlf.slice(0, 7)) == 329 && norminf(vla) == 53 && norminf(vlf * -1) == 53);
+        assert(norm2(vlf) == std::sqrt(93964.0f) && norm2(vli) == 5 && norm1(vli) == 7 && dot(vli, vli) == 25);
+        vec<double> vly = vlb;
+        assert(axpy(-2, vla, vly).str() == vec<double>(vla * 0 - 7).str());
+        assert(scal(3, axpy(2, vla, vly)).str() == vec<double>(vla * 6 - 21).str());
+        vec<double> vlnan{1, -3, NAN, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+        assert(std::isnan(norminf(vlnan)) && std::isnan(norm2(vlnan)) && norminf(vec<float>()) == 0);
+    }
+    vec_simd_isa() = la_isa < VEC_ISA_AVX2 ? la_isa : int(VEC_ISA_AVX2);
+    const bool la_fma = vec_simd_fma();
+    vec_simd_fma() = false;
+    assert(dot(vla, vlb) == 186836 && norm1(vla) == 2706 && norm2(vli) == 5);
+    vec_simd_fma() = la_fma;
+    vec_simd_isa() = la_isa;
+    assert(norm2(vec<double>{3e200, -4e200}) == std::hypot(3e200, 4e200) && norm2(vec<float>{3e-30f, 4e-30f}) == std::hypot(3e-30f, 4e-30f));
+    assert(norm2(vec<double>{INFINITY, 1}) == INFINITY && norm2(vec<double>{0, 0, 0}) == 0);
+    assert(norminf(vec<int>{INT_MIN, 1}) == 2147483648u && norm1(vec<int>{INT_MIN, -5}) == 2147483653u);
+    assert(norminf(vec<long long>{LLONG_MIN}) == 9223372036854775808ull && norm2(vec<int>{INT_MIN}) == 2147483648.0);
+    vec<double> vlbig = vec<int>::range(200000) % 7 - 3;
+    assert(dot(vec_exec::par, vlbig, vlbig) == dot(vlbig, vlbig) && norm1(vec_exec::par, vlbig) == 342858);
+    assert(norminf(vec_exec::par, vlbig) == 3 && norm2(vec_exec::par, vlbig) == norm2(vlbig));
+    vec<double> vlhuge = vlbig * 1e300;
+    assert(std::fabs(norm2(vec_exec::par, vlhuge) / norm2(vlbig) - 1e300) < 1e288);
+    vec<double> vlrev = vec<double>::range(8);
+    assert(axpy(1, vlrev.slice(7, -9, -1), vlrev).str() == "<7, 7, 7, 7, 7, 7, 7, 7>");
+    assert(axpy(2, vlrev, vlrev).str() == "<21, 21, 21, 21, 21, 21, 21, 21>");
+    vec<double> vlbig2 = vlbig;
+    scal(vec_exec::par, 2, axpy(vec_exec::par, 1, vlbig, vlbig2));
+    assert(vlbig2.str() == vec<double>(vlbig * 4).str());
+    threw = false;
+    try { dot(vla, vlb.head(3)); } catch (std::out_of_range&) { threw = true; }
+    assert(threw);
+
+    // Views
+    vec<int> vw = vec<int>::range(10);
+    assert(vw.slice(2, 5).str() == "<2, 3, 4>" && sum(vw.slice(2, 5)) == 9);
+    assert(vw.slice(-3, INT_MAX).str() == "<7, 8, 9>");
+    assert(vw.slice(8, 2, -3).str() == "<8, 5>");
+    assert(vw.slice(0, 10, 2).slice(1, 3).str() == "<2, 4>");
+    assert((vw.slice(0, 5) * vw.slice(INT_MAX, 4, -1)).str() == "<0, 8, 14, 18, 20>");
+    assert(argmax(vw.slice(INT_MAX, INT_MIN, -1)) == 0 && max(sqrt(vw.view())) == 3);
+    vw.slice(0, 3)[-1] = 20;
+    assert(vw[2] == 20 && vw.take(vw.slice(0, 10) > 8).str() == "<20, 9>");
+
+    // Binary files
+    vec<double> vdisk = vec<double>::range(5000) * 0.25;
+    vdisk.save("testfile.vec");
+    vec<double> vmap = vec<double>::mmap_open("testfile.vec");
+    assert(vmap.size() == 5000 && sum(vmap) == sum(vdisk) && vmap[-1] == 1249.75);
+    vmap.append(1);
+    assert(vmap.size() == 5001 && vmap[4999] == 1249.75);
+    threw = false;
+    try { vec<int>::mmap_open("testfile.vec"); } catch (std::runtime_error&) { threw = true; }
+    assert(threw);
+
+    // Formatting
+    vec<double> vfmt{0.1, 1.0 / 3, -2.5, 1e20};
+    assert(vfmt.str() == "<0.1, 0.333333, -2.5, 1e+20>");
+    assert(vfmt.str(vec_format::csv()) == "0.1,0.3333333333333333,-2.5,1e+20\n");
+    assert(vfmt.str(vec_format(" ", 3, "[", "]")) == "[0.1 0.333 -2.5 1e+20]");
+    assert((vec<int>{INT_MIN, -1, 0, 99, INT_MAX}).str() == "<-2147483648, -1, 0, 99, 2147483647>");
+    assert((vec<char>{'a', 'b'}).str(vec_format("", 0, "", "")) == "ab");
+    std::ostringstream vos;
+    vos << vec<int>::range(3000) << vw.slice(0, 4, 2);
+    assert(vos.str().size() == 16897 && vos.str().substr(16885) == "2999><0, 20>");
+    FILE* vtmp = tmpfile();
+    vfmt.write_to(vtmp, vec_format::csv());
+    char vline[64] = {0};
+    rewind(vtmp);
+    assert(fgets(vline, sizeof vline, vtmp) && vfmt.str(vec_format::csv()) == vline);
+    fclose(vtmp);
+    vec<double> vsub{5e-324, -2.5e-320, 2.2250738585072014e-308};
+    assert(vsub.str(vec_format::csv()) == "5e-324,-2.5e-320,2.2250738585072014e-308\n");
+    assert((vec<float>{1e-45f, 0.1f}).str(vec_format::csv()) == "1e-45,0.1\n");
+    if (set_comma_locale()) {
+        assert(vfmt.str() == "<0.1, 0.333333, -2.5, 1e+20>");
+        assert(vfmt.str(vec_format::csv()) == "0.1,0.3333333333333333,-2.5,1e+20\n");
+        setlocale(LC_NUMERIC, "C");
+    }
+
+    // Text parsing
+    assert(vec<int>::parse("1, -2,3\n+4\t2147483647 -2147483648").str()
+        == "<1, -2, 3, 4, 2147483647, -2147483648>");
+    assert(vec<double>::parse(" 0.5,-1e3 .25\r\n1e400 ").str() == "<0.5, -1000, 0.25, inf>");
+    assert(vec<double>::parse("  ,\n").size() == 0);
+    for (const char* bad : {"2147483648", "1x", "--1", "1.5"}) {
+        threw = false;
+        try { vec<int>::parse(bad); } catch (std::invalid_argument&) { threw = true; }
+        assert(threw);
+    }
+    for (const char* bad : {"0x10", "0x1p3", "1e", ".", "-", "infx", "nan("}) {
+        threw = false;
+        try { vec<double>::parse(bad); } catch (std::invalid_argument&) { threw = true; }
+        assert(threw);
+    }
+    const char* vlong = "1.5e300 -Infinity +inf nan(0) 0.1000000000000000055511151231257827 1e-320";
+    const std::string vlongs = vec<double>::parse(vlong).str(vec_format::csv());
+    assert(vlongs == "1.5e+300,-inf,inf,nan,0.1,1e-320\n");
+    if (set_comma_locale()) {
+        assert(vec<double>::parse(vlong).str(vec_format::csv()) == vlongs);
+        assert(vec<float>::parse("1.25 3.4e38 1e-40").str(vec_format::csv()) == "1.25,3.4e+38,1e-40\n");
+        threw = false;
+        try { vec<double>::parse("0x10"); } catch (std::invalid_argument&) { threw = true; }
+        assert(threw);
+        setlocale(LC_NUMERIC, "C");
+    }
+    std::string vtext = vec<double>::range(100000).str(vec_format("\n", 0, "", "\n")) + "0.1";
+    vec<double> vparsed = vec<double>::parse(vec_exec::par, vtext);
+    assert(vparsed.size() == 100001 && vparsed[99999] == 99999 && vparsed[-1] == 0.1);
+    FILE* vtxt = fopen("testfile.txt", "w");
+    fputs(vtext.c_str(), vtxt);
+    fclose(vtxt);
+    assert(sum(vec<double>::load_text("testfile.txt")) == sum(vparsed));
+    std::remove("testfile.txt");
+
+    // Streams
+    vec_stream<double> sfile = vec_stream<double>::open("testfile.vec", 128);
+    assert(sum(sfile) == sum(vdisk) && max(sfile) == 1249.75 && min(sfile) == 0);
+    vec_stream<int> sgen = vec_stream<int>::generate(1000, [](int64_t i) {return int(i);}, 64);
+    assert(sum<int64_t>(sgen.map([](const vec<int>& c) {return c * 2;})) == 999000);
+    assert(sgen.take([](const vec<int>& c) {return c % 100 == 0;}).collect().str()
+        == "<0, 100, 200, 300, 400, 500, 600, 700, 800, 900>");
+    assert(prod(sgen.apply([](int x) {return x < 5 ? x + 1 : 1;})) == 120);
+    int sleft = 300;
+    vec_stream<int> scb = vec_stream<int>::callback([&](int* out, int n) {
+        n = std::min(n, sleft);
+        for (int i = 0; i < n; i++) out[i] = 1;
+        sleft -= n;
+        return n;
+    }, 100);
+    assert(sum(scb) == 300 && sum(scb) == 0);
+    sfile.map([](const vec<double>& c) {return c + 0.5;}).save("testfile2.vec");
+    assert(vec<double>::mmap_open("testfile2.vec")[-1] == 1250.25);
+    std::remove("testfile2.vec");
+    threw = false;
+    try { max(vec_stream<int>::generate(0, [](int64_t) {return 0;})); } catch (std::out_of_range&) { threw = true; }
+    assert(threw);
+    std::remove("testfile.vec");
+
+    // Compound assignment and temporaries
+    vec<int> vc = vec<int>::range(1, 5);
+    vc += 1;
+    vc *= vc;
+    vc -= vec<int>{1, 1, 1, 1, 1};
+    vc %= 7;
+    assert(vc.str() == "<3, 1, 1, 3, 0>");
+    vec<double> vt = vec<double>::range(100);
+    const double* vtbuf = vt.data();
+    vec<double> vt2 = std::move(vt) * 2 + 1;
+    assert(vt2.data() == vtbuf && vt2[99] == 199);
+    vt2 = 1 - std::move(vt2) / 2.0;
+    assert(vt2.data() == vtbuf && vt2[1] == -0.5);
+    vt = std::move(vt2);
+    assert(vt.data() == vtbuf && vt2.size() == 0);
+    vt2 = std::move(vt) + vt;
+    assert(vt2.data() == vtbuf && vt2[3] == -5);
+    vec<int> vrv = vec<int>{0, 1, 2, 3, 4, 5, 6, 7};
+    const int* vrvbuf = vrv.data();
+    vec<int> vrv2 = std::move(vrv) + vrv.slice(7, -9, -1);
+    assert(vrv2.str() == "<7, 7, 7, 7, 7, 7, 7, 7>" && vrv2.data() != vrvbuf);
+    vrv = vec<int>{0, 1, 2, 3, 4, 5, 6, 7};
+    vrv2 = vrv.slice(7, -9, -1) - std::move(vrv);
+    assert(vrv2.str() == "<7, 5, 3, 1, -1, -3, -5, -7>");
+    vec<double> vcs = vec<double>::range(1, 8);
+    vcs += vcs.slice(7, -9, -1);
+    assert(vcs.str() == "<9, 9, 9, 9, 9, 9, 9, 9>");
+    vcs = vec<double>::range(1, 8);
+    vcs -= vcs.slice(7, -9, -1);
+    assert(vcs.str() == "<-7, -5, -3, -1, 1, 3, 5, 7>");
+    vcs = vec<double>::range(1, 8);
+    vcs *= vcs.slice(7, -9, -1);
+    assert(vcs.str() == "<8, 14, 18, 20, 20, 18, 14, 8>");
+    vcs = vec<double>::range(1, 8);
+    vcs /= vcs.slice(7, -9, -1) * 0.5;
+    assert(vcs.str() == "<0.25, 0.571429, 1, 1.6, 2.5, 4, 7, 16>");
+    threw = false;
+    try { vc += vec<int>{1}; } catch (std::out_of_range&) { threw = true; }
+    assert(threw);
+
+    // Allocation counters, all 0 unless built with -DVEC_INSTRUMENT
+    vec_alloc_reset();
+    vec_alloc_reset_scopes();
+    int vhooked = 0;
+    vec_alloc_hook() = [&](vec_alloc_event e, size_t, const char* scope) {
+        vhooked += e == vec_alloc_event::alloc && scope && std::string(scope) == "inner";
+    };
+    {
+        vec_alloc_scope outer("outer");
+        vec<double> vx(1000);
+        vx.resize(1000);
+        vec<double> vy = vx;
+        {
+            vec_alloc_scope inner("inner");
+            vy = vx * 2 + vy;
+            vy.append(1);
+            assert(inner.stats().allocs == (vec_instrumented ? 2u : 0u));
+        }
+        assert(outer.stats().peak == (vec_instrumented ? 32000 : 0));
+    }
+    vec_alloc_hook() = nullptr;
+    vec_alloc_stats vas = vec_alloc_snapshot();
+    std::vector<std::pair<std::string, vec_alloc_stats>> vascopes = vec_alloc_scopes();
+    if (vec_instrumented) {
+        assert(vas.allocs == 4 && vas.frees == 4 && vas.reallocs == 1 && vas.copies == 1);
+        assert(vas.bytes == 40000 && vas.live == 0 && vas.peak == 32000 && vhooked == 2);
+        assert(vascopes.size() == 2 && vascopes[0].first == "inner" && vascopes[1].first == "outer");
+        assert(vascopes[0].second.live == 8000 && vascopes[0].second.peak == 16000);
+        assert(vascopes[1].second.allocs == 4 && vascopes[1].second.live == 0);
+    } else {
+        assert(vas.allocs == 0 && vas.peak == 0 && vascopes.empty() && vhooked == 0);
+    }
+    {
+        vec_alloc_scope vparscope("par");   // Counts the chunks run by workers
+        vec<int> vpa = vec<int>::range(40000);
+        vpa.apply(vec_exec::par, [](int i) {return i + vec<double>(100).size();});
+        assert(vpa[-1] == 39999 && vparscope.stats().frees == (vec_instrumented ? 40000u : 0u));
+        assert(vparscope.stats().allocs == (vec_instrumented ? 40001u : 0u));
+    }
+
+    // Profiler, empty unless built with -DVEC_PROFILE
+    vec_profile_reset();
+    vec<double> px;
+    for (int i = 0; i < 3000; i++)
+        px.append(1.5);
+    vec_profile_enabled() = true;
+    {
+        vec<double> py = px + px;
+        py = sin(px);
+        assert(sum(py) > 0 && mean(px) == 1.5);
+        assert(px.take(px > 1).size() == 3000);
+    }
+    vec_profile_enabled() = false;
+    vec<double> pz = px + 1;
+    std::vector<vec_profile_row> prows = vec_profile_results();
+    std::ostringstream preport, pjson;
+    vec_profile_report(preport);
+    vec_profile_json(pjson);
+    if (set_comma_locale()) {
+        std::ostringstream pjson2;
+        vec_profile_json(pjson2);
+        assert(pjson2.str() == pjson.str());
+        setlocale(LC_NUMERIC, "C");
+    }
+    if (vec_profiled) {
+        std::string pops;
+        for (const vec_profile_row& r : prows) {
+            pops += r.op + " ";
+            assert(r.stats.calls == 1 && r.stats.items == 3000);
+            assert(r.bucket == 2 && r.stats.seconds >= 0);
+        }
+        assert(pops == "add mean sin sum take ");
+        assert(preport.str().find("take") != std::string::npos);
+        assert(pjson.str().find("\"op\": \"sin\", \"size\": \"<4K\"") != std::string::npos);
+    } else {
+        assert(prows.empty() && pjson.str() == "[\n]\n");
+    }
+    assert(vec_profile_bucket(15) == 0 && vec_profile_bucket(4096) == 3);
+    assert(vec_profile_bucket(1 << 30) == 6);
+
+    // SIMD kernels agree with the scalar loop on every instruction set
+    vec<int> ka = vec<int>::range(-20, 20);
+    vec<double> kd = vec<double>::range(-5.0, 5.0, 0.25);
+    const int best_isa = vec_simd_isa();
+    vec_simd_isa() = VEC_ISA_SCALAR;
+    std::string ks = (ka * ka).str() + (ka - 3).str() + (ka + ka).str() + (ka >= 2).str()
+        + (kd / 2.0).str() + (kd != 1).str() + vec_mask(ka >= 2 && kd < 0).str()
+        + ka.take(ka % 3 != 0).str() + kd.take(vec_mask(kd > 1.5)).str();
+    for (int isa = VEC_ISA_SSE2; isa <= best_isa; isa++) {
+        vec_simd_isa() = isa;
+        assert(ks == (ka * ka).str() + (ka - 3).str() + (ka + ka).str() + (ka >= 2).str()
+            + (kd / 2.0).str() + (kd != 1).str() + vec_mask(ka >= 2 && kd < 0).str()
+            + ka.take(ka % 3 != 0).str() + kd.take(vec_mask(kd > 1.5)).str());
+    }
+
+    // A NaN is skipped by max, min, argmax and argmin unless it comes first
+    vec<double> kn, kn0;
+    for (int i = 0; i < 3000; i++)
+        kn.append(i % 7);
+    for (int i = 0; i < 100; i++)
+        kn0.append(i % 7);
+    kn[3] = 50;
+    kn[19] = NAN;
+    kn[1024] = NAN;
+    kn[1500] = -2;
+    kn0[0] = NAN;
+    kn0[5] = 50;
+    for (int isa = VEC_ISA_SCALAR; isa <= best_isa; isa++) {
+        vec_simd_isa() = isa;
+        assert(max(kn) == 50 && argmax(kn) == 3);
+        assert(min(kn) == -2 && argmin(kn) == 1500);
+        assert(std::isnan(max(kn0)) && std::isnan(min(kn0)));
+        assert(argmax(kn0) == 0 && argmin(kn0) == 0);
+    }
+    vec_simd_isa() = best_isa;
+    const int knchunks = vec_par_chunks(vec_exec::par, kn.size());
+    if (knchunks > 1)
+        kn[vec_chunk_begin(kn.size(), knchunks, 1)] = NAN;
+    assert(argmax(vec_exec::par, kn) == 3 && argmin(vec_exec::par, kn) == 1500);
+
+    // Bit masks
+    vi = vec<int>{1, 2, 3, 4, 5};
+    vec_mask m = vi > 2;
+    assert(m.size() == 5 && m.count() == 3);
+    assert(m.str() == "<0, 0, 1, 1, 1>");
+    assert(vi.take(m).str() == "<3, 4, 5>");
+    assert(vi.take(vec_mask(m && !(vi == 4))).str() == "<3, 5>");
+    assert(vi.take(vec_mask{true, false, false, false, true}).str() == "<1, 5>");
+    m.set(0, true);
+    assert(m[0] && !m[1] && m[-1] && m.count() == 4);
+    assert(vec_mask(!m).count() == 1);
+    vec<double> vm = vec<double>::range(1000) * 0.5;
+    vec_mask big = vm < 100.25 || vm >= 499;
+    assert(big.count() == 203 && big.words() == 16);
+    assert(vm.take(big).str() == vm.take(vm < 100.25 || vm >= 499).str());
+    assert(sum(vec<int>::range(10000).take(vec<int>::range(10000) % 2 == 1)) == 25000000);
+    assert(vp.take(vec_exec::par, vec_mask(vec_exec::par, vp % 7 == 0)).str()
+        == vp.take(vp % 7 == 0).str());
+    vi.apply_to(vec_mask(vi % 2 == 0), [](int i){return -i;});
+    assert(vi.str() == "<1, -2, 3, -4, 5>");
 
 
 
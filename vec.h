@@ -3,827 +3,7821 @@
 #include <string>
 #include <stdexcept>
 #include <math.h>
+#include <cmath>
 #include <sstream>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <climits>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <limits>
+#include <chrono>
+#if __cplusplus >= 201703L
+#include <charconv>
+#include <string_view>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VEC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#define VEC_C_LOCALE
+#include <locale.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+#endif
+
+#if defined(VEC_PROFILE) && defined(__linux__)
+#define VEC_PERF
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if !defined(VEC_NO_SIMD) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define VEC_SIMD
+#include <immintrin.h>
+#endif
+
+
+
+template <typename T, typename A = std::allocator<T>>
+class vec;
+template <typename T>
+class vec_view;
+class vec_mask;
+struct vec_format;
+struct vec_pipe_source;
+template <typename E, typename Step>
+class vec_pipe;
+
+// Whether sort() must keep equal items in their order. Numbers are always
+//   sorted stably, see Sorting
+enum class vec_sort {
+    fast,
+    stable
+};
+
+#ifdef VEC_C_LOCALE
+// The "C" locale, for number text that does not depend on LC_NUMERIC
+inline locale_t vec_c_locale()
+{
+    static const locale_t loc = newlocale(LC_ALL_MASK, "C", locale_t(0));
+    return loc;
+}
+#endif
+
+// Switches the calling thread to the "C" locale while in scope, so that
+//   printf() and strtod() write and read '.' as the decimal point
+class vec_c_numeric {
+public:
+#ifdef VEC_C_LOCALE
+    vec_c_numeric() : old_(vec_c_locale() ? uselocale(vec_c_locale()) : 0) {}
+    ~vec_c_numeric() {if (old_) uselocale(old_);}
+private:
+    locale_t old_;
+#endif
+};
+
+
+
+////////////////////////
+// Parallel Execution //
+////////////////////////
+
+// Evaluation of expressions, take(), apply() and the reductions can be
+//   split into chunks and run on a work-stealing thread pool. It is off by
+//   default: turn it on for every call with
+//
+//     vec_exec_default() = vec_exec::par;
+//
+//   or for a single call by passing the policy first, e.g.
+//   sum(vec_exec::par, v) or vec<double> w(vec_exec::par, sin(v)).
+//   Vecs shorter than vec_par_threshold() always run serially.
+
+enum class vec_exec {
+    seq,
+    par
+};
+
+inline vec_exec& vec_exec_default()
+{
+    static vec_exec policy = vec_exec::seq;
+    return policy;
+}
+
+// Minimum number of elements worth splitting across threads
+inline int& vec_par_threshold()
+{
+    static int threshold = 1 << 15;
+    return threshold;
+}
+
+// Number of threads (including the caller) the pool is created with.
+//   Only read when the pool is first used
+inline int& vec_par_threads()
+{
+    static int threads = std::thread::hardware_concurrency() > 0
+        ? std::thread::hardware_concurrency() : 1;
+    return threads;
+}
+
+class vec_alloc_scope;
+
+// The innermost open vec_alloc_scope of the calling thread. Under
+//   VEC_INSTRUMENT a chunk run on the pool takes over the one of the
+//   thread that started it
+inline vec_alloc_scope*& vec_alloc_current()
+{
+    static thread_local vec_alloc_scope* scope = nullptr;
+    return scope;
+}
+
+// Each worker owns a deque of chunks. It runs its own chunks newest
+//   first and steals the oldest chunks of the others when it runs out.
+//   The thread waiting on a batch steals too, so nested parallel calls
+//   from inside a chunk cannot deadlock.
+class vec_thread_pool {
+public:
+    // A set of chunks started by one call
+    struct batch {
+        void (*run)(const void* ctx, int c);
+        const void* ctx;
+        vec_alloc_scope* scope;
+        std::atomic<int> remaining;
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    static vec_thread_pool& instance()
+    {
+        static vec_thread_pool pool(vec_par_threads() - 1);
+        return pool;
+    }
+
+    int threads() const {return static_cast<int>(workers_.size()) + 1;};
+
+    // Run chunks 0..chunks-1 of `b` and wait for all of them
+    void run(batch& b, int chunks)
+    {
+        b.remaining = chunks;
+        b.scope = vec_alloc_current();
+        const int self = worker_id();
+        const int nq = static_cast<int>(queues_.size());
+        for (int c = 0; c < chunks; c++) {
+            queue& q = *queues_[self >= 0 ? self : c % nq];
+            std::lock_guard<std::mutex> lk(q.m);
+            q.tasks.push_back(task{&b, c});
+        }
+        {
+            std::lock_guard<std::mutex> lk(idle_mutex_);
+            pending_ += chunks;
+        }
+        idle_cv_.notify_all();
+
+        while (b.remaining.load(std::memory_order_acquire) > 0) {
+            task t;
+            if (pop(self, t))
+                execute(t);
+            else
+                std::this_thread::yield();
+        }
+
+        if (b.error)
+            std::rethrow_exception(b.error);
+    }
+
+    ~vec_thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(idle_mutex_);
+            stop_ = true;
+        }
+        idle_cv_.notify_all();
+        for (size_t i = 0; i < workers_.size(); i++)
+            workers_[i].join();
+    }
+
+private:
+    struct task {
+        batch* b;
+        int c;
+    };
+
+    struct queue {
+        std::mutex m;
+        std::deque<task> tasks;
+    };
+
+    explicit vec_thread_pool(int workers) : pending_(0), stop_(false)
+    {
+        for (int i = 0; i < workers; i++)
+            queues_.emplace_back(new queue);
+        for (int i = 0; i < workers; i++)
+            workers_.emplace_back(&vec_thread_pool::work, this, i);
+    }
+
+    // Index of the calling worker, -1 for other threads
+    static int& worker_id()
+    {
+        static thread_local int id = -1;
+        return id;
+    }
+
+    bool pop(int self, task& t)
+    {
+        const int nq = static_cast<int>(queues_.size());
+        if (self >= 0) {
+            queue& q = *queues_[self];
+            std::lock_guard<std::mutex> lk(q.m);
+            if (!q.tasks.empty()) {
+                t = q.tasks.back();
+                q.tasks.pop_back();
+                pending_--;
+                return true;
+            }
+        }
+        for (int i = 1; i <= nq; i++) {
+            queue& q = *queues_[(self + i + nq) % nq];
+            std::lock_guard<std::mutex> lk(q.m);
+            if (!q.tasks.empty()) {
+                t = q.tasks.front();
+                q.tasks.pop_front();
+                pending_--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(const task& t)
+    {
+#ifdef VEC_INSTRUMENT
+        vec_alloc_scope* const own = vec_alloc_current();
+        vec_alloc_current() = t.b->scope;
+#endif
+        try {
+            t.b->run(t.b->ctx, t.c);
+        } catch (...) {
+            std::lock_guard<std::mutex> lk(t.b->error_mutex);
+            if (!t.b->error)
+                t.b->error = std::current_exception();
+        }
+#ifdef VEC_INSTRUMENT
+        vec_alloc_current() = own;
+#endif
+        t.b->remaining.fetch_sub(1, std::memory_order_release);
+    }
+
+    void work(int self)
+    {
+        worker_id() = self;
+        for (;;) {
+            task t;
+            if (pop(self, t)) {
+                execute(t);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lk(idle_mutex_);
+            idle_cv_.wait(lk, [this]{return stop_ || pending_ > 0;});
+            if (stop_ && pending_ == 0)
+                return;
+        }
+    }
+
+    std::vector<std::unique_ptr<queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    std::atomic<int> pending_;   // Chunks queued but not yet taken
+    bool stop_;
+};
+
+// Number of chunks to split `n` elements into, 1 to run serially
+inline int vec_par_chunks(vec_exec policy, int n)
+{
+    if (policy != vec_exec::par || n < vec_par_threshold())
+        return 1;
+
+    const int threads = vec_thread_pool::instance().threads();
+    const int min_chunk = 4096;
+    int chunks = 4 * threads;
+    if (chunks > n / min_chunk)
+        chunks = n / min_chunk;
+    return threads > 1 && chunks > 1 ? chunks : 1;
+}
+
+// First element of chunk `c`
+inline int vec_chunk_begin(int n, int chunks, int c)
+{
+    return static_cast<int>(static_cast<int64_t>(n) * c / chunks);
+}
+
+// Call fn(c) for every chunk 0..chunks-1 on the pool
+template <typename Fn>
+void vec_parallel_for(int chunks, const Fn& fn)
+{
+    if (chunks <= 1) {
+        fn(0);
+        return;
+    }
+
+    vec_thread_pool::batch b;
+    b.run = [](const void* ctx, int c) {(*static_cast<const Fn*>(ctx))(c);};
+    b.ctx = &fn;
+    vec_thread_pool::instance().run(b, chunks);
+}
+
+
+
+
+
+///////////////
+// Profiling //
+///////////////
+
+// Build with -DVEC_PROFILE and set vec_profile_enabled() to time the
+//   operators, VECTORIZE_FN functions, reductions and take(). On Linux
+//   each operation also reads the CPU cycles, instructions, cache misses
+//   and branch misses of its thread through perf_event_open. Results are
+//   grouped by operation and by size, in powers of 16 items:
+//
+//     vec_profile_enabled() = true;
+//     run_workload();
+//     vec_profile_report(std::cout);       // Or vec_profile_json()
+//
+// Counters the system does not give (virtual machines often have none,
+//   and /proc/sys/kernel/perf_event_paranoid may forbid them) are left
+//   out; calls and time are always there. When an operation runs another
+//   one, only the outer one is counted, and under vec_exec::par only the
+//   calling thread's share of the counters. Reading the counters costs
+//   about a microsecond per operation, which swamps small ones. Without
+//   VEC_PROFILE nothing is measured and the hooks compile to nothing.
+
+enum {
+    VEC_PERF_CYCLES,
+    VEC_PERF_INSTRUCTIONS,
+    VEC_PERF_CACHE_MISSES,
+    VEC_PERF_BRANCH_MISSES,
+    VEC_PERF_COUNTERS
+};
+
+struct vec_profile_stats {
+    uint64_t calls, items;
+    double seconds;
+    uint64_t counters[VEC_PERF_COUNTERS];
+    unsigned valid;         // Bit k is set when counter k was read
+
+    vec_profile_stats() : calls(0), items(0), seconds(0), valid(0)
+    {
+        for (int k = 0; k < VEC_PERF_COUNTERS; k++)
+            counters[k] = 0;
+    }
+};
+
+// One operation at one size bucket
+struct vec_profile_row {
+    std::string op;
+    int bucket;
+    vec_profile_stats stats;
+};
+
+inline bool& vec_profile_enabled()
+{
+    static bool enabled = false;
+    return enabled;
+}
+
+// 0 for under 16 items, 1 for under 256, ... 6 for 16M and over
+inline int vec_profile_bucket(int items)
+{
+    int b = 0;
+    for (; items >= 16 && b < 6; items >>= 4)
+        b++;
+    return b;
+}
+
+inline const char* vec_profile_bucket_name(int b)
+{
+    static const char* names[] = {
+        "<16", "<256", "<4K", "<64K", "<1M", "<16M", ">=16M"};
+    return names[b];
+}
+
+// The hardware counters of the calling thread, opened as one group so
+//   that a single read() returns them all
+class vec_perf_group {
+public:
+    vec_perf_group() : leader_(-1), count_(0), valid_(0)
+    {
+#ifdef VEC_PERF
+        static const uint64_t events[] = {PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES};
+        for (int k = 0; k < VEC_PERF_COUNTERS; k++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof attr);
+            attr.size = sizeof attr;
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = events[k];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            const int fd = static_cast<int>(syscall(__NR_perf_event_open,
+                &attr, 0, -1, leader_, 0));
+            if (fd < 0)
+                continue;
+            if (leader_ < 0)
+                leader_ = fd;
+            fds_[count_] = fd;
+            slot_[k] = count_++;
+            valid_ |= 1u << k;
+        }
+#endif
+    }
+
+    ~vec_perf_group()
+    {
+#ifdef VEC_PERF
+        for (int i = count_; i--;)
+            close(fds_[i]);
+#endif
+    }
+
+    vec_perf_group(const vec_perf_group&) = delete;
+    vec_perf_group& operator=(const vec_perf_group&) = delete;
+
+    // Fill the counters of the `valid` mask returned
+    unsigned read(uint64_t* out) const
+    {
+#ifdef VEC_PERF
+        uint64_t buf[1 + VEC_PERF_COUNTERS];
+        if (count_ == 0 || ::read(leader_, buf, sizeof buf) <= 0)
+            return 0;
+        for (int k = 0; k < VEC_PERF_COUNTERS; k++)
+            if (valid_ >> k & 1)
+                out[k] = buf[1 + slot_[k]];
+#endif
+        (void)out;
+        return valid_;
+    }
+
+    static vec_perf_group& thread()
+    {
+        static thread_local vec_perf_group group;
+        return group;
+    }
+
+private:
+    int leader_;
+    int count_;
+    unsigned valid_;
+    int fds_[VEC_PERF_COUNTERS];
+    int slot_[VEC_PERF_COUNTERS];
+};
+
+struct vec_profile_table {
+    std::mutex lock;
+    std::vector<vec_profile_row> rows;
+
+    static vec_profile_table& instance()
+    {
+        static vec_profile_table t;
+        return t;
+    }
+
+    void add(const char* op, int items, double seconds,
+        const uint64_t* counters, unsigned valid)
+    {
+        const int bucket = vec_profile_bucket(items);
+        std::lock_guard<std::mutex> hold(lock);
+        vec_profile_row* row = nullptr;
+        for (vec_profile_row& r : rows)
+            if (r.bucket == bucket && r.op == op)
+                row = &r;
+        if (!row) {
+            rows.push_back(vec_profile_row());
+            row = &rows.back();
+            row->op = op;
+            row->bucket = bucket;
+        }
+        vec_profile_stats& s = row->stats;
+        s.calls++;
+        s.items += items;
+        s.seconds += seconds;
+        s.valid |= valid;
+        for (int k = 0; k < VEC_PERF_COUNTERS; k++)
+            if (valid >> k & 1)
+                s.counters[k] += counters[k];
+    }
+};
+
+// Everything measured so far, sorted by operation and size
+inline std::vector<vec_profile_row> vec_profile_results()
+{
+    vec_profile_table& t = vec_profile_table::instance();
+    std::vector<vec_profile_row> rows;
+    {
+        std::lock_guard<std::mutex> hold(t.lock);
+        rows = t.rows;
+    }
+    std::sort(rows.begin(), rows.end(),
+        [](const vec_profile_row& a, const vec_profile_row& b) {
+            return a.op != b.op ? a.op < b.op : a.bucket < b.bucket;
+        });
+    return rows;
+}
+
+inline void vec_profile_reset()
+{
+    vec_profile_table& t = vec_profile_table::instance();
+    std::lock_guard<std::mutex> hold(t.lock);
+    t.rows.clear();
+}
+
+// One line per operation and size: time and counters per item, and
+//   instructions per cycle. Missing counters print as -
+inline void vec_profile_report(std::ostream& os)
+{
+    char line[160];
+    snprintf(line, sizeof line, "%-12s %6s %9s %10s %9s %7s %9s %9s\n",
+        "op", "size", "calls", "ns/item", "cyc/item", "IPC",
+        "miss/Ki", "brmiss/Ki");
+    os << line;
+    for (const vec_profile_row& r : vec_profile_results()) {
+        const vec_profile_stats& s = r.stats;
+        const double items = s.items ? double(s.items) : 1;
+        std::string col[4];
+        const uint64_t* c = s.counters;
+        if (s.valid >> VEC_PERF_CYCLES & 1)
+            col[0] = std::to_string(c[VEC_PERF_CYCLES] / items);
+        if ((s.valid & 3) == 3 && c[VEC_PERF_CYCLES])
+            col[1] = std::to_string(double(c[VEC_PERF_INSTRUCTIONS])
+                / c[VEC_PERF_CYCLES]);
+        if (s.valid >> VEC_PERF_CACHE_MISSES & 1)
+            col[2] = std::to_string(1000 * c[VEC_PERF_CACHE_MISSES] / items);
+        if (s.valid >> VEC_PERF_BRANCH_MISSES & 1)
+            col[3] = std::to_string(1000 * c[VEC_PERF_BRANCH_MISSES] / items);
+        for (std::string& x : col)
+            x = x.empty() ? "-" : x.substr(0, x.find('.') + 3);
+        snprintf(line, sizeof line,
+            "%-12s %6s %9llu %10.3f %9s %7s %9s %9s\n", r.op.c_str(),
+            vec_profile_bucket_name(r.bucket), (unsigned long long)s.calls,
+            1e9 * s.seconds / items, col[0].c_str(), col[1].c_str(),
+            col[2].c_str(), col[3].c_str());
+        os << line;
+    }
+}
+
+// The same as JSON, with the raw totals. Missing counters are null
+inline void vec_profile_json(std::ostream& os)
+{
+    static const char* names[] = {
+        "cycles", "instructions", "cache_misses", "branch_misses"};
+    const std::vector<vec_profile_row> rows = vec_profile_results();
+    os << "[\n";
+    for (size_t i = 0; i < rows.size(); i++) {
+        const vec_profile_stats& s = rows[i].stats;
+        char seconds[32];
+        {
+            vec_c_numeric c;
+            snprintf(seconds, sizeof seconds, "%.9g", s.seconds);
+        }
+        os << "  {\"op\": \"" << rows[i].op << "\", \"size\": \""
+            << vec_profile_bucket_name(rows[i].bucket) << "\", \"calls\": "
+            << s.calls << ", \"items\": " << s.items << ", \"seconds\": "
+            << seconds;
+        for (int k = 0; k < VEC_PERF_COUNTERS; k++) {
+            os << ", \"" << names[k] << "\": ";
+            if (s.valid >> k & 1)
+                os << s.counters[k];
+            else
+                os << "null";
+        }
+        os << "}" << (i + 1 < rows.size() ? "," : "") << "\n";
+    }
+    os << "]\n";
+}
+
+// Measures from construction to destruction, unless profiling is off or
+//   an outer operation of the thread is already being measured
+class vec_profile_scope {
+public:
+    vec_profile_scope(const char* op, int items)
+        : op_(nullptr), items_(items), open_(false), valid_(0)
+    {
+        if (!vec_profile_enabled())
+            return;
+        open_ = true;
+        if (depth()++ > 0)
+            return;
+        op_ = op;
+        valid_ = vec_perf_group::thread().read(start_);
+        time_ = std::chrono::steady_clock::now();
+    }
+
+    ~vec_profile_scope()
+    {
+        if (!open_)
+            return;
+        depth()--;
+        if (!op_)
+            return;
+        const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - time_).count();
+        uint64_t end[VEC_PERF_COUNTERS];
+        const unsigned valid = valid_ & vec_perf_group::thread().read(end);
+        for (int k = 0; k < VEC_PERF_COUNTERS; k++)
+            end[k] = valid >> k & 1 ? end[k] - start_[k] : 0;
+        vec_profile_table::instance().add(op_, items_, seconds, end, valid);
+    }
+
+    vec_profile_scope(const vec_profile_scope&) = delete;
+    vec_profile_scope& operator=(const vec_profile_scope&) = delete;
+
+private:
+    static int& depth()
+    {
+        static thread_local int d = 0;
+        return d;
+    }
+
+    const char* op_;
+    int items_;
+    bool open_;
+    unsigned valid_;
+    uint64_t start_[VEC_PERF_COUNTERS];
+    std::chrono::steady_clock::time_point time_;
+};
+
+#ifdef VEC_PROFILE
+#define VEC_PROFILE_OP(NAME, ITEMS) vec_profile_scope vec_profile_op_(NAME, ITEMS)
+#else
+#define VEC_PROFILE_OP(NAME, ITEMS) ((void)0)
+#endif
+
+
+
+
+
+//////////////////////////
+// Expression Templates //
+//////////////////////////
+
+// Operators and vectorized functions do not compute anything when they are
+//   called. Instead they return a lightweight node describing the operation.
+//   Nodes are only evaluated, one element at a time and in a single loop, when
+//   they are assigned to a `vec` or consumed by sum(), take(), str(), etc.
+//
+// Leaf `vec`s are held by reference, so an expression must not outlive the
+//   vecs it was built from (do not store one in an `auto` variable if it
+//   refers to a temporary `vec`).
+
+// Common base of all expressions, used to tell vecs apart from atoms
+struct vec_expr_base {};
+
+template <typename E>
+class vec_expr : public vec_expr_base {
+public:
+    const E& self() const {return static_cast<const E&>(*this);};
+
+    // Format the items, evaluating the expression into a `vec` first
+    //   unless it is a vec or a view. write_to() never builds the whole
+    //   string
+    std::string str() const;
+    std::string str(const vec_format& fmt) const;
+    void write_to(FILE* f) const;
+    void write_to(FILE* f, const vec_format& fmt) const;
+#ifdef VEC_MMAP
+    void write_to(int fd) const;
+    void write_to(int fd, const vec_format& fmt) const;
+#endif
+
+    // Start a lazy pipeline over the items, see vec_pipe
+    vec_pipe<E, vec_pipe_source> pipe() const;
+    vec_pipe<E, vec_pipe_source> pipe(vec_exec policy) const;
+};
+
+template <typename X>
+struct is_vec_expr
+    : std::is_base_of<vec_expr_base, typename std::decay<X>::type> {};
+
+// An atom on one side of a binary operator
+template <typename Q>
+class vec_scalar {
+public:
+    vec_scalar(Q n) : n_(n) {}
+    const Q& eval(int) const {return n_;};
+private:
+    Q n_;
+};
+
+// How an operand is stored inside a node: `vec`s by reference, everything
+//   else (nodes and atoms) by value
+template <typename X>
+struct vec_operand {typedef const X type;};
+
+template <typename T, typename A>
+struct vec_operand<vec<T, A>> {typedef const vec<T, A>& type;};
+
+template <>
+struct vec_operand<vec_mask> {typedef const vec_mask& type;};
+
+// Applies `Op` to each pair of elements of `L` and `R`, converting to `V`
+template <typename Op, typename V, typename L, typename R>
+class vec_binary_expr : public vec_expr<vec_binary_expr<Op, V, L, R>> {
+public:
+    typedef V value_type;
+
+    vec_binary_expr(const L& l, const R& r, int size)
+        : l_(l), r_(r), size_(size) {}
+
+    int size() const {return size_;};
+    V eval(int i) const {return static_cast<V>(Op()(l_.eval(i), r_.eval(i)));};
+    const L& lhs() const {return l_;};
+    const R& rhs() const {return r_;};
+
+private:
+    typename vec_operand<L>::type l_;
+    typename vec_operand<R>::type r_;
+    int size_;
+};
+
+// Applies `Fn` to each element of `E`, converting to `V`
+template <typename Fn, typename V, typename E>
+class vec_unary_expr : public vec_expr<vec_unary_expr<Fn, V, E>> {
+public:
+    typedef V value_type;
+
+    vec_unary_expr(const E& e) : e_(e) {}
+
+    int size() const {return e_.size();};
+    V eval(int i) const {return static_cast<V>(Fn()(e_.eval(i)));};
+    const E& arg() const {return e_;};
+
+private:
+    typename vec_operand<E>::type e_;
+};
+
+// Evaluate elements `begin`..`end`-1 of `e` into `out` in a single pass
+template <typename T, typename E>
+void vec_materialize(T* out, const E& e, int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+        out[i] = static_cast<T>(e.eval(i));
+}
+
+// Simple nodes may be evaluated by SIMD kernels instead, see below
+template <typename T, typename Op, typename V, typename L, typename R>
+void vec_materialize(T* out, const vec_binary_expr<Op, V, L, R>& e,
+    int begin, int end);
+template <typename T, typename Fn, typename V, typename E>
+void vec_materialize(T* out, const vec_unary_expr<Fn, V, E>& e,
+    int begin, int end);
+
+// The operation at the root of an expression, for profiling. Functors
+//   without a name() are counted as "expr"
+template <typename Op>
+auto vec_profile_op_name(int) -> decltype(Op::name()) {return Op::name();}
+
+template <typename Op>
+const char* vec_profile_op_name(long) {return "expr";}
+
+template <typename E>
+struct vec_profile_name {
+    static const char* get() {return "copy";};
+};
+
+template <typename Op, typename V, typename L, typename R>
+struct vec_profile_name<vec_binary_expr<Op, V, L, R>> {
+    static const char* get() {return vec_profile_op_name<Op>(0);};
+};
+
+template <typename Fn, typename V, typename E>
+struct vec_profile_name<vec_unary_expr<Fn, V, E>> {
+    static const char* get() {return vec_profile_op_name<Fn>(0);};
+};
+
+// Evaluate all of `e` into `out`, in parallel chunks under vec_exec::par
+template <typename T, typename E>
+void vec_evaluate(T* out, const E& e, vec_exec policy)
+{
+    const int size = e.size();
+    VEC_PROFILE_OP(vec_profile_name<E>::get(), size);
+    const int chunks = vec_par_chunks(policy, size);
+    vec_parallel_for(chunks, [&](int c) {
+        vec_materialize(out, e, vec_chunk_begin(size, chunks, c),
+            vec_chunk_begin(size, chunks, c+1));
+    });
+}
+
+
+
+
+
+////////////////////////////////
+// Vectorized Function Macros //
+////////////////////////////////
+
+// Vectorized functions
+// fn(op) = {fn(op0), fn(op1), ...}
+// sin, abs, sqrt, etc...
+#define VECTORIZE_FN(FN) struct vec_fn_##FN {                   \
+    static const char* name() {return #FN;};                    \
+    template <typename A>                                       \
+    auto operator()(const A& a) const -> decltype(FN(a))        \
+    {                                                           \
+        return FN(a);                                           \
+    }                                                           \
+};                                                              \
+                                                                \
+template <typename E>                                           \
+vec_unary_expr<vec_fn_##FN, typename E::value_type, E>          \
+FN(const vec_expr<E>& v)                                        \
+{                                                               \
+    return vec_unary_expr<vec_fn_##FN,                          \
+        typename E::value_type, E>(v.self());                   \
+}
+
+
+
+
+
+////////////////////////////
+// Binary Operator Macros //
+////////////////////////////
+
+// The elementwise operation itself: a op b
+#define BOP_FUNCTOR(NAME, OP) struct vec_op_##NAME {                \
+    static const char* name() {return #NAME;};                      \
+    template <typename A, typename B>                               \
+    auto operator()(const A& a, const B& b) const -> decltype(a OP b) \
+    {                                                               \
+        return a OP b;                                              \
+    }                                                               \
+};
+
+// A binary operator taking an atom on the left
+//   and a `vec` on the right
+#define BOP_ATM_VEC(NAME, OP) template <typename Q, typename R,     \
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type> \
+vec_binary_expr<vec_op_##NAME, typename R::value_type, vec_scalar<Q>, R> \
+operator OP(Q n, const vec_expr<R>& v) {                            \
+    return vec_binary_expr<vec_op_##NAME, typename R::value_type,   \
+        vec_scalar<Q>, R>(n, v.self(), v.self().size());            \
+}
+
+// A binary operator taking a `vec` on the left
+//   and an atom on the right
+#define BOP_VEC_ATM(NAME, OP) template <typename L, typename Q,     \
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type> \
+vec_binary_expr<vec_op_##NAME, typename L::value_type, L, vec_scalar<Q>> \
+operator OP(const vec_expr<L>& v, Q n) {                            \
+    return vec_binary_expr<vec_op_##NAME, typename L::value_type,   \
+        L, vec_scalar<Q>>(v.self(), n, v.self().size());            \
+}
+
+// A binary operator taking a `vec` on both the right
+//   hand side and the left hand side. Vecs have different types,
+//   the result uses the type from the left side
+#define BOP_VECT_VEC(NAME, OP) template <typename L, typename R>    \
+vec_binary_expr<vec_op_##NAME, typename L::value_type, L, R>        \
+operator OP(const vec_expr<L>& v1, const vec_expr<R>& v2) {         \
+    if (v1.self().size() != v2.self().size()) {                     \
+        throw std::out_of_range("length error");                    \
+    }                                                               \
+    return vec_binary_expr<vec_op_##NAME, typename L::value_type,   \
+        L, R>(v1.self(), v2.self(), v1.self().size());              \
+}
+
+
+
+// True when evaluating `e` item by item into the `n` items at `out` could
+//   overwrite an item before `e` reads it: some leaf of `e` is a view into
+//   that memory at other positions (reversed, strided or shifted)
+template <typename T, typename X>
+bool vec_reads_shifted(const X&, const T*, int)
+{
+    return false;
+}
+
+template <typename T, typename U>
+bool vec_reads_shifted(const vec_view<U>& v, const T* out, int n)
+{
+    typedef typename vec_view<U>::value_type V;
+    if (v.size() == 0 || n == 0)
+        return false;
+    if (std::is_same<V, T>::value && v.stride() == 1
+            && static_cast<const void*>(v.data()) == out)
+        return false;
+
+    const int last = (v.size() - 1) * v.stride();
+    const uintptr_t first = reinterpret_cast<uintptr_t>(
+        v.data() + (last < 0 ? last : 0));
+    const uintptr_t end = reinterpret_cast<uintptr_t>(
+        v.data() + (last < 0 ? 0 : last) + 1);
+    const uintptr_t lo = reinterpret_cast<uintptr_t>(out);
+    return first < lo + n * sizeof(T) && lo < end;
+}
+
+template <typename T, typename Op, typename V, typename L, typename R>
+bool vec_reads_shifted(const vec_binary_expr<Op, V, L, R>& e,
+    const T* out, int n)
+{
+    return vec_reads_shifted(e.lhs(), out, n)
+        || vec_reads_shifted(e.rhs(), out, n);
+}
+
+template <typename T, typename Fn, typename V, typename E>
+bool vec_reads_shifted(const vec_unary_expr<Fn, V, E>& e, const T* out, int n)
+{
+    return vec_reads_shifted(e.arg(), out, n);
+}
+
+// Overloads for a temporary `vec` operand that is about to be destroyed:
+//   the result is computed eagerly into its buffer, which is returned,
+//   instead of building an expression. The vec on the right is only reused
+//   when it has the type of the result. When the other operand reads the
+//   buffer at other positions (e.g. std::move(v) + v.slice(-1, -n-1, -1))
+//   a new vec is returned instead
+#define BOP_RVALUE(NAME, OP) template <typename T, typename A, typename R> \
+vec<T, A> operator OP(vec<T, A>&& v, const vec_expr<R>& e) {        \
+    if (v.size() != e.self().size()) {                              \
+        throw std::out_of_range("length error");                    \
+    }                                                               \
+    const vec_binary_expr<vec_op_##NAME, T, vec<T, A>, R>           \
+        node(v, e.self(), v.size());                                \
+    if (vec_reads_shifted(e.self(), v.data(), v.size()))            \
+        return vec<T, A>(node);                                     \
+    vec_evaluate(v.data(), node, vec_exec_default());               \
+    return std::move(v);                                            \
+}                                                                   \
+                                                                    \
+template <typename T, typename A, typename Q, typename B>           \
+vec<T, A> operator OP(vec<T, A>&& v1, vec<Q, B>&& v2) {             \
+    return std::move(v1) OP static_cast<const vec_expr<vec<Q, B>>&>(v2); \
+}                                                                   \
+                                                                    \
+template <typename L, typename T, typename A, typename = typename   \
+    std::enable_if<std::is_same<typename L::value_type, T>::value>::type> \
+vec<T, A> operator OP(const vec_expr<L>& e, vec<T, A>&& v) {        \
+    if (v.size() != e.self().size()) {                              \
+        throw std::out_of_range("length error");                    \
+    }                                                               \
+    const vec_binary_expr<vec_op_##NAME, T, L, vec<T, A>>           \
+        node(e.self(), v, v.size());                                \
+    if (vec_reads_shifted(e.self(), v.data(), v.size()))            \
+        return vec<T, A>(node);                                     \
+    vec_evaluate(v.data(), node, vec_exec_default());               \
+    return std::move(v);                                            \
+}                                                                   \
+                                                                    \
+template <typename T, typename A, typename Q,                       \
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type> \
+vec<T, A> operator OP(vec<T, A>&& v, Q n) {                         \
+    vec_evaluate(v.data(), vec_binary_expr<vec_op_##NAME, T,        \
+        vec<T, A>, vec_scalar<Q>>(v, n, v.size()), vec_exec_default()); \
+    return std::move(v);                                            \
+}                                                                   \
+                                                                    \
+template <typename Q, typename T, typename A,                       \
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type> \
+vec<T, A> operator OP(Q n, vec<T, A>&& v) {                         \
+    vec_evaluate(v.data(), vec_binary_expr<vec_op_##NAME, T,        \
+        vec_scalar<Q>, vec<T, A>>(n, v, v.size()), vec_exec_default()); \
+    return std::move(v);                                            \
+}
+
+// Compound assignment, v OP= expression or atom, evaluated in place.
+//   When the expression reads `v` through a view of it shifted to other
+//   positions, it is evaluated into a new buffer first
+#define BOP_COMPOUND(NAME, OP) template <typename T, typename A, typename R> \
+vec<T, A>& operator OP(vec<T, A>& v, const vec_expr<R>& e) {        \
+    if (v.size() != e.self().size()) {                              \
+        throw std::out_of_range("length error");                    \
+    }                                                               \
+    const vec_binary_expr<vec_op_##NAME, T, vec<T, A>, R>           \
+        node(v, e.self(), v.size());                                \
+    if (vec_reads_shifted(e.self(), v.data(), v.size()))            \
+        return v = vec<T, A>(node);                                 \
+    vec_evaluate(v.data(), node, vec_exec_default());               \
+    return v;                                                       \
+}                                                                   \
+                                                                    \
+template <typename T, typename A, typename Q,                       \
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type> \
+vec<T, A>& operator OP(vec<T, A>& v, Q n) {                         \
+    vec_evaluate(v.data(), vec_binary_expr<vec_op_##NAME, T,        \
+        vec<T, A>, vec_scalar<Q>>(v, n, v.size()), vec_exec_default()); \
+    return v;                                                       \
+}
+
+
+
+// Implement all three cases for binary operators
+#define IMPL_BOP(NAME, OP) BOP_FUNCTOR(NAME, OP)    \
+BOP_VECT_VEC(NAME, OP)                              \
+BOP_ATM_VEC(NAME, OP)                               \
+BOP_VEC_ATM(NAME, OP)                               \
+BOP_RVALUE(NAME, OP)
+
+
+
+////////////////////////////////
+// Comparison Operator Macros //
+////////////////////////////////
+
+// A comparison taking an atom on the left
+//   and a `vec` on the right
+#define COMP_ATM_VEC(NAME, OP) template <typename Q, typename R,    \
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type> \
+vec_binary_expr<vec_op_##NAME, bool, vec_scalar<Q>, R>              \
+operator OP(Q n, const vec_expr<R>& v) {                            \
+    return vec_binary_expr<vec_op_##NAME, bool,                     \
+        vec_scalar<Q>, R>(n, v.self(), v.self().size());            \
+}
+
+// A comparison taking a `vec` on the left
+//   and an atom on the right
+#define COMP_VEC_ATM(NAME, OP) template <typename L, typename Q,    \
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type> \
+vec_binary_expr<vec_op_##NAME, bool, L, vec_scalar<Q>>              \
+operator OP(const vec_expr<L>& v, Q n) {                            \
+    return vec_binary_expr<vec_op_##NAME, bool,                     \
+        L, vec_scalar<Q>>(v.self(), n, v.self().size());            \
+}
+
+// A comparison taking a `vec` on both the right
+//   hand side and the left hand side. Vecs have different types
+#define COMP_VECT_VEC(NAME, OP) template <typename L, typename R>   \
+vec_binary_expr<vec_op_##NAME, bool, L, R>                          \
+operator OP(const vec_expr<L>& v1, const vec_expr<R>& v2) {         \
+    if (v1.self().size() != v2.self().size()) {                     \
+        throw std::out_of_range("length error");                    \
+    }                                                               \
+    return vec_binary_expr<vec_op_##NAME, bool,                     \
+        L, R>(v1.self(), v2.self(), v1.self().size());              \
+}
+
+
+
+// Implement all three cases for comparison operators
+#define IMPL_COMP(NAME, OP) BOP_FUNCTOR(NAME, OP)   \
+COMP_VECT_VEC(NAME, OP)                             \
+COMP_ATM_VEC(NAME, OP)                              \
+COMP_VEC_ATM(NAME, OP)
+
+
+
+
+
+/////////////////////
+// Instrumentation //
+/////////////////////
+
+// Build with -DVEC_INSTRUMENT to count what vecs do with memory: heap
+//   allocations and frees, the bytes they take, reallocations of storage
+//   that already held items and deep copies of a vec. Counters are kept
+//   per thread, and per named scope:
+//
+//     {
+//         vec_alloc_scope scope("normalize");
+//         y = (x - mean(x)) / stddev(x);
+//     }
+//     for (auto& s : vec_alloc_scopes())
+//         std::cout << s.first << ": " << s.second << std::endl;
+//
+// A scope counts everything its thread does while it is open, nested
+//   scopes and the chunks of vec_exec::par calls on other threads
+//   included, and adds that up under its name when it closes. The
+//   counters of a thread only see the events on that thread, so a thread
+//   that frees what another one allocated can have a negative `live`.
+//   vec_alloc_hook() is called on every event. Without VEC_INSTRUMENT the
+//   hooks compile to nothing and every counter stays 0.
+
+enum class vec_alloc_event {
+    alloc,
+    free,
+    realloc,
+    copy
+};
+
+struct vec_alloc_stats {
+    uint64_t allocs, frees, reallocs, copies;
+    uint64_t bytes;         // Allocated in total
+    int64_t live, peak;     // Allocated and not yet freed, and its maximum
+
+    vec_alloc_stats() : allocs(0), frees(0), reallocs(0), copies(0),
+        bytes(0), live(0), peak(0) {}
+
+    void add(vec_alloc_event e, size_t n)
+    {
+        switch (e) {
+        case vec_alloc_event::alloc:
+            allocs++;
+            bytes += n;
+            live += n;
+            peak = live > peak ? live : peak;
+            break;
+        case vec_alloc_event::free:
+            frees++;
+            live -= n;
+            break;
+        case vec_alloc_event::realloc:
+            reallocs++;
+            break;
+        case vec_alloc_event::copy:
+            copies++;
+            break;
+        }
+    }
+
+    // Counts of `b`, which happened after everything counted here
+    void add(const vec_alloc_stats& b)
+    {
+        allocs += b.allocs;
+        frees += b.frees;
+        reallocs += b.reallocs;
+        copies += b.copies;
+        bytes += b.bytes;
+        peak = live + b.peak > peak ? live + b.peak : peak;
+        live += b.live;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const vec_alloc_stats& s)
+{
+    return os << s.allocs << " allocs, " << s.frees << " frees, "
+        << s.reallocs << " reallocs, " << s.copies << " copies, "
+        << s.bytes << " bytes, peak " << s.peak << " bytes";
+}
+
+// Called with each event, its size in bytes and the innermost open scope
+//   of the thread (or null), from every thread that allocates. Set it
+//   before any vec is used
+inline std::function<void(vec_alloc_event, size_t, const char*)>&
+vec_alloc_hook()
+{
+    static std::function<void(vec_alloc_event, size_t, const char*)> fn;
+    return fn;
+}
+
+// The counters of the calling thread
+inline vec_alloc_stats& vec_alloc_thread()
+{
+    static thread_local vec_alloc_stats stats;
+    return stats;
+}
+
+inline vec_alloc_stats vec_alloc_snapshot()
+{
+    return vec_alloc_thread();
+}
+
+// Zero the counters of the calling thread
+inline void vec_alloc_reset()
+{
+    vec_alloc_thread() = vec_alloc_stats();
+}
+
+// Totals of every closed scope by name. The peak is the largest of any
+//   single time the scope was open
+struct vec_alloc_registry {
+    std::mutex lock;
+    std::vector<std::pair<std::string, vec_alloc_stats>> scopes;
+
+    static vec_alloc_registry& instance()
+    {
+        static vec_alloc_registry r;
+        return r;
+    }
+};
+
+inline std::vector<std::pair<std::string, vec_alloc_stats>> vec_alloc_scopes()
+{
+    vec_alloc_registry& r = vec_alloc_registry::instance();
+    std::lock_guard<std::mutex> hold(r.lock);
+    return r.scopes;
+}
+
+inline void vec_alloc_reset_scopes()
+{
+    vec_alloc_registry& r = vec_alloc_registry::instance();
+    std::lock_guard<std::mutex> hold(r.lock);
+    r.scopes.clear();
+}
+
+class vec_alloc_scope {
+public:
+    explicit vec_alloc_scope(const char* name) : name_(name), parent_(nullptr)
+    {
+#ifdef VEC_INSTRUMENT
+        parent_ = current();
+        current() = this;
+#endif
+    }
+
+    ~vec_alloc_scope()
+    {
+#ifdef VEC_INSTRUMENT
+        current() = parent_;
+        if (parent_) {
+            std::lock_guard<std::mutex> hold(parent_->lock_);
+            parent_->stats_.add(stats_);
+        }
+
+        vec_alloc_registry& r = vec_alloc_registry::instance();
+        std::lock_guard<std::mutex> hold(r.lock);
+        for (auto& s : r.scopes)
+            if (s.first == name_) {
+                const int64_t peak = s.second.peak;
+                s.second.add(stats_);
+                s.second.peak = peak > stats_.peak ? peak : stats_.peak;
+                return;
+            }
+        r.scopes.push_back(std::make_pair(std::string(name_), stats_));
+#endif
+    }
+
+    vec_alloc_scope(const vec_alloc_scope&) = delete;
+    vec_alloc_scope& operator=(const vec_alloc_scope&) = delete;
+
+    // Counted so far
+    const vec_alloc_stats& stats() const {return stats_;};
+
+    static vec_alloc_scope*& current()
+    {
+        return vec_alloc_current();
+    }
+
+    // Workers of the pool may count in the same scope at once
+    static void track(vec_alloc_event e, size_t bytes)
+    {
+        vec_alloc_thread().add(e, bytes);
+        vec_alloc_scope* s = current();
+        if (s) {
+            std::lock_guard<std::mutex> hold(s->lock_);
+            s->stats_.add(e, bytes);
+        }
+        if (vec_alloc_hook())
+            vec_alloc_hook()(e, bytes, s ? s->name_ : nullptr);
+    }
+
+private:
+    const char* name_;
+    vec_alloc_scope* parent_;
+    std::mutex lock_;
+    vec_alloc_stats stats_;
+};
+
+#ifdef VEC_INSTRUMENT
+#define VEC_TRACK(EVENT, BYTES) \
+    vec_alloc_scope::track(vec_alloc_event::EVENT, BYTES)
+#else
+#define VEC_TRACK(EVENT, BYTES) ((void)0)
+#endif
+
+
+
+
+
+////////////////
+// Allocators //
+////////////////
+
+// The second template parameter of `vec` is an allocator with the usual
+//   allocate(n) / deallocate(p, n) interface. Allocators are expected to be
+//   stateless: a default constructed one is used whenever memory is needed.
+//
+//     vec<float, vec_aligned_allocator<float>> a;    // 64 byte aligned
+//     vec<float, vec_hugepage_allocator<float>> b;   // 2 MB pages on Linux
+
+inline void* vec_aligned_alloc(size_t bytes, size_t align)
+{
+    void* p = nullptr;
+    if (posix_memalign(&p, align, bytes ? bytes : 1) != 0)
+        throw std::bad_alloc();
+    return p;
+}
+
+// Memory aligned to `Align` bytes, a cache line by default, so that SIMD
+//   loads never straddle two lines
+template <typename T, size_t Align = 64>
+struct vec_aligned_allocator {
+    typedef T value_type;
+    template <typename U>
+    struct rebind {typedef vec_aligned_allocator<U, Align> other;};
+
+    vec_aligned_allocator() {}
+    template <typename U>
+    vec_aligned_allocator(const vec_aligned_allocator<U, Align>&) {}
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(vec_aligned_alloc(n * sizeof(T), Align));
+    }
+    void deallocate(T* p, size_t) {free(p);};
+
+    bool operator==(const vec_aligned_allocator&) const {return true;};
+    bool operator!=(const vec_aligned_allocator&) const {return false;};
+};
+
+// Buffers of 2 MB or more are mapped with huge pages, so that scanning
+//   them takes far fewer TLB misses. MAP_HUGETLB needs pages reserved by
+//   the administrator (vm.nr_hugepages); without them the buffer is mapped
+//   2 MB aligned with a transparent huge page hint instead. Smaller
+//   buffers, and other systems, use vec_aligned_allocator
+template <typename T>
+struct vec_hugepage_allocator {
+    typedef T value_type;
+    template <typename U>
+    struct rebind {typedef vec_hugepage_allocator<U> other;};
+    enum {page = 2 << 20};
+
+    vec_hugepage_allocator() {}
+    template <typename U>
+    vec_hugepage_allocator(const vec_hugepage_allocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        const size_t bytes = n * sizeof(T);
+#ifdef __linux__
+        if (bytes >= page) {
+            const size_t len = (bytes + page - 1) / page * page;
+            const int prot = PROT_READ | PROT_WRITE;
+            const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+            void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            p = mmap(nullptr, len, prot, flags | MAP_HUGETLB, -1, 0);
+#endif
+            if (p != MAP_FAILED)
+                return static_cast<T*>(p);
+
+            // Map an extra page and trim both ends to a page boundary
+            char* base = static_cast<char*>(
+                mmap(nullptr, len + page, prot, flags, -1, 0));
+            if (base == MAP_FAILED)
+                throw std::bad_alloc();
+            const size_t head = (page - reinterpret_cast<uintptr_t>(base)
+                % page) % page;
+            if (head)
+                munmap(base, head);
+            munmap(base + head + len, page - head);
+#ifdef MADV_HUGEPAGE
+            madvise(base + head, len, MADV_HUGEPAGE);
+#endif
+            return reinterpret_cast<T*>(base + head);
+        }
+#endif
+        return static_cast<T*>(vec_aligned_alloc(bytes, 64));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        const size_t bytes = n * sizeof(T);
+#ifdef __linux__
+        if (bytes >= page) {
+            munmap(p, (bytes + page - 1) / page * page);
+            return;
+        }
+#endif
+        free(p);
+    }
+
+    bool operator==(const vec_hugepage_allocator&) const {return true;};
+    bool operator!=(const vec_hugepage_allocator&) const {return false;};
+};
+
+
+
+
+
+/////////////////////////
+// Small Buffer Storage //
+/////////////////////////
+
+// Number of items a `vec` keeps inside the object itself before it goes
+//   to the allocator. By default 32 bytes worth of numbers and other
+//   trivial types of up to 8 bytes, none for anything else. Specialize it
+//   to change that for a type:
+//
+//     template <> struct vec_inline_capacity<Point>
+//         : std::integral_constant<int, 4> {};
+//
+// Like std::string, moving a short `vec` moves its items, so pointers
+//   into it do not survive the move. Only vecs using std::allocator keep
+//   items inline: the buffer could not honor the alignment or pages
+//   another allocator gives.
+template <typename T>
+struct vec_inline_capacity : std::integral_constant<int,
+    std::is_trivial<T>::value && sizeof(T) <= 8 ? 32 / sizeof(T) : 0> {};
+
+template <typename T, int N>
+struct vec_inline_buffer {
+    T* data() {return reinterpret_cast<T*>(bytes_);};
+    const T* data() const {return reinterpret_cast<const T*>(bytes_);};
+    alignas(T) unsigned char bytes_[N * sizeof(T)];
+};
+
+template <typename T>
+struct vec_inline_buffer<T, 0> {
+    T* data() {return nullptr;};
+    const T* data() const {return nullptr;};
+};
+
+
+
+
+
+////////////////////////
+// Binary File Format //
+////////////////////////
+
+// A 64 byte header followed by the raw items. The header is written in
+//   the byte order of the machine, which `byte_order` tells apart
+enum vec_type_kind {
+    VEC_TYPE_NONE, VEC_TYPE_INT, VEC_TYPE_UINT, VEC_TYPE_FLOAT, VEC_TYPE_BOOL
+};
+
+template <typename T>
+struct vec_type_tag : std::integral_constant<int,
+    std::is_same<T, bool>::value ? VEC_TYPE_BOOL
+    : std::is_floating_point<T>::value ? VEC_TYPE_FLOAT
+    : std::is_integral<T>::value && std::is_signed<T>::value ? VEC_TYPE_INT
+    : std::is_integral<T>::value ? VEC_TYPE_UINT
+    : VEC_TYPE_NONE> {};
+
+struct vec_file_header {
+    char magic[8];                      // "vec.h\0\0\1"
+    uint32_t byte_order;                // 0x01020304
+    uint32_t kind;                      // vec_type_kind
+    uint32_t item_size;                 // sizeof(T)
+    uint32_t unused;
+    uint64_t count;                     // Number of items
+    char reserved[32];
+
+    static vec_file_header make(int kind, int item_size, uint64_t count)
+    {
+        vec_file_header h;
+        memset(&h, 0, sizeof h);
+        memcpy(h.magic, "vec.h\0\0\1", 8);
+        h.byte_order = 0x01020304;
+        h.kind = kind;
+        h.item_size = item_size;
+        h.count = count;
+        return h;
+    }
+
+    // Why a file of `bytes` bytes starting with this header cannot be
+    //   read as at most `max_count` items of `kind` and `item_size`, null
+    //   if it can
+    const char* error(int kind, int item_size, uint64_t bytes,
+        uint64_t max_count = INT_MAX) const
+    {
+        if (bytes < sizeof *this || memcmp(magic, "vec.h\0\0\1", 8) != 0)
+            return "not a vec file";
+        if (byte_order != 0x01020304)
+            return "written with another byte order";
+        if (this->kind != uint32_t(kind) || this->item_size != uint32_t(item_size))
+            return "holds items of another type";
+        if (count > max_count)
+            return "too many items";
+        if (bytes != sizeof *this + count * item_size)
+            return "wrong size";
+        return nullptr;
+    }
+};
+
+static_assert(sizeof(vec_file_header) == 64, "vec_file_header must be 64 bytes");
+
+
+
+
+
+/////////////////////
+// The `vec` Class //
+/////////////////////
+
+
+template <typename T, typename A>
+class vec : public vec_expr<vec<T, A>> {
+public:
+    typedef T value_type;
+    typedef A allocator_type;
+
+    // Constructor / Destructors
+    vec();                              // Default Constructor
+    vec(int size);                      // Preallocated memory constructor
+    vec(std::initializer_list<T> lst);  // initializer_list constructor
+    vec(const vec& other);              // Copy constructor
+    vec(vec<T, A>&& v);                 // Move constructor
+    template <typename E>
+    vec(const vec_expr<E>& e);          // Evaluate an expression
+    template <typename E>
+    vec(vec_exec policy, const vec_expr<E>& e);
+    ~vec() {release();};                // Destructor
+    vec& operator=(const vec& v);
+    vec& operator=(vec&& v);
+    template <typename E>
+    vec& operator=(const vec_expr<E>& e);
+
+    // Utils / Access
+    int size() const {return size_;};
+    T& operator[](int i);
+    const T& operator[](int i) const;
+    const T& eval(int i) const {return arr_[i];}; // Unchecked, for expressions
+    T* data() {return arr_;};
+    const T* data() const {return arr_;};
+
+
+    // Resource Mgmt.
+    void realloc(int s);
+    void resize(int size, T dflt);
+    void resize(int size);
+    void clear();
+    void reserve(int n);                // Allocate room for `n` items
+    int capacity() const {return allocsize_ < 0 ? -allocsize_ : allocsize_;};
+    void shrink_to_fit();               // Free unused memory
+
+    // Aggregate Operations
+    //   sum(), prod(), max() and min() are free functions
+    //   accepting any expression
+    //   cumsum() and cumprod() are the running sum and product, scan()
+    //   the same with any associative `op`. exclusive_scan() starts from
+    //   `init` and leaves out the item itself
+    vec<T, A> cumsum() const;
+    vec<T, A> cumsum(vec_exec policy) const;
+    vec<T, A> cumprod() const;
+    vec<T, A> cumprod(vec_exec policy) const;
+    template <typename Op>
+    vec<T, A> scan(Op op) const;
+    template <typename Op>
+    vec<T, A> scan(vec_exec policy, Op op) const;
+    template <typename Op>
+    vec<T, A> exclusive_scan(T init, Op op) const;
+    template <typename Op>
+    vec<T, A> exclusive_scan(vec_exec policy, T init, Op op) const;
+    //   mean(), var(), stddev(), skew(), median(), quantile(), mode()
+    //   and describe() are free functions as well
+
+    // Binary files
+    void save(const std::string& path) const;
+    static vec<T, A> mmap_open(const std::string& path);
+
+    // Text files: numbers separated by whitespace or commas
+#if __cplusplus >= 201703L
+    static vec<T, A> parse(std::string_view text);
+    static vec<T, A> parse(vec_exec policy, std::string_view text);
+#else
+    static vec<T, A> parse(const std::string& text);
+    static vec<T, A> parse(vec_exec policy, const std::string& text);
+#endif
+    static vec<T, A> parse(vec_exec policy, const char* text, size_t n);
+    static vec<T, A> load_text(const std::string& path);
+    static vec<T, A> load_text(vec_exec policy, const std::string& path);
+
+    // Modification
+    void append(T x);
+    void append(const vec<T, A>& v);
+    template <typename... Args>
+    T& emplace(Args&&... args);         // Construct a new item at the end
+    void swap(int i, int j);
+    void reverse();
+
+    // Sorting, in ascending order. argsort() gives the positions of the
+    //   items in sorted order, for gather() on this or any other vec of
+    //   the same size. sort_by_key() puts the items in the order of `keys`
+    vec<T, A>& sort();
+    vec<T, A>& sort(vec_exec policy, vec_sort kind = vec_sort::fast);
+    vec<int> argsort() const;
+    vec<int> argsort(vec_exec policy, vec_sort kind = vec_sort::fast) const;
+    template <typename K, typename KA>
+    vec<T, A>& sort_by_key(const vec<K, KA>& keys);
+    template <typename K, typename KA>
+    vec<T, A>& sort_by_key(vec_exec policy, const vec<K, KA>& keys,
+        vec_sort kind = vec_sort::fast);
+    vec<T, A> gather(const vec<int>& positions) const;
+    vec<T, A> gather(vec_exec policy, const vec<int>& positions) const;
+
+    // Sublists
+    T head() const;
+    vec<T, A> head(int items) const;
+    vec<T, A> head(int items, T overtake) const;
+    T tail() const;
+    vec<T, A> tail(int items) const;
+    vec<T, A> tail(int items, T overtake) const;
+
+    void pop();
+    void pop(int n);
+
+    // Views (no copy), Python style: negative positions count from the
+    //   end, a negative step walks backwards
+    vec_view<T> view() {return vec_view<T>(arr_, size_);};
+    vec_view<const T> view() const {return vec_view<const T>(arr_, size_);};
+    vec_view<T> slice(int start, int stop, int step = 1);
+    vec_view<const T> slice(int start, int stop, int step = 1) const;
+
+    template <typename E>
+    vec<T, A> take(const vec_expr<E>& filter) const;
+    template <typename E>
+    vec<T, A> take(vec_exec policy, const vec_expr<E>& filter) const;
+    vec<T, A> take(const vec_mask& filter) const;
+    vec<T, A> take(vec_exec policy, const vec_mask& filter) const;
+
+    // Functional, changing the items in place. See also pipe()
+    vec<T, A>& apply(auto fn);
+    vec<T, A>& apply(vec_exec policy, auto fn);
+    template <typename E>
+    vec<T, A>& apply_to(const vec_expr<E>& filter, auto fn);
+    template <typename E>
+    vec<T, A>& apply_to(vec_exec policy, const vec_expr<E>& filter, auto fn);
+    vec<T, A>& apply_to(const vec_mask& filter, auto fn);
+    vec<T, A>& apply_to(vec_exec policy, const vec_mask& filter, auto fn);
+
+    //Generators
+    static vec<T, A> range(T i);
+    static vec<T, A> range(T a, T b);
+    static vec<T, A> range(T a, T b, T inc);
+
+
+
+    // Operators, comparisons and vectorized math functions (sin, cos,
+    //   etc...) are free functions returning lazy expressions.
+    //   dot(), axpy(), scal() and the norms are free functions too
+
+    vec<T, A> power(T i);
+
+
+private:
+    enum {inline_size = std::is_same<A, std::allocator<T>>::value
+        ? vec_inline_capacity<T>::value : 0};
+
+    int grow_to(int n) const;
+    static T* allocate(int s);
+    static void deallocate(T* p, int s);
+
+    // Small buffer handling, see vec_inline_capacity
+    bool is_inline() const {return inline_size > 0 && arr_ == buf_.data();};
+    void init_inline();                 // Become empty, using the buffer
+    void release();                     // Free the storage, keep no items
+    void adopt(vec& v);                 // Take the items of `v`, empty it
+
+    T* arr_;
+    int size_;
+    int allocsize_;
+    vec_inline_buffer<T, inline_size> buf_;
+};
+
+
+
+
+
+
+
+//////////////////
+// Constructors //
+//////////////////
+
+template <typename T, typename A>
+vec<T, A>::vec()
+{
+    init_inline();
+}
+
+template <typename T, typename A>
+vec<T, A>::vec(int size)
+{
+    init_inline();
+    realloc(size);
+}
+
+template <typename T, typename A>
+vec<T, A>::vec(std::initializer_list<T> lst)
+{
+    init_inline();
+    realloc(lst.size());
+    std::copy(lst.begin(), lst.end(), arr_);
+    size_ = lst.size();
+}
+
+
+//Copy constructor
+template <typename T, typename A>
+vec<T, A>::vec(const vec<T, A>& other)
+{
+    init_inline();
+    realloc(other.size_);
+    size_ = other.size_;
+    VEC_TRACK(copy, size_t(size_) * sizeof(T));
+
+    for (int i = 0; i < size_; i++)
+        arr_[i] = other.arr_[i];
+}
+
+//Move Constructor
+template <typename T, typename A>
+vec<T, A>::vec(vec<T, A>&& v)
+{
+    init_inline();
+    adopt(v);
+}
+
+//Expression constructor
+template <typename T, typename A>
+template <typename E>
+vec<T, A>::vec(const vec_expr<E>& e) : vec(vec_exec_default(), e)
+{}
+
+template <typename T, typename A>
+template <typename E>
+vec<T, A>::vec(vec_exec policy, const vec_expr<E>& e)
+{
+    init_inline();
+    const int size = e.self().size();
+    realloc(size);
+    vec_evaluate(arr_, e.self(), policy);
+    size_ = size;
+}
+
+template <typename T, typename A>
+vec<T, A>& vec<T, A>::operator=(const vec<T, A>& v)
+{
+  if (this == &v)
+    return *this;
+
+  // Reuse the storage when the items fit
+  if (v.size_ > allocsize_)
+  {
+    release();
+    realloc(v.size_);
+  }
+  for (int i = 0; i < v.size(); i++)
+  {
+    arr_[i] = v.arr_[i];
+  }
+  size_ = v.size_;
+  VEC_TRACK(copy, size_t(size_) * sizeof(T));
+  return *this;
+}
+
+template <typename T, typename A>
+vec<T, A>& vec<T, A>::operator=(vec<T, A>&& v)
+{
+    if (this != &v) {
+        release();
+        adopt(v);
+    }
+    return *this;
+}
+
+// Evaluate into a new buffer first, the expression may refer to this vec
+template <typename T, typename A>
+template <typename E>
+vec<T, A>& vec<T, A>::operator=(const vec_expr<E>& e)
+{
+    vec<T, A> v(e);
+    release();
+    adopt(v);
+    return *this;
+}
+
+
+
+/////////////////////////
+// Resource Management //
+/////////////////////////
+
+
+template <typename T, typename A>
+void vec<T, A>::realloc(int s) {
+
+    //We are making the array smaller, drop the items past the end
+    if (s < size_)
+        size_ = s;
+
+    //Small enough for the inline buffer
+    if (s <= inline_size) {
+        if (is_inline())
+            return;
+
+        T* oldarr = arr_;
+        int oldalloc = allocsize_;
+        int items = size_;
+        if (items)
+            VEC_TRACK(realloc, size_t(items) * sizeof(T));
+        init_inline();
+        for (int i = 0; i < items; i++)
+            arr_[i] = std::move(oldarr[i]);
+        size_ = items;
+        deallocate(oldarr, oldalloc);
+        return;
+    }
+
+    //No change in array size
+    if (s == allocsize_)
+        return;
+
+    T* newarr = allocate(s);
+    if (size_)
+        VEC_TRACK(realloc, size_t(size_) * sizeof(T));
+
+    // Move the existing elements, leave newly
+    //   allocated space uninitilized
+    for (int i = 0; i < size_; i++)
+        newarr[i] = std::move(arr_[i]);
+
+    int oldsize = size_;
+    release();
+
+    size_ = oldsize;
+    allocsize_ = s;
+    arr_ = newarr;
+}
+
+template <typename T, typename A>
+void vec<T, A>::init_inline()
+{
+    arr_ = buf_.data();
+    size_ = 0;
+    allocsize_ = inline_size;
+    if (!std::is_trivially_default_constructible<T>::value)
+        for (int i = 0; i < inline_size; i++)
+            new (arr_ + i) T;
+}
+
+template <typename T, typename A>
+void vec<T, A>::release()
+{
+    if (is_inline()) {
+        if (!std::is_trivially_destructible<T>::value)
+            for (int i = 0; i < inline_size; i++)
+                arr_[i].~T();
+    } else {
+        deallocate(arr_, allocsize_);
+    }
+    arr_ = nullptr;
+    size_ = 0;
+    allocsize_ = 0;
+}
+
+// Heap storage changes hands, inline items are moved one by one.
+//   This vec must hold no storage (after release() or in a constructor)
+template <typename T, typename A>
+void vec<T, A>::adopt(vec& v)
+{
+    if (v.is_inline()) {
+        if (!is_inline())
+            init_inline();
+        for (int i = 0; i < v.size_; i++)
+            arr_[i] = std::move(v.arr_[i]);
+        size_ = v.size_;
+        v.size_ = 0;
+        return;
+    }
+
+    if (is_inline())
+        release();
+    arr_ = v.arr_;
+    size_ = v.size_;
+    allocsize_ = v.allocsize_;
+    v.init_inline();
+}
+
+// Storage for `s` items from the allocator, each default constructed
+//   like new T[s] would
+template <typename T, typename A>
+T* vec<T, A>::allocate(int s)
+{
+    if (s == 0)
+        return nullptr;
+
+    T* p = A().allocate(s);
+    VEC_TRACK(alloc, size_t(s) * sizeof(T));
+    if (std::is_trivially_default_constructible<T>::value)
+        return p;
+
+    int i = 0;
+    try {
+        for (; i < s; i++)
+            new (p + i) T;
+    } catch (...) {
+        while (i--)
+            p[i].~T();
+        A().deallocate(p, s);
+        VEC_TRACK(free, size_t(s) * sizeof(T));
+        throw;
+    }
+    return p;
+}
+
+template <typename T, typename A>
+void vec<T, A>::deallocate(T* p, int s)
+{
+    if (s == 0)
+        return;
+
+    // A negative size means `p` holds -s items of a file mapped by
+    //   mmap_open(), right after the header
+    if (s < 0) {
+#ifdef VEC_MMAP
+        munmap(reinterpret_cast<char*>(p) - sizeof(vec_file_header),
+            sizeof(vec_file_header) + size_t(-s) * sizeof(T));
+#endif
+        return;
+    }
+
+    if (!std::is_trivially_destructible<T>::value)
+        for (int i = 0; i < s; i++)
+            p[i].~T();
+    A().deallocate(p, s);
+    VEC_TRACK(free, size_t(s) * sizeof(T));
+}
+
+// Capacity to allocate when `n` items no longer fit: grow
+//   geometrically so that n appends cost O(n) copies
+template <typename T, typename A>
+int vec<T, A>::grow_to(int n) const
+{
+    const int cap = capacity();
+    if (cap > INT_MAX / 2)
+        return INT_MAX;
+
+    return n > 2 * cap ? n : 2 * cap;
+}
+
+
+
+template <typename T, typename A>
+void vec<T, A>::resize(int size, T dflt)
+{
+    // Same size, do nothing
+    if (size == size_)
+        return;
+
+    //Making it smaller
+    else if (size < size_)
+        realloc(size);
+
+    //Making it bigger
+    else
+    {
+        int oldsize = size_;
+        realloc(size);
+
+        for (int i = oldsize; i < size; i++)
+            arr_[i] = dflt;
+
+        size_ = size;
+    }
+}
+
+// New items are value initialized (0 for numbers)
+template <typename T, typename A>
+void vec<T, A>::resize(int size)
+{
+    resize(size, T());
+}
+
+template <typename T, typename A>
+void vec<T, A>::clear()
+{
+    realloc(0);
+}
+
+template <typename T, typename A>
+void vec<T, A>::reserve(int n)
+{
+    if (n > capacity())
+        realloc(n);
+}
+
+// Mapped files are left alone, unmapping them would mean a copy
+template <typename T, typename A>
+void vec<T, A>::shrink_to_fit()
+{
+    if (allocsize_ >= 0)
+        realloc(size_);
+}
+
+
+
+
+/////////////////////
+// Utils. / Access //
+/////////////////////
+
+template <typename T, typename A>
+T& vec<T, A>::operator[](int i)
+{
+    if (i < 0)
+        i = size_ + i;
+
+    if (i <= size_)
+        return arr_[i];
+
+    throw std::out_of_range("Invalid position!");
+}
+
+template <typename T, typename A>
+const T& vec<T, A>::operator[](int i) const
+{
+    if (i <= size_)
+        return arr_[i];
+
+    throw std::out_of_range("Invalid position!");
+}
+
+
+
+////////////
+// Output //
+////////////
+
+// How str(), write_to() and operator<< lay out the items
+struct vec_format {
+    const char* open;                   // Before the first item
+    const char* sep;                    // Between two items
+    const char* close;                  // After the last item
+    int precision;                      // Significant digits of floats, 0
+                                        //   for the shortest exact text
+
+    vec_format(const char* sep = ", ", int precision = 6,
+        const char* open = "<", const char* close = ">")
+        : open(open), sep(sep), close(close), precision(precision) {}
+
+    // One comma separated line that reads back to the same numbers
+    static vec_format csv() {return vec_format(",", 0, "", "\n");};
+};
+
+// Longest text of one number, including a "e-308" or such
+enum {vec_item_chars = 64};
+
+// Numbers are written with the routines below instead of through a
+//   stream, the rest (chars, strings, ...) still go through operator<<
+template <typename T>
+struct vec_fast_format : std::integral_constant<bool,
+    (std::is_integral<T>::value && !std::is_same<T, char>::value
+        && !std::is_same<T, signed char>::value
+        && !std::is_same<T, unsigned char>::value)
+    || std::is_same<T, float>::value || std::is_same<T, double>::value> {};
+
+// Digits of 0 to 99, two at a time
+inline const char* vec_digit_pairs()
+{
+    return "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+        "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+}
+
+template <typename U>
+int vec_format_unsigned(char* out, U x)
+{
+    char tmp[24];
+    char* p = tmp + sizeof tmp;
+    const char* digits = vec_digit_pairs();
+    while (x >= 100) {
+        const char* d = digits + (x % 100) * 2;
+        x /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if (x >= 10) {
+        *--p = digits[x * 2 + 1];
+        *--p = digits[x * 2];
+    } else {
+        *--p = char('0' + x);
+    }
+
+    const int n = int(tmp + sizeof tmp - p);
+    memcpy(out, p, n);
+    return n;
+}
+
+// Write `x` at `out` and return the number of chars
+inline int vec_format_item(char* out, bool x, int)
+{
+    *out = x ? '1' : '0';
+    return 1;
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value, int>::type
+vec_format_item(char* out, T x, int)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    if (x >= 0)
+        return vec_format_unsigned(out, U(x));
+    *out = '-';
+    return 1 + vec_format_unsigned(out + 1, U(U(0) - U(x)));
+}
+
+// With no precision, the fewest digits that read back to `x`. Without
+//   to_chars the caller must hold a vec_c_numeric, so that the text does
+//   not depend on the locale
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, int>::type
+vec_format_item(char* out, T x, int precision)
+{
+    if (precision > 40)
+        precision = 40;
+#if __cplusplus >= 201703L
+    const std::to_chars_result r = precision > 0
+        ? std::to_chars(out, out + vec_item_chars, x,
+            std::chars_format::general, precision)
+        : std::to_chars(out, out + vec_item_chars, x);
+    return int(r.ptr - out);
+#else
+    if (precision > 0)
+        return snprintf(out, vec_item_chars, "%.*g", precision, double(x));
+
+    // Any text of up to digits10 digits reads back to the same normal
+    //   number, so when one is the shortest %g finds it at digits10 (it
+    //   drops trailing zeros). Subnormals have fewer digits to spare
+    const bool subnormal = x != 0
+        && (x < 0 ? -x : x) < std::numeric_limits<T>::min();
+    int n = 0;
+    for (int p = subnormal ? 1 : std::numeric_limits<T>::digits10;
+         p <= std::numeric_limits<T>::max_digits10; p++) {
+        n = snprintf(out, vec_item_chars, "%.*g", p, double(x));
+        const T back = std::is_same<T, float>::value
+            ? T(strtof(out, nullptr)) : T(strtod(out, nullptr));
+        if (back == x || x != x)
+            break;
+    }
+    return n;
+#endif
+}
+
+// Collects the text in a fixed buffer and hands it to
+//   `sink(const char*, size_t)` whenever it fills up
+template <typename Sink>
+class vec_format_buffer {
+public:
+    explicit vec_format_buffer(Sink& sink) : sink_(sink), len_(0) {}
+
+    char* room()                        // For one item
+    {
+        if (len_ + vec_item_chars > sizeof buf_)
+            flush();
+        return buf_ + len_;
+    };
+    void commit(int n) {len_ += n;};
+
+    void put(const char* s, size_t n)
+    {
+        if (len_ + n > sizeof buf_) {
+            flush();
+            if (n > sizeof buf_) {
+                sink_(s, n);
+                return;
+            }
+        }
+        memcpy(buf_ + len_, s, n);
+        len_ += n;
+    };
+
+    void flush()
+    {
+        if (len_)
+            sink_(buf_, len_);
+        len_ = 0;
+    };
+
+private:
+    Sink& sink_;
+    char buf_[16384];
+    size_t len_;
+};
+
+template <typename T, bool Fast = vec_fast_format<T>::value>
+class vec_item_writer {
+public:
+    explicit vec_item_writer(int precision) : precision_(precision) {}
+
+    template <typename B>
+    void operator()(B& out, const T& x)
+    {
+        out.commit(vec_format_item(out.room(), x, precision_));
+    };
+
+private:
+    int precision_;
+};
+
+template <typename T>
+class vec_item_writer<T, false> {
+public:
+    explicit vec_item_writer(int precision)
+    {
+        s_.precision(precision > 0 ? precision
+            : std::numeric_limits<T>::max_digits10);
+    }
+
+    template <typename B>
+    void operator()(B& out, const T& x)
+    {
+        s_.str(std::string());
+        s_ << x;
+        const std::string t = s_.str();
+        out.put(t.data(), t.size());
+    };
+
+private:
+    std::ostringstream s_;
+};
+
+// Format `n` items, `stride` apart
+template <typename T, typename Sink>
+void vec_format_items(const T* p, int n, int stride, const vec_format& fmt,
+    Sink sink)
+{
+    vec_format_buffer<Sink> out(sink);
+    vec_item_writer<T> item(fmt.precision);
+    const size_t sep = strlen(fmt.sep);
+#if __cplusplus < 201703L
+    vec_c_numeric c;                    // Once for all the items
+#endif
+
+    out.put(fmt.open, strlen(fmt.open));
+    for (int i = 0; i < n; i++) {
+        if (i)
+            out.put(fmt.sep, sep);
+        item(out, p[i * stride]);
+    }
+    out.put(fmt.close, strlen(fmt.close));
+    out.flush();
+}
+
+// Vecs and views are formatted in place, other expressions evaluated first
+template <typename T, typename A, typename Sink>
+void vec_format_expr(const vec<T, A>& v, const vec_format& fmt, Sink sink)
+{
+    vec_format_items(v.data(), v.size(), 1, fmt, sink);
+}
+
+template <typename T, typename Sink>
+void vec_format_expr(const vec_view<T>& v, const vec_format& fmt, Sink sink)
+{
+    vec_format_items(static_cast<const T*>(v.data()), v.size(), v.stride(),
+        fmt, sink);
+}
+
+template <typename E, typename Sink>
+void vec_format_expr(const vec_expr<E>& e, const vec_format& fmt, Sink sink)
+{
+    const vec<typename E::value_type> v(e.self());
+    vec_format_items(v.data(), v.size(), 1, fmt, sink);
+}
+
+template <typename E>
+std::string vec_expr<E>::str() const {
+    return str(vec_format());
+}
+
+template <typename E>
+std::string vec_expr<E>::str(const vec_format& fmt) const {
+    std::string s;
+    vec_format_expr(self(), fmt,
+        [&](const char* p, size_t n) {s.append(p, n);});
+    return s;
+}
+
+template <typename E>
+void vec_expr<E>::write_to(FILE* f) const {
+    write_to(f, vec_format());
+}
+
+template <typename E>
+void vec_expr<E>::write_to(FILE* f, const vec_format& fmt) const {
+    vec_format_expr(self(), fmt, [&](const char* p, size_t n) {
+        if (fwrite(p, 1, n, f) != n)
+            throw std::runtime_error("write_to(): cannot write");
+    });
+}
+
+#ifdef VEC_MMAP
+template <typename E>
+void vec_expr<E>::write_to(int fd) const {
+    write_to(fd, vec_format());
+}
+
+template <typename E>
+void vec_expr<E>::write_to(int fd, const vec_format& fmt) const {
+    vec_format_expr(self(), fmt, [&](const char* p, size_t n) {
+        while (n > 0) {
+            const ssize_t w = write(fd, p, n);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                throw std::runtime_error("write_to(): cannot write");
+            p += w;
+            n -= w;
+        }
+    });
+}
+#endif
+
+template <typename E>
+std::ostream& operator<<(std::ostream& strm, const vec_expr<E>& v) {
+    vec_format_expr(v.self(), vec_format(),
+        [&](const char* p, size_t n) {strm.write(p, n);});
+    return strm;
+}
+
+
+
+
+
+//////////////////
+// Binary Files //
+//////////////////
+
+// Write the items after a vec_file_header, see mmap_open()
+template <typename T, typename A>
+void vec<T, A>::save(const std::string& path) const
+{
+    static_assert(vec_type_tag<T>::value != VEC_TYPE_NONE,
+        "save(): only numbers and bools can be stored");
+
+    const vec_file_header h = vec_file_header::make(vec_type_tag<T>::value,
+        sizeof(T), size_);
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f)
+        throw std::runtime_error("save(): cannot open " + path);
+
+    bool ok = fwrite(&h, sizeof h, 1, f) == 1
+        && (size_ == 0 || fwrite(arr_, sizeof(T), size_, f) == size_t(size_));
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        throw std::runtime_error("save(): cannot write " + path);
+}
+
+// Map a file written by save(): nothing is parsed and pages are read from
+//   disk when first touched. The mapping is copy-on-write, changes to the
+//   items never reach the file. Growing the vec moves it to the allocator.
+//   Without mmap the file is read instead
+template <typename T, typename A>
+vec<T, A> vec<T, A>::mmap_open(const std::string& path)
+{
+    static_assert(vec_type_tag<T>::value != VEC_TYPE_NONE,
+        "mmap_open(): only numbers and bools can be stored");
+
+    vec<T, A> v;
+#ifdef VEC_MMAP
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("mmap_open(): cannot open " + path);
+
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(vec_file_header))
+        p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        throw std::runtime_error("mmap_open(): cannot map " + path);
+
+    const vec_file_header& h = *static_cast<const vec_file_header*>(p);
+    const char* err = h.error(vec_type_tag<T>::value, sizeof(T), st.st_size);
+    const int count = err ? 0 : static_cast<int>(h.count);
+    if (err || count == 0) {
+        munmap(p, st.st_size);
+        if (err)
+            throw std::runtime_error("mmap_open(): " + path + " " + err);
+        return v;
+    }
+
+    v.release();
+    v.arr_ = reinterpret_cast<T*>(static_cast<char*>(p) + sizeof h);
+    v.size_ = count;
+    v.allocsize_ = -count;
+#else
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        throw std::runtime_error("mmap_open(): cannot open " + path);
+
+    vec_file_header h;
+    const bool ok = fread(&h, sizeof h, 1, f) == 1 && fseek(f, 0, SEEK_END) == 0;
+    const long bytes = ok ? ftell(f) : 0;
+    const char* err = ok ? h.error(vec_type_tag<T>::value, sizeof(T), bytes)
+        : "not a vec file";
+    if (!err) {
+        v.resize(static_cast<int>(h.count));
+        fseek(f, sizeof h, SEEK_SET);
+        if (fread(v.arr_, sizeof(T), v.size_, f) != size_t(v.size_))
+            err = "cannot be read";
+    }
+    fclose(f);
+    if (err)
+        throw std::runtime_error("mmap_open(): " + path + " " + err);
+#endif
+    return v;
+}
+
+
+
+
+//////////////////
+// Modification //
+//////////////////
+
+template <typename T, typename A>
+void vec<T, A>::append(T x)  {
+    //Do we need to increase the vector array size?
+    if (size_+1 > allocsize_) {
+        realloc(grow_to(size_+1));
+    }
+
+    arr_[size_] = std::move(x);
+    size_++;
+}
+
+template <typename T, typename A>
+void vec<T, A>::append(const vec<T, A>& v)
+{
+    int newsize = size_ + v.size_;
+
+    if (newsize > allocsize_)
+        realloc(grow_to(newsize));
+
+    // Copy the items
+    for (int i = size_, j = 0; i < newsize; i++, j++)
+        arr_[i] = v.arr_[j];
+
+    size_ = newsize;
+}
+
+// The slot past the end already holds a default constructed item
+//   (see allocate()), so it is replaced in place
+template <typename T, typename A>
+template <typename... Args>
+T& vec<T, A>::emplace(Args&&... args)
+{
+    if (size_+1 > allocsize_) {
+        realloc(grow_to(size_+1));
+    }
+
+    T* slot = arr_ + size_;
+    if (std::is_nothrow_constructible<T, Args&&...>::value) {
+        slot->~T();
+        new (slot) T(std::forward<Args>(args)...);
+    } else {
+        *slot = T(std::forward<Args>(args)...);
+    }
+
+    size_++;
+    return *slot;
+}
+
+template <typename T, typename A>
+void vec<T, A>::swap(int i, int j) {
+    //Bounds check
+    if (!(i >= 0 && i < size_ && j >= 0 && j < size_)) {
+        throw std::out_of_range("vec::swap() bounds error");
+    }
+
+    int tmp = arr_[i];
+    arr_[i] = arr_[j];
+    arr_[j] = tmp;
+}
+
+template <typename T, typename A>
+void vec<T, A>::reverse() {
+    int i = 0;
+    int j = size_-1;
+    while (i < j) {
+        swap(i++, j--);
+    }
+}
+
+
+
+
+
+
+//////////////
+// Sublists //
+//////////////
+
+template <typename T, typename A>
+T vec<T, A>::head() const
+{
+    if (size_ == 0)
+        throw std::out_of_range("head(): vec has no elements");
+
+    return arr_[0];
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::head(int items) const
+{
+    return head(items, 0);
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::head(int items, T overtake) const
+{
+    vec v = vec<T, A>(items);
+    v.size_ = items;
+
+    //Overtake
+    if (items > size_) {
+        for (int i = 0; i < size_; i++) {
+            v.arr_[i] = arr_[i];
+        }
+        for (int i = size_; i < items; i++) {
+            v.arr_[i] = overtake;
+        }
+    } else {
+        for (int i = 0; i < items; i++) {
+            v.arr_[i] = arr_[i];
+        }
+    }
+
+    return v;
+}
+
+template <typename T, typename A>
+T vec<T, A>::tail() const
+{
+    if (size_ == 0)
+        throw std::out_of_range("tail(): vec has no elements");
+
+    return arr_[size_-1];
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::tail(int items) const
+{
+    return tail(items, 0);
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::tail(int items, T overtake) const
+{
+    vec v = vec<T, A>(items);
+    v.size_ = items;
+    //Overtake
+    if (items > size_)
+    {
+        int start = items-size_;
+        // overtake
+        for (int i = 0; i < start; i++)
+            v.arr_[i] = overtake;
+
+        // copy in the back of the array
+        for (int i = start, j = 0; i < items; i++, j++)
+            v.arr_[i] = arr_[j];
+
+    } else {
+        int start = size_ - items;
+        for (int i = start, j = 0; j < items; j++, i++)
+            v.arr_[j] = arr_[i];
+    }
+
+    return v;
+}
+
+template <typename T, typename A>
+void vec<T, A>::pop()
+{
+    size_ -= 1;
+}
+
+template <typename T, typename A>
+void vec<T, A>::pop(int n)
+{
+    size_ -= n;
+
+    if (size_ < 0)
+        size_ = 0;
+}
+
+
+
+
+
+///////////
+// Views //
+///////////
+
+// A window into the items of a `vec`: a pointer, a length and a stride.
+//   Nothing is copied. Views are expressions, so operators, reductions
+//   and vectorized functions accept them; contiguous ones (stride 1) go
+//   through the SIMD kernels like a `vec`. A view is only valid while its
+//   `vec` is alive and does not reallocate (append, resize, ...)
+//
+//     vec<int> v = vec<int>::range(10);
+//     sum(v.slice(2, 5));                  // 2 + 3 + 4
+//     v.slice(0, 10, 2).str();             // <0, 2, 4, 6, 8>
+//     v.slice(INT_MAX, INT_MIN, -1);       // Reversed, the bounds clamp
+template <typename T>
+class vec_view : public vec_expr<vec_view<T>> {
+public:
+    typedef typename std::remove_const<T>::type value_type;
+
+    vec_view() : ptr_(nullptr), size_(0), stride_(1) {}
+    vec_view(T* ptr, int size, int stride = 1)
+        : ptr_(ptr), size_(size), stride_(stride) {}
+    template <typename U, typename = typename std::enable_if<
+        std::is_same<const U, T>::value>::type>
+    vec_view(const vec_view<U>& v)      // Writable to read-only
+        : ptr_(v.data()), size_(v.size()), stride_(v.stride()) {}
+
+    int size() const {return size_;};
+    int stride() const {return stride_;};
+    T* data() const {return ptr_;};     // The first item
+    const value_type& eval(int i) const {return ptr_[i * stride_];};
+    T& operator[](int i) const;
+
+    vec_view slice(int start, int stop, int step = 1) const;
+
+private:
+    T* ptr_;
+    int size_;
+    int stride_;
+};
+
+// Clamp `start` and `stop` like Python does for a sequence of `size`
+//   items and return the number of items in the slice
+inline int vec_slice_bounds(int size, int& start, int stop, int step)
+{
+    if (step == 0)
+        throw std::invalid_argument("slice(): step cannot be 0");
+
+    const int lower = step > 0 ? 0 : -1;
+    const int upper = step > 0 ? size : size - 1;
+    if (start < 0)
+        start += size;
+    start = start < lower ? lower : start > upper ? upper : start;
+    if (stop < 0)
+        stop += size;
+    stop = stop < lower ? lower : stop > upper ? upper : stop;
+
+    if (step > 0)
+        return stop > start ? (stop - start - 1) / step + 1 : 0;
+    return start > stop ? (start - stop - 1) / -step + 1 : 0;
+}
+
+template <typename T>
+T& vec_view<T>::operator[](int i) const
+{
+    if (i < 0)
+        i = size_ + i;
+
+    if (i >= 0 && i < size_)
+        return ptr_[i * stride_];
+
+    throw std::out_of_range("Invalid position!");
+}
+
+template <typename T>
+vec_view<T> vec_view<T>::slice(int start, int stop, int step) const
+{
+    const int size = vec_slice_bounds(size_, start, stop, step);
+    return vec_view<T>(size ? ptr_ + start * stride_ : ptr_, size,
+        stride_ * step);
+}
+
+template <typename T, typename A>
+vec_view<T> vec<T, A>::slice(int start, int stop, int step)
+{
+    return view().slice(start, stop, step);
+}
+
+template <typename T, typename A>
+vec_view<const T> vec<T, A>::slice(int start, int stop, int step) const
+{
+    return view().slice(start, stop, step);
+}
+
+
+
+
+
+////////////////
+// Functional //
+////////////////
+
+template <typename T, typename A>
+vec<T, A>& vec<T, A>::apply(auto fn) {
+    return apply(vec_exec_default(), fn);
+}
+
+// Under vec_exec::par, `fn` is called from several threads at once
+template <typename T, typename A>
+vec<T, A>& vec<T, A>::apply(vec_exec policy, auto fn) {
+    const int chunks = vec_par_chunks(policy, size_);
+    vec_parallel_for(chunks, [&](int c) {
+        const int end = vec_chunk_begin(size_, chunks, c+1);
+        for (int i = vec_chunk_begin(size_, chunks, c); i < end; i++)
+            arr_[i] = fn(arr_[i]);
+    });
+    return *this;
+}
+
+template <typename T, typename A>
+template <typename E>
+vec<T, A>& vec<T, A>::apply_to(const vec_expr<E>& filter, auto fn) {
+    return apply_to(vec_exec_default(), filter, fn);
+}
+
+template <typename T, typename A>
+template <typename E>
+vec<T, A>& vec<T, A>::apply_to(vec_exec policy, const vec_expr<E>& filter, auto fn) {
+    const E& f = filter.self();
+    if (f.size() != size_)
+        throw std::out_of_range("take: length error");
+
+    const int chunks = vec_par_chunks(policy, size_);
+    vec_parallel_for(chunks, [&](int c) {
+        const int end = vec_chunk_begin(size_, chunks, c+1);
+        for (int i = vec_chunk_begin(size_, chunks, c); i < end; i++)
+            if (f.eval(i))
+                arr_[i] = fn(arr_[i]);
+    });
+
+    return *this;
+}
+
+
+////////////////
+// Operators  //
+////////////////
+
+
+IMPL_BOP(add, +);
+IMPL_BOP(sub, -);
+IMPL_BOP(mul, *);
+IMPL_BOP(div, /);
+IMPL_BOP(mod, %);
+IMPL_BOP(and, &&);
+IMPL_BOP(or, ||);
+IMPL_BOP(bitand, &);
+IMPL_BOP(bitor, |);
+
+BOP_COMPOUND(add, +=);
+BOP_COMPOUND(sub, -=);
+BOP_COMPOUND(mul, *=);
+BOP_COMPOUND(div, /=);
+BOP_COMPOUND(mod, %=);
+BOP_COMPOUND(bitand, &=);
+BOP_COMPOUND(bitor, |=);
+
+IMPL_COMP(lt, <);
+IMPL_COMP(gt, >);
+IMPL_COMP(le, <=);
+IMPL_COMP(ge, >=);
+IMPL_COMP(eq, ==);
+IMPL_COMP(ne, !=);
+
+
+struct vec_op_not {
+    static const char* name() {return "not";};
+    template <typename A>
+    bool operator()(const A& a) const
+    {
+        return !a;
+    }
+};
+
+template <typename E>
+vec_unary_expr<vec_op_not, bool, E> operator!(const vec_expr<E>& v)
+{
+    return vec_unary_expr<vec_op_not, bool, E>(v.self());
+}
+
+// The smaller / larger of two elements, used by min() and max()
+struct vec_op_min {
+    static const char* name() {return "min";};
+    template <typename A>
+    A operator()(const A& a, const A& b) const
+    {
+        return a > b ? b : a;
+    }
+};
+
+struct vec_op_max {
+    static const char* name() {return "max";};
+    template <typename A>
+    A operator()(const A& a, const A& b) const
+    {
+        return a < b ? b : a;
+    }
+};
+
+
+//////////////////
+// SIMD Kernels //
+//////////////////
+
+// A `vec` OP `vec` (or atom) node whose operands are both int32, int64,
+//   float or double is evaluated with explicit SSE2/AVX2/AVX-512 kernels.
+//   The instruction set is detected once, the first time a kernel runs.
+//   Combinations the hardware has no instruction for (integer division,
+//   int32 multiplication on SSE2, ...) and nested expressions use the
+//   fused scalar loop. Define VEC_NO_SIMD to disable the kernels.
+
+enum vec_isa {
+    VEC_ISA_SCALAR,
+    VEC_ISA_SSE2,
+    VEC_ISA_AVX2,
+    VEC_ISA_AVX512
+};
+
+inline int vec_detect_isa()
+{
+#ifdef VEC_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return VEC_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return VEC_ISA_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return VEC_ISA_SSE2;
+#endif
+    return VEC_ISA_SCALAR;
+}
+
+// The instruction set used by the kernels. May be lowered, e.g. to
+//   compare the kernels against each other, but never raised above
+//   what the CPU supports
+inline int& vec_simd_isa()
+{
+    static int isa = vec_detect_isa();
+    return isa;
+}
+
+inline bool vec_detect_fma()
+{
+#ifdef VEC_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+}
+
+// Whether the AVX2 BLAS kernels, the only AVX2 ones that need fused
+//   multiply-add, may run. Without it they fall back to the SSE2 ones.
+//   May be turned off like vec_simd_isa(), never on without FMA
+inline bool& vec_simd_fma()
+{
+    static bool fma = vec_detect_fma();
+    return fma;
+}
+
+// Write the low `width` bits of `m` as bools
+inline void vec_expand_mask(bool* out, unsigned m, int width)
+{
+    for (int j = 0; j < width; j++)
+        out[j] = (m >> j) & 1;
+}
+
+// Loops shared by every instruction set. `shape` tells which operand
+//   is an atom: 0 = vec OP vec, 1 = vec OP atom, 2 = atom OP vec
+//   compare() writes either one bool per element or packed 64 bit words
+//   reduce() folds with four independent accumulators. The new items go
+//   first: min and max instructions return their second operand when
+//   either is NaN, so like the scalar loop a NaN never replaces the
+//   running value, unless it is that value
+#define VEC_SIMD_LOOPS(TARGET)                                          \
+    template <typename Op, typename T>                                  \
+    static TARGET void arith(T* out, const T* a, const T* b,            \
+        int n, int shape)                                               \
+    {                                                                   \
+        if (n == 0)                                                     \
+            return;                                                     \
+        const int sa = shape == 2 ? 0 : 1;                              \
+        const int sb = shape == 1 ? 0 : 1;                              \
+        reg va = set1(*a);                                              \
+        reg vb = set1(*b);                                              \
+        int i = 0;                                                      \
+        for (; i + width <= n; i += width) {                            \
+            if (sa) va = load(a + i);                                   \
+            if (sb) vb = load(b + i);                                   \
+            store(out + i, apply(Op(), va, vb));                        \
+        }                                                               \
+        for (; i < n; i++)                                              \
+            out[i] = static_cast<T>(Op()(a[i * sa], b[i * sb]));        \
+    }                                                                   \
+                                                                        \
+    template <typename Op, typename T>                                  \
+    static TARGET void compare(bool* out, const T* a, const T* b,       \
+        int n, int shape)                                               \
+    {                                                                   \
+        if (n == 0)                                                     \
+            return;                                                     \
+        const int sa = shape == 2 ? 0 : 1;                              \
+        const int sb = shape == 1 ? 0 : 1;                              \
+        reg va = set1(*a);                                              \
+        reg vb = set1(*b);                                              \
+        int i = 0;                                                      \
+        for (; i + width <= n; i += width) {                            \
+            if (sa) va = load(a + i);                                   \
+            if (sb) vb = load(b + i);                                   \
+            vec_expand_mask(out + i, cmp(Op(), va, vb), width);         \
+        }                                                               \
+        for (; i < n; i++)                                              \
+            out[i] = Op()(a[i * sa], b[i * sb]);                        \
+    }                                                                   \
+                                                                        \
+    template <typename Op, typename T>                                  \
+    static TARGET void compare(uint64_t* out, const T* a, const T* b,   \
+        int n, int shape)                                               \
+    {                                                                   \
+        if (n == 0)                                                     \
+            return;                                                     \
+        const int sa = shape == 2 ? 0 : 1;                              \
+        const int sb = shape == 1 ? 0 : 1;                              \
+        reg va = set1(*a);                                              \
+        reg vb = set1(*b);                                              \
+        for (int i = 0, w = 0; i < n; w++) {                            \
+            const int len = n - i < 64 ? n - i : 64;                    \
+            uint64_t word = 0;                                          \
+            int j = 0;                                                  \
+            for (; j + width <= len; j += width, i += width) {          \
+                if (sa) va = load(a + i);                               \
+                if (sb) vb = load(b + i);                               \
+                word |= static_cast<uint64_t>(cmp(Op(), va, vb)) << j;  \
+            }                                                           \
+            for (; j < len; j++, i++)                                   \
+                word |= static_cast<uint64_t>(                          \
+                    Op()(a[i * sa], b[i * sb])) << j;                   \
+            out[w] = word;                                              \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    template <typename Op, typename T>                                  \
+    static TARGET T reduce(const T* a, int n, T init)                   \
+    {                                                                   \
+        reg acc0 = set1(init);                                          \
+        reg acc1 = acc0;                                                \
+        reg acc2 = acc0;                                                \
+        reg acc3 = acc0;                                                \
+        int i = 0;                                                      \
+        for (; i + 4 * width <= n; i += 4 * width) {                    \
+            acc0 = apply(Op(), load(a + i), acc0);                      \
+            acc1 = apply(Op(), load(a + i + width), acc1);              \
+            acc2 = apply(Op(), load(a + i + 2 * width), acc2);          \
+            acc3 = apply(Op(), load(a + i + 3 * width), acc3);          \
+        }                                                               \
+        for (; i + width <= n; i += width)                              \
+            acc0 = apply(Op(), load(a + i), acc0);                      \
+        acc0 = apply(Op(), apply(Op(), acc3, acc2),                     \
+            apply(Op(), acc1, acc0));                                   \
+                                                                        \
+        T lanes[width];                                                 \
+        store(lanes, acc0);                                             \
+        T total = lanes[0];                                             \
+        for (int j = 1; j < width; j++)                                 \
+            total = static_cast<T>(Op()(total, lanes[j]));              \
+        for (; i < n; i++)                                              \
+            total = static_cast<T>(Op()(total, a[i]));                  \
+        return total;                                                   \
+    }
+
+// How VECTORIZE_FN functions on vecs of floats and doubles are computed:
+//   exact calls libm for every element, fast uses the SIMD kernels below.
+//   Either way sqrt() uses the (correctly rounded) SIMD instruction.
+//   Largest errors of the fast kernels in units in the last place,
+//   measured against long double results over 20M random samples of each
+//   range (uniform and by exponent) and the items next to each n pi/2
+//   (libm itself is within 0.5 to 2):
+//
+//                   double   float    range computed by the kernel
+//     exp            1.2      1.2     |x| < 708 (double), 87 (float)
+//     log            1.5      1.5     positive, normal
+//     log2, log10    0.8      0.9     positive, normal
+//     sin, cos       1.6      1.6     |x| < 2^20 (double), 1024 (float)
+//     tan            3.6      3.6     as sin
+//     tanh           3.4      3.3     all
+//     atan           1.0      2.3     all
+//     cbrt           0.8      0.8     normal
+//
+//   Elements outside the range (NaN, infinities, denormals, large
+//   arguments of sin, ...) are handed to libm, so the special cases
+//   always match it.
+enum class vec_math {
+    exact,
+    fast
+};
+
+inline vec_math& vec_math_mode()
+{
+    static vec_math mode = vec_math::exact;
+    return mode;
+}
+
+enum vec_math_fn {
+    VEC_MATH_NONE,
+    VEC_MATH_SQRT,
+    VEC_MATH_EXP,
+    VEC_MATH_LOG,
+    VEC_MATH_LOG2,
+    VEC_MATH_LOG10,
+    VEC_MATH_SIN,
+    VEC_MATH_COS,
+    VEC_MATH_TAN,
+    VEC_MATH_TANH,
+    VEC_MATH_ATAN,
+    VEC_MATH_CBRT
+};
+
+// The kernel of a VECTORIZE_FN functor, set next to the VECTORIZE_FN lines
+template <typename Fn>
+struct vec_math_id {static const vec_math_fn value = VEC_MATH_NONE;};
+
+// Constants of the math kernels for each type
+template <typename T>
+struct vec_math_consts;
+
+template <>
+struct vec_math_consts<double> {
+    typedef uint64_t bits;
+    static const bits sign = 0x8000000000000000ull;
+    static const bits mant_mask = 0x000FFFFFFFFFFFFFull;
+    static const bits hi_mask = 0xFFFFFFFF00000000ull;   // Upper half
+    static const bits one = 0x3FF0000000000000ull;
+    static const bits two_mant = 0x4330000000000000ull;  // 2^52
+    enum {mant = 52, bias = 1023};
+
+    static constexpr double magic = 6755399441055744.0;  // 1.5 * 2^52
+    static constexpr double min_normal = 2.2250738585072014e-308;
+    static constexpr double huge = 1.7976931348623157e308;
+    static constexpr double sqrt2 = 1.4142135623730951;
+
+    // exp, tanh
+    static constexpr double log2e = 1.4426950408889634;
+    static constexpr double ln2_hi = 6.93147180369123816490e-01;
+    static constexpr double ln2_lo = 1.90821492927058770002e-10;
+    static constexpr double exp_limit = 708, tanh_limit = 20;
+
+    // log2, log10, from fdlibm
+    static constexpr double ivln2_hi = 1.44269504072144627571e+00;
+    static constexpr double ivln2_lo = 1.67517131648865118353e-10;
+    static constexpr double ivln10_hi = 4.34294481878168880939e-01;
+    static constexpr double ivln10_lo = 2.50829467116452752298e-11;
+    static constexpr double log10_2_hi = 3.01029995663611771306e-01;
+    static constexpr double log10_2_lo = 3.69423907715893078616e-13;
+
+    // pi / 2 in four parts of fdlibm, the first three of 33 bits so that
+    //   their products with n < 2^20 are exact
+    static constexpr double two_over_pi = 0.6366197723675814;
+    static constexpr double pio2_1 = 1.57079632673412561417e+00;
+    static constexpr double pio2_2 = 6.07710050630396597660e-11;
+    static constexpr double pio2_3 = 2.02226624871116645580e-21;
+    static constexpr double pio2_4 = 8.47842766036889956997e-32;
+    static constexpr double trig_limit = 1048576;
+    static constexpr double trig_tiny = 7.450580596923828e-09;
+
+    // atan, `atan_more` is pi / 2 - pio2
+    static constexpr double pio2 = 1.5707963267948966;
+    static constexpr double pio4 = 0.7853981633974483;
+    static constexpr double tan3pio8 = 2.414213562373095, atan_mid = 0.66;
+    static constexpr double atan_more = 6.123233995736765886130e-17;
+
+    // cbrt, cube roots of 2 and 4
+    static constexpr double cbrt2 = 1.2599210498948732;
+    static constexpr double cbrt4 = 1.5874010519681994;
+    enum {cbrt_steps = 3};
+
+    // Coefficients, lowest degree first
+    enum {exp_terms = 14, expm1_terms = 13, log_terms = 11};
+    enum {sin_terms = 8, cos_terms = 8};
+    enum {atan_p_terms = 5, atan_q_terms = 6};
+    static const double* exp_poly()            // 1 / k!
+    {
+        static const double c[] = {
+            1.0, 1.0, 0.5, 0.16666666666666666, 0.041666666666666664,
+            0.008333333333333333, 0.001388888888888889,
+            0.0001984126984126984, 2.48015873015873e-05,
+            2.7557319223985893e-06, 2.755731922398589e-07,
+            2.505210838544172e-08, 2.08767569878681e-09,
+            1.6059043836821613e-10};
+        return c;
+    }
+    static const double* expm1_poly()          // 1 / (k + 1)!
+    {
+        static const double c[] = {
+            1.0, 0.5, 0.16666666666666666, 0.041666666666666664,
+            0.008333333333333333, 0.001388888888888889,
+            0.0001984126984126984, 2.48015873015873e-05,
+            2.7557319223985893e-06, 2.755731922398589e-07,
+            2.505210838544172e-08, 2.08767569878681e-09,
+            1.6059043836821613e-10};
+        return c;
+    }
+    static const double* log_poly()            // 2 / (2k + 3)
+    {
+        static const double c[] = {
+            0.6666666666666666, 0.4, 0.2857142857142857,
+            0.2222222222222222, 0.18181818181818182, 0.15384615384615385,
+            0.13333333333333333, 0.11764705882352941, 0.10526315789473684,
+            0.09523809523809523, 0.08695652173913043};
+        return c;
+    }
+    static const double* sin_poly()            // (-1)^k / (2k + 1)!, from k = 1
+    {
+        static const double c[] = {
+            -0.16666666666666666, 0.008333333333333333,
+            -0.0001984126984126984, 2.7557319223985893e-06,
+            -2.505210838544172e-08, 1.6059043836821613e-10,
+            -7.647163731819816e-13, 2.8114572543455206e-15};
+        return c;
+    }
+    static const double* cos_poly()            // (-1)^k / (2k)!, from k = 2
+    {
+        static const double c[] = {
+            0.041666666666666664, -0.001388888888888889,
+            2.48015873015873e-05, -2.755731922398589e-07,
+            2.08767569878681e-09, -1.1470745597729725e-11,
+            4.779477332387385e-14, -1.5619206968586225e-16};
+        return c;
+    }
+    static const double* atan_p()              // From Cephes
+    {
+        static const double c[] = {
+            -64.85021904942025, -122.88666844901361, -75.00855792314705,
+            -16.157537187333652, -0.8750608600031904};
+        return c;
+    }
+    static const double* atan_q()
+    {
+        static const double c[] = {
+            194.5506571482614, 485.3903996359137, 432.88106049129027,
+            165.02700983169885, 24.858464901423062, 1.0};
+        return c;
+    }
+};
+
+template <>
+struct vec_math_consts<float> {
+    typedef uint32_t bits;
+    static const bits sign = 0x80000000u;
+    static const bits mant_mask = 0x007FFFFFu;
+    static const bits hi_mask = 0xFFFFF000u;
+    static const bits one = 0x3F800000u;
+    static const bits two_mant = 0x4B000000u;            // 2^23
+    enum {mant = 23, bias = 127};
+
+    static constexpr float magic = 12582912.0f;          // 1.5 * 2^23
+    static constexpr float min_normal = 1.17549435e-38f;
+    static constexpr float huge = 3.40282347e38f;
+    static constexpr float sqrt2 = 1.41421356f;
+
+    static constexpr float log2e = 1.44269504f;
+    static constexpr float ln2_hi = 6.9313812256e-01f;
+    static constexpr float ln2_lo = 9.0580006145e-06f;
+    static constexpr float exp_limit = 87, tanh_limit = 9;
+
+    static constexpr float ivln2_hi = 1.4428710938e+00f;
+    static constexpr float ivln2_lo = -1.7605285393e-04f;
+    static constexpr float ivln10_hi = 4.3432617188e-01f;
+    static constexpr float ivln10_lo = -3.1689971365e-05f;
+    static constexpr float log10_2_hi = 3.0102920532e-01f;
+    static constexpr float log10_2_lo = 7.9034151668e-07f;
+
+    static constexpr float two_over_pi = 0.636619772f;
+    static constexpr float pio2_1 = 1.5706787109375f;
+    static constexpr float pio2_2 = 1.17614865303039550781e-04f;
+    static constexpr float pio2_3 = 9.92031345958821475506e-10f;
+    static constexpr float pio2_4 = 6.22337196966998851266e-14f;
+    static constexpr float trig_limit = 1024, trig_tiny = 2.44140625e-04f;
+
+    static constexpr float pio2 = 1.57079633f, pio4 = 0.785398163f;
+    static constexpr float tan3pio8 = 2.41421356f, atan_mid = 0.414213562f;
+    static constexpr float atan_more = -4.37113883e-08f;
+
+    static constexpr float cbrt2 = 1.25992105f, cbrt4 = 1.58740105f;
+    enum {cbrt_steps = 2};
+
+    // Coefficients, lowest degree first
+    enum {exp_terms = 8, expm1_terms = 7, log_terms = 5};
+    enum {sin_terms = 4, cos_terms = 4};
+    enum {atan_p_terms = 4, atan_q_terms = 1};
+    static const float* exp_poly()            // 1 / k!
+    {
+        static const float c[] = {
+            1.0f, 1.0f, 0.5f, 0.166666667f, 0.0416666667f, 0.00833333333f,
+            0.00138888889f, 0.000198412698f};
+        return c;
+    }
+    static const float* expm1_poly()          // 1 / (k + 1)!
+    {
+        static const float c[] = {
+            1.0f, 0.5f, 0.166666667f, 0.0416666667f, 0.00833333333f,
+            0.00138888889f, 0.000198412698f};
+        return c;
+    }
+    static const float* log_poly()            // 2 / (2k + 3)
+    {
+        static const float c[] = {
+            0.666666667f, 0.4f, 0.285714286f, 0.222222222f, 0.181818182f};
+        return c;
+    }
+    static const float* sin_poly()            // (-1)^k / (2k + 1)!, from k = 1
+    {
+        static const float c[] = {
+            -0.166666667f, 0.00833333333f, -0.000198412698f, 2.75573192e-06f};
+        return c;
+    }
+    static const float* cos_poly()            // (-1)^k / (2k)!, from k = 2
+    {
+        static const float c[] = {
+            0.0416666667f, -0.00138888889f, 2.48015873e-05f,
+            -2.75573192e-07f};
+        return c;
+    }
+    static const float* atan_p()              // From Cephes
+    {
+        static const float c[] = {
+            -0.333329492f, 0.199777106f, -0.138776856f, 0.080537445f};
+        return c;
+    }
+    static const float* atan_q()
+    {
+        static const float c[] = {1.0f};
+        return c;
+    }
+};
+
+// The math kernels, written once for every instruction set. Besides the
+//   loads, stores and arithmetic of VEC_SIMD_LOOPS, they need:
+//     madd(a, b, c)        a * b + c, fused on AVX-512
+//     sqrt(a)
+//     band, bor, bxor      bitwise operators
+//     bandn(a, b)          ~a & b
+//     less(a, b)           all ones in the lanes where a < b
+//     lanes(m)             one bit per lane of a less() mask
+//     shl(a), shr(a)       shift the bits of each lane by `mant`
+#define VEC_SIMD_MATH(TARGET)                                           \
+    typedef vec_math_consts<elem> mc;                                   \
+                                                                        \
+    static TARGET reg cbits(typename mc::bits b)                        \
+    {                                                                   \
+        elem x;                                                         \
+        memcpy(&x, &b, sizeof x);                                       \
+        return set1(x);                                                 \
+    }                                                                   \
+    static TARGET reg add(reg a, reg b) {return apply(vec_op_add(), a, b);}; \
+    static TARGET reg sub(reg a, reg b) {return apply(vec_op_sub(), a, b);}; \
+    static TARGET reg mul(reg a, reg b) {return apply(vec_op_mul(), a, b);}; \
+    static TARGET reg div(reg a, reg b) {return apply(vec_op_div(), a, b);}; \
+    static TARGET reg select(reg m, reg a, reg b)                       \
+    {                                                                   \
+        return bor(band(m, a), bandn(m, b));                            \
+    }                                                                   \
+    static TARGET reg fabs(reg a) {return bandn(cbits(mc::sign), a);};  \
+    static TARGET reg round(reg a)      /* To nearest, |a| < 2^(mant-1) */ \
+    {                                                                   \
+        return sub(add(a, set1(mc::magic)), set1(mc::magic));           \
+    }                                                                   \
+    static TARGET reg poly(reg x, const elem* c, int n)                 \
+    {                                                                   \
+        reg p = set1(c[n - 1]);                                         \
+        for (int k = n - 2; k >= 0; k--)                                \
+            p = madd(p, x, set1(c[k]));                                 \
+        return p;                                                       \
+    }                                                                   \
+    /* 2^n for an integral n in the normal range */                     \
+    static TARGET reg pow2(reg n)                                       \
+    {                                                                   \
+        return shl(add(n, set1(mc::magic + mc::bias)));                 \
+    }                                                                   \
+    /* x = m * 2^e with m in [1, 2), for a positive normal x */        \
+    static TARGET reg frexp1(reg x, reg& e)                             \
+    {                                                                   \
+        e = sub(bor(shr(x), cbits(mc::two_mant)),                       \
+            set1(elem(uint64_t(1) << mc::mant) + mc::bias));            \
+        return bor(band(x, cbits(mc::mant_mask)), cbits(mc::one));      \
+    }                                                                   \
+    static elem libm(int fn, elem a)                                    \
+    {                                                                   \
+        switch (fn) {                                                   \
+        case VEC_MATH_EXP: return std::exp(a);                          \
+        case VEC_MATH_LOG: return std::log(a);                          \
+        case VEC_MATH_LOG2: return std::log2(a);                        \
+        case VEC_MATH_LOG10: return std::log10(a);                      \
+        case VEC_MATH_SIN: return std::sin(a);                          \
+        case VEC_MATH_COS: return std::cos(a);                          \
+        case VEC_MATH_TAN: return std::tan(a);                          \
+        case VEC_MATH_TANH: return std::tanh(a);                        \
+        case VEC_MATH_ATAN: return std::atan(a);                        \
+        default: return std::cbrt(a);                                   \
+        }                                                               \
+    }                                                                   \
+    /* Recompute the lanes outside of `ok` with libm */                 \
+    static TARGET reg fix(reg r, reg x, reg ok, int fn)                 \
+    {                                                                   \
+        const unsigned m = lanes(ok);                                   \
+        if (m == (1u << width) - 1)                                     \
+            return r;                                                   \
+        elem rs[width], xs[width];                                      \
+        store(rs, r);                                                   \
+        store(xs, x);                                                   \
+        for (int j = 0; j < width; j++)                                 \
+            if (!((m >> j) & 1))                                        \
+                rs[j] = libm(fn, xs[j]);                                \
+        return load(rs);                                                \
+    }                                                                   \
+                                                                        \
+    static TARGET reg exp_kernel(reg x)                                 \
+    {                                                                   \
+        const reg n = round(mul(x, set1(mc::log2e)));                   \
+        reg r = madd(n, set1(-mc::ln2_hi), x);                          \
+        r = madd(n, set1(-mc::ln2_lo), r);                              \
+        const reg y = mul(poly(r, mc::exp_poly(), mc::exp_terms), pow2(n)); \
+        return fix(y, x, less(fabs(x), set1(mc::exp_limit)), VEC_MATH_EXP); \
+    }                                                                   \
+                                                                        \
+    /* fdlibm: log(m) = g - (g^2 / 2 - s (g^2 / 2 + R(s^2))) with */    \
+    /*   g = m - 1, s = g / (2 + g), and the sum split in high and low */ \
+    /*   parts for log2 and log10 */                                    \
+    static TARGET reg log_kernel(reg x, int fn)                         \
+    {                                                                   \
+        const reg one = set1(elem(1));                                  \
+        reg e;                                                          \
+        reg m = frexp1(x, e);                                           \
+        const reg big = less(set1(mc::sqrt2), m);                       \
+        m = select(big, mul(m, set1(elem(0.5))), m);                    \
+        e = select(big, add(e, one), e);                                \
+        const reg g = sub(m, one);                                      \
+        const reg s = div(g, add(g, set1(elem(2))));                    \
+        const reg z = mul(s, s);                                        \
+        const reg hfsq = mul(mul(g, g), set1(elem(0.5)));               \
+        const reg r = mul(z, poly(z, mc::log_poly(), mc::log_terms));   \
+        const reg sr = mul(s, add(hfsq, r));                            \
+                                                                        \
+        reg y;                                                          \
+        if (fn == VEC_MATH_LOG) {                                       \
+            y = sub(madd(e, set1(mc::ln2_hi), g),                       \
+                sub(hfsq, madd(e, set1(mc::ln2_lo), sr)));              \
+        } else {                                                        \
+            const reg hi = band(sub(g, hfsq), cbits(mc::hi_mask));      \
+            const reg lo = add(sub(sub(g, hi), hfsq), sr);              \
+            const bool two = fn == VEC_MATH_LOG2;                       \
+            const reg ivhi = set1(two ? mc::ivln2_hi : mc::ivln10_hi);  \
+            const reg ivlo = set1(two ? mc::ivln2_lo : mc::ivln10_lo);  \
+            const reg ye = two ? e : mul(e, set1(mc::log10_2_hi));      \
+            const reg vhi = mul(hi, ivhi);                              \
+            reg vlo = madd(add(lo, hi), ivlo, mul(lo, ivhi));           \
+            if (!two)                                                   \
+                vlo = madd(e, set1(mc::log10_2_lo), vlo);               \
+            const reg w = add(ye, vhi);                                 \
+            y = add(add(vlo, add(sub(ye, w), vhi)), w);                 \
+        }                                                               \
+        const reg ok = bandn(less(x, set1(mc::min_normal)),             \
+            less(x, set1(mc::huge)));                                   \
+        return fix(y, x, ok, fn);                                       \
+    }                                                                   \
+                                                                        \
+    /* x = n pi/2 + r, then the sine or cosine of r by the quadrant. */ \
+    /*   The steps subtracting n pio2_k round only when the result is */ \
+    /*   large next to what is left, and their rounding errors are */   \
+    /*   added back at the end, so r is rounded once */                 \
+    static TARGET reg trig_kernel(reg x, int fn)                        \
+    {                                                                   \
+        const reg n = round(mul(x, set1(mc::two_over_pi)));             \
+        const reg r1 = madd(n, set1(-mc::pio2_1), x);                   \
+        const reg t2 = mul(n, set1(mc::pio2_2));                        \
+        const reg r2 = sub(r1, t2);                                     \
+        const reg t3 = mul(n, set1(mc::pio2_3));                        \
+        const reg r3 = sub(r2, t3);                                     \
+        const reg e = add(sub(sub(r1, r2), t2), sub(sub(r2, r3), t3));  \
+        const reg r = add(r3, madd(n, set1(-mc::pio2_4), e));           \
+        const reg s = mul(r, r);                                        \
+        const reg sn = madd(mul(r, s),                                  \
+            poly(s, mc::sin_poly(), mc::sin_terms), r);                 \
+        const reg cs = madd(mul(s, s), poly(s, mc::cos_poly(),          \
+            mc::cos_terms), sub(set1(elem(1)), mul(s, set1(elem(0.5))))); \
+                                                                        \
+        /* n mod 4 from n - 4 round(n / 4), which is in -2..2 */        \
+        const reg q = sub(n, mul(set1(elem(4)),                         \
+            round(mul(n, set1(elem(0.25))))));                          \
+        const reg aq = fabs(q);                                         \
+        const reg odd = band(less(set1(elem(0.5)), aq),                 \
+            less(aq, set1(elem(1.5))));                                 \
+        const reg high = bor(less(q, set1(elem(-0.5))),                 \
+            less(set1(elem(1.5)), q));                                  \
+                                                                        \
+        reg y, neg;                                                     \
+        if (fn == VEC_MATH_SIN) {                                       \
+            y = select(odd, cs, sn);                                    \
+            neg = high;                                                 \
+        } else if (fn == VEC_MATH_COS) {                                \
+            y = select(odd, sn, cs);                                    \
+            neg = bxor(odd, high);                                      \
+        } else {                                                        \
+            y = div(select(odd, cs, sn), select(odd, sn, cs));          \
+            neg = odd;                                                  \
+        }                                                               \
+        y = bxor(y, band(neg, cbits(mc::sign)));                        \
+        if (fn != VEC_MATH_COS)         /* Keeps -0 and denormals */    \
+            y = select(less(fabs(x), set1(mc::trig_tiny)), x, y);       \
+        return fix(y, x, less(fabs(x), set1(mc::trig_limit)), fn);      \
+    }                                                                   \
+                                                                        \
+    /* expm1(2|x|) / (expm1(2|x|) + 2), |x| clamped where it rounds to 1 */ \
+    static TARGET reg tanh_kernel(reg x)                                \
+    {                                                                   \
+        const reg one = set1(elem(1));                                  \
+        const reg ax = fabs(x);                                         \
+        reg a = apply(vec_op_min(), ax, set1(mc::tanh_limit));          \
+        a = add(a, a);                                                  \
+        const reg n = round(mul(a, set1(mc::log2e)));                   \
+        reg r = madd(n, set1(-mc::ln2_hi), a);                          \
+        r = madd(n, set1(-mc::ln2_lo), r);                              \
+        const reg p = pow2(n);                                          \
+        const reg em = madd(p, mul(r, poly(r, mc::expm1_poly(),         \
+            mc::expm1_terms)), sub(p, one));                            \
+        const reg y = bor(div(em, add(em, set1(elem(2)))),              \
+            band(x, cbits(mc::sign)));                                  \
+        return fix(y, x, less(ax, set1(mc::huge)), VEC_MATH_TANH);      \
+    }                                                                   \
+                                                                        \
+    /* Cephes: reduce |x| to [0, tan(pi/8)] or [0, 0.66], then a */     \
+    /*   rational function */                                           \
+    static TARGET reg atan_kernel(reg x)                                \
+    {                                                                   \
+        const reg one = set1(elem(1));                                  \
+        const reg zero = set1(elem(0));                                 \
+        const reg ax = fabs(x);                                         \
+        const reg big = less(set1(mc::tan3pio8), ax);                   \
+        const reg mid = bandn(big, less(set1(mc::atan_mid), ax));       \
+        const reg t = select(big, div(set1(elem(-1)), ax),              \
+            select(mid, div(sub(ax, one), add(ax, one)), ax));          \
+        const reg base = select(big, set1(mc::pio2),                    \
+            select(mid, set1(mc::pio4), zero));                         \
+        const reg more = select(big, set1(mc::atan_more),               \
+            select(mid, set1(elem(0.5) * mc::atan_more), zero));        \
+        const reg z = mul(t, t);                                        \
+        const reg p = div(mul(z, poly(z, mc::atan_p(), mc::atan_p_terms)), \
+            poly(z, mc::atan_q(), mc::atan_q_terms));                   \
+        const reg y = bor(add(base, add(madd(t, p, t), more)),          \
+            band(x, cbits(mc::sign)));                                  \
+        return fix(y, x, less(ax, set1(mc::huge)), VEC_MATH_ATAN);      \
+    }                                                                   \
+                                                                        \
+    /* |x| = m 2^(3q + r): a quadratic guess of cbrt(m 2^r), then */    \
+    /*   Newton steps y -= (y - a / y^2) / 3 */                         \
+    static TARGET reg cbrt_kernel(reg x)                                \
+    {                                                                   \
+        const reg ax = fabs(x);                                         \
+        reg e;                                                          \
+        const reg m = frexp1(ax, e);                                    \
+        const reg q = round(mul(sub(e, set1(elem(1))),                  \
+            set1(elem(1) / 3)));                                        \
+        const reg r = sub(e, mul(q, set1(elem(3))));                    \
+        const reg scale = select(less(set1(elem(1.5)), r), set1(mc::cbrt4), \
+            select(less(set1(elem(0.5)), r), set1(mc::cbrt2), set1(elem(1)))); \
+        const reg a = mul(m, pow2(r));                                  \
+        reg y = mul(madd(madd(set1(elem(-0.0588)), m, set1(elem(0.4364))), \
+            m, set1(elem(0.6224))), scale);                             \
+        for (int k = 0; k < mc::cbrt_steps; k++)                        \
+            y = sub(y, mul(sub(y, div(a, mul(y, y))), set1(elem(1) / 3))); \
+        y = bor(mul(y, pow2(q)), band(x, cbits(mc::sign)));             \
+        const reg ok = bandn(less(ax, set1(mc::min_normal)),            \
+            less(ax, set1(mc::huge)));                                  \
+        return fix(y, x, ok, VEC_MATH_CBRT);                            \
+    }                                                                   \
+                                                                        \
+    template <int Fn>                                                   \
+    static TARGET reg math_kernel(reg x)                                \
+    {                                                                   \
+        switch (Fn) {                                                   \
+        case VEC_MATH_SQRT: return sqrt(x);                             \
+        case VEC_MATH_EXP: return exp_kernel(x);                        \
+        case VEC_MATH_LOG: case VEC_MATH_LOG2: case VEC_MATH_LOG10:     \
+            return log_kernel(x, Fn);                                   \
+        case VEC_MATH_SIN: case VEC_MATH_COS: case VEC_MATH_TAN:        \
+            return trig_kernel(x, Fn);                                  \
+        case VEC_MATH_TANH: return tanh_kernel(x);                      \
+        case VEC_MATH_ATAN: return atan_kernel(x);                      \
+        default: return cbrt_kernel(x);                                 \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    /* `out` may be `a` */                                              \
+    template <int Fn>                                                   \
+    static TARGET void math(elem* out, const elem* a, int n)            \
+    {                                                                   \
+        int i = 0;                                                      \
+        for (; i + width <= n; i += width)                              \
+            store(out + i, math_kernel<Fn>(load(a + i)));               \
+        if (i < n) {                                                    \
+            elem tail[width];                                           \
+            for (int j = 0; j < width; j++)                             \
+                tail[j] = i + j < n ? a[i + j] : elem(1);               \
+            store(tail, math_kernel<Fn>(load(tail)));                   \
+            for (int j = 0; i + j < n; j++)                             \
+                out[i + j] = tail[j];                                   \
+        }                                                               \
+    }
+
+// BLAS level 1 kernels for floats and doubles, built on the helpers of
+//   VEC_SIMD_MATH and on fmadd(a, b, c), a * b + c fused when the CPU has
+//   FMA (the AVX2 ones are only run when it does, see vec_simd_fma()). dot() and asum() keep four accumulators so that
+//   consecutive multiply-adds do not wait on each other. amax() also
+//   sums, only to notice NaNs, which max would drop. comoments() is the
+//   block step of cov(), corr() and regression()
+#define VEC_SIMD_BLAS(TARGET)                                           \
+    static TARGET elem hsum(reg a)                                      \
+    {                                                                   \
+        elem lanes[width];                                              \
+        store(lanes, a);                                                \
+        elem s = 0;                                                     \
+        for (int j = 0; j < width; j++)                                 \
+            s += lanes[j];                                              \
+        return s;                                                       \
+    }                                                                   \
+    static TARGET elem hmax(reg a)                                      \
+    {                                                                   \
+        elem lanes[width];                                              \
+        store(lanes, a);                                                \
+        elem m = lanes[0];                                              \
+        for (int j = 1; j < width; j++)                                 \
+            m = lanes[j] > m ? lanes[j] : m;                            \
+        return m;                                                       \
+    }                                                                   \
+    static TARGET elem dot(const elem* a, const elem* b, int n)         \
+    {                                                                   \
+        reg s0 = set1(0), s1 = s0, s2 = s0, s3 = s0;                    \
+        int i = 0;                                                      \
+        for (; i + 4 * width <= n; i += 4 * width) {                    \
+            s0 = fmadd(load(a + i), load(b + i), s0);                    \
+            s1 = fmadd(load(a + i + width), load(b + i + width), s1);    \
+            s2 = fmadd(load(a + i + 2 * width),                          \
+                load(b + i + 2 * width), s2);                           \
+            s3 = fmadd(load(a + i + 3 * width),                          \
+                load(b + i + 3 * width), s3);                           \
+        }                                                               \
+        for (; i + width <= n; i += width)                              \
+            s0 = fmadd(load(a + i), load(b + i), s0);                    \
+        elem s = hsum(add(add(s0, s1), add(s2, s3)));                   \
+        for (; i < n; i++)                                              \
+            s += a[i] * b[i];                                           \
+        return s;                                                       \
+    }                                                                   \
+    static TARGET void axpy(elem alpha, const elem* x, elem* y, int n)  \
+    {                                                                   \
+        const reg a = set1(alpha);                                      \
+        int i = 0;                                                      \
+        for (; i + width <= n; i += width)                              \
+            store(y + i, fmadd(a, load(x + i), load(y + i)));            \
+        for (; i < n; i++)                                              \
+            y[i] += alpha * x[i];                                       \
+    }                                                                   \
+    static TARGET void scal(elem alpha, elem* x, int n)                 \
+    {                                                                   \
+        const reg a = set1(alpha);                                      \
+        int i = 0;                                                      \
+        for (; i + width <= n; i += width)                              \
+            store(x + i, mul(a, load(x + i)));                          \
+        for (; i < n; i++)                                              \
+            x[i] *= alpha;                                              \
+    }                                                                   \
+    static TARGET elem asum(const elem* a, int n)                       \
+    {                                                                   \
+        reg s0 = set1(0), s1 = s0, s2 = s0, s3 = s0;                    \
+        int i = 0;                                                      \
+        for (; i + 4 * width <= n; i += 4 * width) {                    \
+            s0 = add(s0, fabs(load(a + i)));                            \
+            s1 = add(s1, fabs(load(a + i + width)));                    \
+            s2 = add(s2, fabs(load(a + i + 2 * width)));                \
+            s3 = add(s3, fabs(load(a + i + 3 * width)));                \
+        }                                                               \
+        for (; i + width <= n; i += width)                              \
+            s0 = add(s0, fabs(load(a + i)));                            \
+        elem s = hsum(add(add(s0, s1), add(s2, s3)));                   \
+        for (; i < n; i++)                                              \
+            s += a[i] < 0 ? -a[i] : a[i];                               \
+        return s;                                                       \
+    }                                                                   \
+    static TARGET elem amax(const elem* a, int n)                       \
+    {                                                                   \
+        reg m = set1(0), s = m;                                         \
+        int i = 0;                                                      \
+        for (; i + width <= n; i += width) {                            \
+            const reg x = fabs(load(a + i));                            \
+            m = apply(vec_op_max(), m, x);                              \
+            s = add(s, x);                                              \
+        }                                                               \
+        elem r = hmax(m), t = hsum(s);                                  \
+        for (; i < n; i++) {                                            \
+            const elem x = a[i] < 0 ? -a[i] : a[i];                     \
+            r = x > r ? x : r;                                          \
+            t += x;                                                     \
+        }                                                               \
+        return t != t ? t : r;                                          \
+    }                                                                   \
+    /* Means, sums of squared deviations and of their products */      \
+    static TARGET void comoments(const elem* x, const elem* y, int n,   \
+        elem* out)                                                      \
+    {                                                                   \
+        reg x0 = set1(0), x1 = x0, y0 = x0, y1 = x0;                    \
+        int i = 0;                                                      \
+        for (; i + 2 * width <= n; i += 2 * width) {                    \
+            x0 = add(x0, load(x + i));                                  \
+            x1 = add(x1, load(x + i + width));                          \
+            y0 = add(y0, load(y + i));                                  \
+            y1 = add(y1, load(y + i + width));                          \
+        }                                                               \
+        elem sx = hsum(add(x0, x1)), sy = hsum(add(y0, y1));            \
+        for (; i < n; i++) {                                            \
+            sx += x[i];                                                 \
+            sy += y[i];                                                 \
+        }                                                               \
+        const elem mx = sx / n, my = sy / n;                            \
+        const reg vmx = set1(mx), vmy = set1(my);                       \
+        reg xx = set1(0), yy = xx, xy = xx;                             \
+        for (i = 0; i + width <= n; i += width) {                       \
+            const reg dx = sub(load(x + i), vmx);                       \
+            const reg dy = sub(load(y + i), vmy);                       \
+            xx = fmadd(dx, dx, xx);                                      \
+            yy = fmadd(dy, dy, yy);                                      \
+            xy = fmadd(dx, dy, xy);                                      \
+        }                                                               \
+        elem sxx = hsum(xx), syy = hsum(yy), sxy = hsum(xy);            \
+        for (; i < n; i++) {                                            \
+            const elem dx = x[i] - mx, dy = y[i] - my;                  \
+            sxx += dx * dx;                                             \
+            syy += dy * dy;                                             \
+            sxy += dx * dy;                                             \
+        }                                                               \
+        out[0] = mx;                                                    \
+        out[1] = my;                                                    \
+        out[2] = sxx;                                                   \
+        out[3] = syy;                                                   \
+        out[4] = sxy;                                                   \
+    }
+
+#ifdef VEC_SIMD
+
+#define VEC_SSE2 __attribute__((target("sse2")))
+#define VEC_AVX2 __attribute__((target("avx2")))
+#define VEC_AVX2_FMA __attribute__((target("avx2,fma")))
+#define VEC_AVX512 __attribute__((target("avx512f")))
+
+struct vec_sse2_f32 {
+    typedef __m128 reg;
+    enum {width = 4};
+    static VEC_SSE2 reg load(const void* p) {return _mm_loadu_ps((const float*)p);};
+    static VEC_SSE2 void store(void* p, reg a) {_mm_storeu_ps((float*)p, a);};
+    static VEC_SSE2 reg set1(float x) {return _mm_set1_ps(x);};
+    static VEC_SSE2 reg apply(vec_op_add, reg a, reg b) {return _mm_add_ps(a, b);};
+    static VEC_SSE2 reg apply(vec_op_sub, reg a, reg b) {return _mm_sub_ps(a, b);};
+    static VEC_SSE2 reg apply(vec_op_mul, reg a, reg b) {return _mm_mul_ps(a, b);};
+    static VEC_SSE2 reg apply(vec_op_div, reg a, reg b) {return _mm_div_ps(a, b);};
+    static VEC_SSE2 reg apply(vec_op_min, reg a, reg b) {return _mm_min_ps(a, b);};
+    static VEC_SSE2 reg apply(vec_op_max, reg a, reg b) {return _mm_max_ps(a, b);};
+    static VEC_SSE2 unsigned cmp(vec_op_lt, reg a, reg b) {return _mm_movemask_ps(_mm_cmplt_ps(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_gt, reg a, reg b) {return _mm_movemask_ps(_mm_cmpgt_ps(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_le, reg a, reg b) {return _mm_movemask_ps(_mm_cmple_ps(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_ge, reg a, reg b) {return _mm_movemask_ps(_mm_cmpge_ps(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_eq, reg a, reg b) {return _mm_movemask_ps(_mm_cmpeq_ps(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_ne, reg a, reg b) {return _mm_movemask_ps(_mm_cmpneq_ps(a, b));};
+    VEC_SIMD_LOOPS(VEC_SSE2)
+
+    typedef float elem;
+    static VEC_SSE2 reg madd(reg a, reg b, reg c) {return _mm_add_ps(_mm_mul_ps(a, b), c);};
+    static VEC_SSE2 reg fmadd(reg a, reg b, reg c) {return madd(a, b, c);};
+    static VEC_SSE2 reg sqrt(reg a) {return _mm_sqrt_ps(a);};
+    static VEC_SSE2 reg band(reg a, reg b) {return _mm_and_ps(a, b);};
+    static VEC_SSE2 reg bor(reg a, reg b) {return _mm_or_ps(a, b);};
+    static VEC_SSE2 reg bxor(reg a, reg b) {return _mm_xor_ps(a, b);};
+    static VEC_SSE2 reg bandn(reg a, reg b) {return _mm_andnot_ps(a, b);};
+    static VEC_SSE2 reg less(reg a, reg b) {return _mm_cmplt_ps(a, b);};
+    static VEC_SSE2 unsigned lanes(reg m) {return _mm_movemask_ps(m);};
+    static VEC_SSE2 reg shl(reg a) {return _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(a), 23));};
+    static VEC_SSE2 reg shr(reg a) {return _mm_castsi128_ps(_mm_srli_epi32(_mm_castps_si128(a), 23));};
+    VEC_SIMD_MATH(VEC_SSE2)
+    VEC_SIMD_BLAS(VEC_SSE2)
+};
+
+struct vec_sse2_f64 {
+    typedef __m128d reg;
+    enum {width = 2};
+    static VEC_SSE2 reg load(const void* p) {return _mm_loadu_pd((const double*)p);};
+    static VEC_SSE2 void store(void* p, reg a) {_mm_storeu_pd((double*)p, a);};
+    static VEC_SSE2 reg set1(double x) {return _mm_set1_pd(x);};
+    static VEC_SSE2 reg apply(vec_op_add, reg a, reg b) {return _mm_add_pd(a, b);};
+    static VEC_SSE2 reg apply(vec_op_sub, reg a, reg b) {return _mm_sub_pd(a, b);};
+    static VEC_SSE2 reg apply(vec_op_mul, reg a, reg b) {return _mm_mul_pd(a, b);};
+    static VEC_SSE2 reg apply(vec_op_div, reg a, reg b) {return _mm_div_pd(a, b);};
+    static VEC_SSE2 reg apply(vec_op_min, reg a, reg b) {return _mm_min_pd(a, b);};
+    static VEC_SSE2 reg apply(vec_op_max, reg a, reg b) {return _mm_max_pd(a, b);};
+    static VEC_SSE2 unsigned cmp(vec_op_lt, reg a, reg b) {return _mm_movemask_pd(_mm_cmplt_pd(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_gt, reg a, reg b) {return _mm_movemask_pd(_mm_cmpgt_pd(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_le, reg a, reg b) {return _mm_movemask_pd(_mm_cmple_pd(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_ge, reg a, reg b) {return _mm_movemask_pd(_mm_cmpge_pd(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_eq, reg a, reg b) {return _mm_movemask_pd(_mm_cmpeq_pd(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_ne, reg a, reg b) {return _mm_movemask_pd(_mm_cmpneq_pd(a, b));};
+    VEC_SIMD_LOOPS(VEC_SSE2)
+
+    typedef double elem;
+    static VEC_SSE2 reg madd(reg a, reg b, reg c) {return _mm_add_pd(_mm_mul_pd(a, b), c);};
+    static VEC_SSE2 reg fmadd(reg a, reg b, reg c) {return madd(a, b, c);};
+    static VEC_SSE2 reg sqrt(reg a) {return _mm_sqrt_pd(a);};
+    static VEC_SSE2 reg band(reg a, reg b) {return _mm_and_pd(a, b);};
+    static VEC_SSE2 reg bor(reg a, reg b) {return _mm_or_pd(a, b);};
+    static VEC_SSE2 reg bxor(reg a, reg b) {return _mm_xor_pd(a, b);};
+    static VEC_SSE2 reg bandn(reg a, reg b) {return _mm_andnot_pd(a, b);};
+    static VEC_SSE2 reg less(reg a, reg b) {return _mm_cmplt_pd(a, b);};
+    static VEC_SSE2 unsigned lanes(reg m) {return _mm_movemask_pd(m);};
+    static VEC_SSE2 reg shl(reg a) {return _mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(a), 52));};
+    static VEC_SSE2 reg shr(reg a) {return _mm_castsi128_pd(_mm_srli_epi64(_mm_castpd_si128(a), 52));};
+    VEC_SIMD_MATH(VEC_SSE2)
+    VEC_SIMD_BLAS(VEC_SSE2)
+};
+
+// SSE2 has no 32 bit multiply and only >, < and == for integers
+struct vec_sse2_i32 {
+    typedef __m128i reg;
+    enum {width = 4};
+    static VEC_SSE2 reg load(const void* p) {return _mm_loadu_si128((const __m128i*)p);};
+    static VEC_SSE2 void store(void* p, reg a) {_mm_storeu_si128((__m128i*)p, a);};
+    static VEC_SSE2 reg set1(int32_t x) {return _mm_set1_epi32(x);};
+    static VEC_SSE2 unsigned bits(reg a) {return _mm_movemask_ps(_mm_castsi128_ps(a));};
+    static VEC_SSE2 reg apply(vec_op_add, reg a, reg b) {return _mm_add_epi32(a, b);};
+    static VEC_SSE2 reg apply(vec_op_sub, reg a, reg b) {return _mm_sub_epi32(a, b);};
+    static VEC_SSE2 reg apply(vec_op_bitand, reg a, reg b) {return _mm_and_si128(a, b);};
+    static VEC_SSE2 reg apply(vec_op_bitor, reg a, reg b) {return _mm_or_si128(a, b);};
+    static VEC_SSE2 unsigned cmp(vec_op_lt, reg a, reg b) {return bits(_mm_cmplt_epi32(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_gt, reg a, reg b) {return bits(_mm_cmpgt_epi32(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_le, reg a, reg b) {return ~bits(_mm_cmpgt_epi32(a, b)) & 0xF;};
+    static VEC_SSE2 unsigned cmp(vec_op_ge, reg a, reg b) {return ~bits(_mm_cmplt_epi32(a, b)) & 0xF;};
+    static VEC_SSE2 unsigned cmp(vec_op_eq, reg a, reg b) {return bits(_mm_cmpeq_epi32(a, b));};
+    static VEC_SSE2 unsigned cmp(vec_op_ne, reg a, reg b) {return ~bits(_mm_cmpeq_epi32(a, b)) & 0xF;};
+    VEC_SIMD_LOOPS(VEC_SSE2)
+
+    // Sign extend to 64 bits before adding
+    static VEC_SSE2 int64_t sum_wide(const int32_t* a, int n)
+    {
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = acc0;
+        int i = 0;
+        for (; i + width <= n; i += width) {
+            __m128i x = load(a + i);
+            __m128i sign = _mm_srai_epi32(x, 31);
+            acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(x, sign));
+            acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(x, sign));
+        }
+        int64_t lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+        int64_t total = lanes[0] + lanes[1];
+        for (; i < n; i++)
+            total += a[i];
+        return total;
+    }
+};
+
+// SSE2 has no 64 bit multiply or comparisons
+struct vec_sse2_i64 {
+    typedef __m128i reg;
+    enum {width = 2};
+    static VEC_SSE2 reg load(const void* p) {return _mm_loadu_si128((const __m128i*)p);};
+    static VEC_SSE2 void store(void* p, reg a) {_mm_storeu_si128((__m128i*)p, a);};
+    static VEC_SSE2 reg set1(int64_t x) {return _mm_set1_epi64x(x);};
+    static VEC_SSE2 reg apply(vec_op_add, reg a, reg b) {return _mm_add_epi64(a, b);};
+    static VEC_SSE2 reg apply(vec_op_sub, reg a, reg b) {return _mm_sub_epi64(a, b);};
+    static VEC_SSE2 reg apply(vec_op_bitand, reg a, reg b) {return _mm_and_si128(a, b);};
+    static VEC_SSE2 reg apply(vec_op_bitor, reg a, reg b) {return _mm_or_si128(a, b);};
+    VEC_SIMD_LOOPS(VEC_SSE2)
+};
+
+struct vec_avx2_f32 {
+    typedef __m256 reg;
+    enum {width = 8};
+    static VEC_AVX2 reg load(const void* p) {return _mm256_loadu_ps((const float*)p);};
+    static VEC_AVX2 void store(void* p, reg a) {_mm256_storeu_ps((float*)p, a);};
+    static VEC_AVX2 reg set1(float x) {return _mm256_set1_ps(x);};
+    static VEC_AVX2 reg apply(vec_op_add, reg a, reg b) {return _mm256_add_ps(a, b);};
+    static VEC_AVX2 reg apply(vec_op_sub, reg a, reg b) {return _mm256_sub_ps(a, b);};
+    static VEC_AVX2 reg apply(vec_op_mul, reg a, reg b) {return _mm256_mul_ps(a, b);};
+    static VEC_AVX2 reg apply(vec_op_div, reg a, reg b) {return _mm256_div_ps(a, b);};
+    static VEC_AVX2 reg apply(vec_op_min, reg a, reg b) {return _mm256_min_ps(a, b);};
+    static VEC_AVX2 reg apply(vec_op_max, reg a, reg b) {return _mm256_max_ps(a, b);};
+    static VEC_AVX2 unsigned cmp(vec_op_lt, reg a, reg b) {return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_gt, reg a, reg b) {return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_le, reg a, reg b) {return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_ge, reg a, reg b) {return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GE_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_eq, reg a, reg b) {return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_ne, reg a, reg b) {return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NEQ_UQ));};
+    VEC_SIMD_LOOPS(VEC_AVX2)
+
+    typedef float elem;
+    static VEC_AVX2 reg madd(reg a, reg b, reg c) {return _mm256_add_ps(_mm256_mul_ps(a, b), c);};
+    static VEC_AVX2_FMA reg fmadd(reg a, reg b, reg c) {return _mm256_fmadd_ps(a, b, c);};
+    static VEC_AVX2 reg sqrt(reg a) {return _mm256_sqrt_ps(a);};
+    static VEC_AVX2 reg band(reg a, reg b) {return _mm256_and_ps(a, b);};
+    static VEC_AVX2 reg bor(reg a, reg b) {return _mm256_or_ps(a, b);};
+    static VEC_AVX2 reg bxor(reg a, reg b) {return _mm256_xor_ps(a, b);};
+    static VEC_AVX2 reg bandn(reg a, reg b) {return _mm256_andnot_ps(a, b);};
+    static VEC_AVX2 reg less(reg a, reg b) {return _mm256_cmp_ps(a, b, _CMP_LT_OQ);};
+    static VEC_AVX2 unsigned lanes(reg m) {return _mm256_movemask_ps(m);};
+    static VEC_AVX2 reg shl(reg a) {return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_castps_si256(a), 23));};
+    static VEC_AVX2 reg shr(reg a) {return _mm256_castsi256_ps(_mm256_srli_epi32(_mm256_castps_si256(a), 23));};
+    VEC_SIMD_MATH(VEC_AVX2)
+    VEC_SIMD_BLAS(VEC_AVX2_FMA)
+};
+
+struct vec_avx2_f64 {
+    typedef __m256d reg;
+    enum {width = 4};
+    static VEC_AVX2 reg load(const void* p) {return _mm256_loadu_pd((const double*)p);};
+    static VEC_AVX2 void store(void* p, reg a) {_mm256_storeu_pd((double*)p, a);};
+    static VEC_AVX2 reg set1(double x) {return _mm256_set1_pd(x);};
+    static VEC_AVX2 reg apply(vec_op_add, reg a, reg b) {return _mm256_add_pd(a, b);};
+    static VEC_AVX2 reg apply(vec_op_sub, reg a, reg b) {return _mm256_sub_pd(a, b);};
+    static VEC_AVX2 reg apply(vec_op_mul, reg a, reg b) {return _mm256_mul_pd(a, b);};
+    static VEC_AVX2 reg apply(vec_op_div, reg a, reg b) {return _mm256_div_pd(a, b);};
+    static VEC_AVX2 reg apply(vec_op_min, reg a, reg b) {return _mm256_min_pd(a, b);};
+    static VEC_AVX2 reg apply(vec_op_max, reg a, reg b) {return _mm256_max_pd(a, b);};
+    static VEC_AVX2 unsigned cmp(vec_op_lt, reg a, reg b) {return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_gt, reg a, reg b) {return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_le, reg a, reg b) {return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_ge, reg a, reg b) {return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GE_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_eq, reg a, reg b) {return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ));};
+    static VEC_AVX2 unsigned cmp(vec_op_ne, reg a, reg b) {return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_NEQ_UQ));};
+    VEC_SIMD_LOOPS(VEC_AVX2)
+
+    typedef double elem;
+    static VEC_AVX2 reg madd(reg a, reg b, reg c) {return _mm256_add_pd(_mm256_mul_pd(a, b), c);};
+    static VEC_AVX2_FMA reg fmadd(reg a, reg b, reg c) {return _mm256_fmadd_pd(a, b, c);};
+    static VEC_AVX2 reg sqrt(reg a) {return _mm256_sqrt_pd(a);};
+    static VEC_AVX2 reg band(reg a, reg b) {return _mm256_and_pd(a, b);};
+    static VEC_AVX2 reg bor(reg a, reg b) {return _mm256_or_pd(a, b);};
+    static VEC_AVX2 reg bxor(reg a, reg b) {return _mm256_xor_pd(a, b);};
+    static VEC_AVX2 reg bandn(reg a, reg b) {return _mm256_andnot_pd(a, b);};
+    static VEC_AVX2 reg less(reg a, reg b) {return _mm256_cmp_pd(a, b, _CMP_LT_OQ);};
+    static VEC_AVX2 unsigned lanes(reg m) {return _mm256_movemask_pd(m);};
+    static VEC_AVX2 reg shl(reg a) {return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(a), 52));};
+    static VEC_AVX2 reg shr(reg a) {return _mm256_castsi256_pd(_mm256_srli_epi64(_mm256_castpd_si256(a), 52));};
+    VEC_SIMD_MATH(VEC_AVX2)
+    VEC_SIMD_BLAS(VEC_AVX2_FMA)
+};
+
+struct vec_avx2_i32 {
+    typedef __m256i reg;
+    enum {width = 8};
+    static VEC_AVX2 reg load(const void* p) {return _mm256_loadu_si256((const __m256i*)p);};
+    static VEC_AVX2 void store(void* p, reg a) {_mm256_storeu_si256((__m256i*)p, a);};
+    static VEC_AVX2 reg set1(int32_t x) {return _mm256_set1_epi32(x);};
+    static VEC_AVX2 unsigned bits(reg a) {return _mm256_movemask_ps(_mm256_castsi256_ps(a));};
+    static VEC_AVX2 reg apply(vec_op_add, reg a, reg b) {return _mm256_add_epi32(a, b);};
+    static VEC_AVX2 reg apply(vec_op_sub, reg a, reg b) {return _mm256_sub_epi32(a, b);};
+    static VEC_AVX2 reg apply(vec_op_mul, reg a, reg b) {return _mm256_mullo_epi32(a, b);};
+    static VEC_AVX2 reg apply(vec_op_min, reg a, reg b) {return _mm256_min_epi32(a, b);};
+    static VEC_AVX2 reg apply(vec_op_max, reg a, reg b) {return _mm256_max_epi32(a, b);};
+    static VEC_AVX2 reg apply(vec_op_bitand, reg a, reg b) {return _mm256_and_si256(a, b);};
+    static VEC_AVX2 reg apply(vec_op_bitor, reg a, reg b) {return _mm256_or_si256(a, b);};
+    static VEC_AVX2 unsigned cmp(vec_op_lt, reg a, reg b) {return bits(_mm256_cmpgt_epi32(b, a));};
+    static VEC_AVX2 unsigned cmp(vec_op_gt, reg a, reg b) {return bits(_mm256_cmpgt_epi32(a, b));};
+    static VEC_AVX2 unsigned cmp(vec_op_le, reg a, reg b) {return ~bits(_mm256_cmpgt_epi32(a, b)) & 0xFF;};
+    static VEC_AVX2 unsigned cmp(vec_op_ge, reg a, reg b) {return ~bits(_mm256_cmpgt_epi32(b, a)) & 0xFF;};
+    static VEC_AVX2 unsigned cmp(vec_op_eq, reg a, reg b) {return bits(_mm256_cmpeq_epi32(a, b));};
+    static VEC_AVX2 unsigned cmp(vec_op_ne, reg a, reg b) {return ~bits(_mm256_cmpeq_epi32(a, b)) & 0xFF;};
+    VEC_SIMD_LOOPS(VEC_AVX2)
+
+    // Sign extend to 64 bits before adding
+    static VEC_AVX2 int64_t sum_wide(const int32_t* a, int n)
+    {
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = acc0;
+        int i = 0;
+        for (; i + width <= n; i += width) {
+            __m256i x = load(a + i);
+            acc0 = _mm256_add_epi64(acc0,
+                _mm256_cvtepi32_epi64(_mm256_castsi256_si128(x)));
+            acc1 = _mm256_add_epi64(acc1,
+                _mm256_cvtepi32_epi64(_mm256_extracti128_si256(x, 1)));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+        int64_t total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        for (; i < n; i++)
+            total += a[i];
+        return total;
+    }
+};
+
+// AVX2 has no 64 bit multiply
+struct vec_avx2_i64 {
+    typedef __m256i reg;
+    enum {width = 4};
+    static VEC_AVX2 reg load(const void* p) {return _mm256_loadu_si256((const __m256i*)p);};
+    static VEC_AVX2 void store(void* p, reg a) {_mm256_storeu_si256((__m256i*)p, a);};
+    static VEC_AVX2 reg set1(int64_t x) {return _mm256_set1_epi64x(x);};
+    static VEC_AVX2 unsigned bits(reg a) {return _mm256_movemask_pd(_mm256_castsi256_pd(a));};
+    static VEC_AVX2 reg apply(vec_op_add, reg a, reg b) {return _mm256_add_epi64(a, b);};
+    static VEC_AVX2 reg apply(vec_op_sub, reg a, reg b) {return _mm256_sub_epi64(a, b);};
+    static VEC_AVX2 reg apply(vec_op_bitand, reg a, reg b) {return _mm256_and_si256(a, b);};
+    static VEC_AVX2 reg apply(vec_op_bitor, reg a, reg b) {return _mm256_or_si256(a, b);};
+    static VEC_AVX2 unsigned cmp(vec_op_lt, reg a, reg b) {return bits(_mm256_cmpgt_epi64(b, a));};
+    static VEC_AVX2 unsigned cmp(vec_op_gt, reg a, reg b) {return bits(_mm256_cmpgt_epi64(a, b));};
+    static VEC_AVX2 unsigned cmp(vec_op_le, reg a, reg b) {return ~bits(_mm256_cmpgt_epi64(a, b)) & 0xF;};
+    static VEC_AVX2 unsigned cmp(vec_op_ge, reg a, reg b) {return ~bits(_mm256_cmpgt_epi64(b, a)) & 0xF;};
+    static VEC_AVX2 unsigned cmp(vec_op_eq, reg a, reg b) {return bits(_mm256_cmpeq_epi64(a, b));};
+    static VEC_AVX2 unsigned cmp(vec_op_ne, reg a, reg b) {return ~bits(_mm256_cmpeq_epi64(a, b)) & 0xF;};
+    VEC_SIMD_LOOPS(VEC_AVX2)
+};
+
+struct vec_avx512_f32 {
+    typedef __m512 reg;
+    enum {width = 16};
+    static VEC_AVX512 reg load(const void* p) {return _mm512_loadu_ps(p);};
+    static VEC_AVX512 void store(void* p, reg a) {_mm512_storeu_ps(p, a);};
+    static VEC_AVX512 reg set1(float x) {return _mm512_set1_ps(x);};
+    static VEC_AVX512 reg apply(vec_op_add, reg a, reg b) {return _mm512_add_ps(a, b);};
+    static VEC_AVX512 reg apply(vec_op_sub, reg a, reg b) {return _mm512_sub_ps(a, b);};
+    static VEC_AVX512 reg apply(vec_op_mul, reg a, reg b) {return _mm512_mul_ps(a, b);};
+    static VEC_AVX512 reg apply(vec_op_div, reg a, reg b) {return _mm512_div_ps(a, b);};
+    static VEC_AVX512 reg apply(vec_op_min, reg a, reg b) {return _mm512_min_ps(a, b);};
+    static VEC_AVX512 reg apply(vec_op_max, reg a, reg b) {return _mm512_max_ps(a, b);};
+    static VEC_AVX512 unsigned cmp(vec_op_lt, reg a, reg b) {return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_gt, reg a, reg b) {return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_le, reg a, reg b) {return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_ge, reg a, reg b) {return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_eq, reg a, reg b) {return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_ne, reg a, reg b) {return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ);};
+    VEC_SIMD_LOOPS(VEC_AVX512)
+
+    typedef float elem;
+    static VEC_AVX512 reg madd(reg a, reg b, reg c) {return _mm512_fmadd_ps(a, b, c);};
+    static VEC_AVX512 reg fmadd(reg a, reg b, reg c) {return madd(a, b, c);};
+    static VEC_AVX512 reg sqrt(reg a) {return _mm512_sqrt_ps(a);};
+    static VEC_AVX512 reg band(reg a, reg b) {return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));};
+    static VEC_AVX512 reg bor(reg a, reg b) {return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));};
+    static VEC_AVX512 reg bxor(reg a, reg b) {return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));};
+    static VEC_AVX512 reg bandn(reg a, reg b) {return _mm512_castsi512_ps(_mm512_andnot_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));};
+    static VEC_AVX512 reg less(reg a, reg b) {return _mm512_castsi512_ps(_mm512_maskz_set1_epi32(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), -1));};
+    static VEC_AVX512 unsigned lanes(reg m) {return _mm512_test_epi32_mask(_mm512_castps_si512(m), _mm512_castps_si512(m));};
+    static VEC_AVX512 reg shl(reg a) {return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_castps_si512(a), 23));};
+    static VEC_AVX512 reg shr(reg a) {return _mm512_castsi512_ps(_mm512_srli_epi32(_mm512_castps_si512(a), 23));};
+    VEC_SIMD_MATH(VEC_AVX512)
+    VEC_SIMD_BLAS(VEC_AVX512)
+};
+
+struct vec_avx512_f64 {
+    typedef __m512d reg;
+    enum {width = 8};
+    static VEC_AVX512 reg load(const void* p) {return _mm512_loadu_pd(p);};
+    static VEC_AVX512 void store(void* p, reg a) {_mm512_storeu_pd(p, a);};
+    static VEC_AVX512 reg set1(double x) {return _mm512_set1_pd(x);};
+    static VEC_AVX512 reg apply(vec_op_add, reg a, reg b) {return _mm512_add_pd(a, b);};
+    static VEC_AVX512 reg apply(vec_op_sub, reg a, reg b) {return _mm512_sub_pd(a, b);};
+    static VEC_AVX512 reg apply(vec_op_mul, reg a, reg b) {return _mm512_mul_pd(a, b);};
+    static VEC_AVX512 reg apply(vec_op_div, reg a, reg b) {return _mm512_div_pd(a, b);};
+    static VEC_AVX512 reg apply(vec_op_min, reg a, reg b) {return _mm512_min_pd(a, b);};
+    static VEC_AVX512 reg apply(vec_op_max, reg a, reg b) {return _mm512_max_pd(a, b);};
+    static VEC_AVX512 unsigned cmp(vec_op_lt, reg a, reg b) {return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_gt, reg a, reg b) {return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_le, reg a, reg b) {return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_ge, reg a, reg b) {return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_eq, reg a, reg b) {return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_ne, reg a, reg b) {return _mm512_cmp_pd_mask(a, b, _CMP_NEQ_UQ);};
+    VEC_SIMD_LOOPS(VEC_AVX512)
+
+    typedef double elem;
+    static VEC_AVX512 reg madd(reg a, reg b, reg c) {return _mm512_fmadd_pd(a, b, c);};
+    static VEC_AVX512 reg fmadd(reg a, reg b, reg c) {return madd(a, b, c);};
+    static VEC_AVX512 reg sqrt(reg a) {return _mm512_sqrt_pd(a);};
+    static VEC_AVX512 reg band(reg a, reg b) {return _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)));};
+    static VEC_AVX512 reg bor(reg a, reg b) {return _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)));};
+    static VEC_AVX512 reg bxor(reg a, reg b) {return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)));};
+    static VEC_AVX512 reg bandn(reg a, reg b) {return _mm512_castsi512_pd(_mm512_andnot_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)));};
+    static VEC_AVX512 reg less(reg a, reg b) {return _mm512_castsi512_pd(_mm512_maskz_set1_epi64(_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ), -1));};
+    static VEC_AVX512 unsigned lanes(reg m) {return _mm512_test_epi64_mask(_mm512_castpd_si512(m), _mm512_castpd_si512(m));};
+    static VEC_AVX512 reg shl(reg a) {return _mm512_castsi512_pd(_mm512_slli_epi64(_mm512_castpd_si512(a), 52));};
+    static VEC_AVX512 reg shr(reg a) {return _mm512_castsi512_pd(_mm512_srli_epi64(_mm512_castpd_si512(a), 52));};
+    VEC_SIMD_MATH(VEC_AVX512)
+    VEC_SIMD_BLAS(VEC_AVX512)
+};
+
+struct vec_avx512_i32 {
+    typedef __m512i reg;
+    enum {width = 16};
+    static VEC_AVX512 reg load(const void* p) {return _mm512_loadu_si512(p);};
+    static VEC_AVX512 void store(void* p, reg a) {_mm512_storeu_si512(p, a);};
+    static VEC_AVX512 reg set1(int32_t x) {return _mm512_set1_epi32(x);};
+    static VEC_AVX512 reg apply(vec_op_add, reg a, reg b) {return _mm512_add_epi32(a, b);};
+    static VEC_AVX512 reg apply(vec_op_sub, reg a, reg b) {return _mm512_sub_epi32(a, b);};
+    static VEC_AVX512 reg apply(vec_op_mul, reg a, reg b) {return _mm512_mullo_epi32(a, b);};
+    static VEC_AVX512 reg apply(vec_op_min, reg a, reg b) {return _mm512_min_epi32(a, b);};
+    static VEC_AVX512 reg apply(vec_op_max, reg a, reg b) {return _mm512_max_epi32(a, b);};
+    static VEC_AVX512 reg apply(vec_op_bitand, reg a, reg b) {return _mm512_and_si512(a, b);};
+    static VEC_AVX512 reg apply(vec_op_bitor, reg a, reg b) {return _mm512_or_si512(a, b);};
+    static VEC_AVX512 unsigned cmp(vec_op_lt, reg a, reg b) {return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_LT);};
+    static VEC_AVX512 unsigned cmp(vec_op_gt, reg a, reg b) {return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NLE);};
+    static VEC_AVX512 unsigned cmp(vec_op_le, reg a, reg b) {return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_LE);};
+    static VEC_AVX512 unsigned cmp(vec_op_ge, reg a, reg b) {return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NLT);};
+    static VEC_AVX512 unsigned cmp(vec_op_eq, reg a, reg b) {return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_EQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_ne, reg a, reg b) {return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NE);};
+    VEC_SIMD_LOOPS(VEC_AVX512)
+
+    // Sign extend to 64 bits before adding
+    static VEC_AVX512 int64_t sum_wide(const int32_t* a, int n)
+    {
+        __m512i acc0 = _mm512_setzero_si512();
+        __m512i acc1 = acc0;
+        int i = 0;
+        for (; i + width <= n; i += width) {
+            __m512i x = load(a + i);
+            acc0 = _mm512_add_epi64(acc0,
+                _mm512_cvtepi32_epi64(_mm512_castsi512_si256(x)));
+            acc1 = _mm512_add_epi64(acc1,
+                _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(x, 1)));
+        }
+        int64_t total = _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+        for (; i < n; i++)
+            total += a[i];
+        return total;
+    }
+};
+
+// 64 bit multiply needs AVX-512DQ, left to the AVX2/scalar path
+struct vec_avx512_i64 {
+    typedef __m512i reg;
+    enum {width = 8};
+    static VEC_AVX512 reg load(const void* p) {return _mm512_loadu_si512(p);};
+    static VEC_AVX512 void store(void* p, reg a) {_mm512_storeu_si512(p, a);};
+    static VEC_AVX512 reg set1(int64_t x) {return _mm512_set1_epi64(x);};
+    static VEC_AVX512 reg apply(vec_op_add, reg a, reg b) {return _mm512_add_epi64(a, b);};
+    static VEC_AVX512 reg apply(vec_op_sub, reg a, reg b) {return _mm512_sub_epi64(a, b);};
+    static VEC_AVX512 reg apply(vec_op_min, reg a, reg b) {return _mm512_min_epi64(a, b);};
+    static VEC_AVX512 reg apply(vec_op_max, reg a, reg b) {return _mm512_max_epi64(a, b);};
+    static VEC_AVX512 reg apply(vec_op_bitand, reg a, reg b) {return _mm512_and_si512(a, b);};
+    static VEC_AVX512 reg apply(vec_op_bitor, reg a, reg b) {return _mm512_or_si512(a, b);};
+    static VEC_AVX512 unsigned cmp(vec_op_lt, reg a, reg b) {return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_LT);};
+    static VEC_AVX512 unsigned cmp(vec_op_gt, reg a, reg b) {return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_NLE);};
+    static VEC_AVX512 unsigned cmp(vec_op_le, reg a, reg b) {return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_LE);};
+    static VEC_AVX512 unsigned cmp(vec_op_ge, reg a, reg b) {return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_NLT);};
+    static VEC_AVX512 unsigned cmp(vec_op_eq, reg a, reg b) {return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_EQ);};
+    static VEC_AVX512 unsigned cmp(vec_op_ne, reg a, reg b) {return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_NE);};
+    VEC_SIMD_LOOPS(VEC_AVX512)
+};
+
+#endif // VEC_SIMD
+
+
+// Element types with kernels: int32, int64, float and double
+template <typename T, typename = void>
+struct vec_simd_key {typedef void type;};
+
+template <>
+struct vec_simd_key<float> {typedef float type;};
+
+template <>
+struct vec_simd_key<double> {typedef double type;};
+
+template <typename T>
+struct vec_simd_key<T, typename std::enable_if<std::is_integral<T>::value
+    && std::is_signed<T>::value && sizeof(T) == 4>::type> {typedef int32_t type;};
+
+template <typename T>
+struct vec_simd_key<T, typename std::enable_if<std::is_integral<T>::value
+    && std::is_signed<T>::value && sizeof(T) == 8>::type> {typedef int64_t type;};
+
+// The kernels for an instruction set and element type
+template <int Isa, typename K>
+struct vec_simd_traits {typedef void type;};
+
+#ifdef VEC_SIMD
+template <> struct vec_simd_traits<VEC_ISA_SSE2, float> {typedef vec_sse2_f32 type;};
+template <> struct vec_simd_traits<VEC_ISA_SSE2, double> {typedef vec_sse2_f64 type;};
+template <> struct vec_simd_traits<VEC_ISA_SSE2, int32_t> {typedef vec_sse2_i32 type;};
+template <> struct vec_simd_traits<VEC_ISA_SSE2, int64_t> {typedef vec_sse2_i64 type;};
+template <> struct vec_simd_traits<VEC_ISA_AVX2, float> {typedef vec_avx2_f32 type;};
+template <> struct vec_simd_traits<VEC_ISA_AVX2, double> {typedef vec_avx2_f64 type;};
+template <> struct vec_simd_traits<VEC_ISA_AVX2, int32_t> {typedef vec_avx2_i32 type;};
+template <> struct vec_simd_traits<VEC_ISA_AVX2, int64_t> {typedef vec_avx2_i64 type;};
+template <> struct vec_simd_traits<VEC_ISA_AVX512, float> {typedef vec_avx512_f32 type;};
+template <> struct vec_simd_traits<VEC_ISA_AVX512, double> {typedef vec_avx512_f64 type;};
+template <> struct vec_simd_traits<VEC_ISA_AVX512, int32_t> {typedef vec_avx512_i32 type;};
+template <> struct vec_simd_traits<VEC_ISA_AVX512, int64_t> {typedef vec_avx512_i64 type;};
+#endif
+
+// Does kernel set `S` implement `Op`?
+template <typename S, typename Op, typename = void>
+struct vec_simd_has_apply : std::false_type {};
+
+template <typename S, typename Op>
+struct vec_simd_has_apply<S, Op, decltype((void)S::apply(Op(),
+    std::declval<typename S::reg>(), std::declval<typename S::reg>()))>
+    : std::true_type {};
+
+template <typename S, typename Op, typename = void>
+struct vec_simd_has_cmp : std::false_type {};
+
+template <typename S, typename Op>
+struct vec_simd_has_cmp<S, Op, decltype((void)S::cmp(Op(),
+    std::declval<typename S::reg>(), std::declval<typename S::reg>()))>
+    : std::true_type {};
+
+template <typename S, typename Op, bool Arith, bool Cmp>
+struct vec_simd_run {
+    template <typename T>
+    static bool arith(T*, const T*, const T*, int, int) {return false;};
+    template <typename T>
+    static bool reduce(const T*, int, T, T&) {return false;};
+    template <typename Out, typename T>
+    static bool compare(Out*, const T*, const T*, int, int) {return false;};
+};
+
+template <typename S, typename Op, bool Cmp>
+struct vec_simd_run<S, Op, true, Cmp> {
+    template <typename T>
+    static bool arith(T* out, const T* a, const T* b, int n, int shape)
+    {
+        S::template arith<Op>(out, a, b, n, shape);
+        return true;
+    }
+    template <typename T>
+    static bool reduce(const T* a, int n, T init, T& out)
+    {
+        out = S::template reduce<Op>(a, n, init);
+        return true;
+    }
+    template <typename Out, typename T>
+    static bool compare(Out*, const T*, const T*, int, int) {return false;};
+};
+
+template <typename S, typename Op>
+struct vec_simd_run<S, Op, false, true> {
+    template <typename T>
+    static bool arith(T*, const T*, const T*, int, int) {return false;};
+    template <typename T>
+    static bool reduce(const T*, int, T, T&) {return false;};
+    template <typename Out, typename T>
+    static bool compare(Out* out, const T* a, const T* b, int n, int shape)
+    {
+        S::template compare<Op>(out, a, b, n, shape);
+        return true;
+    }
+};
+
+// Try the best instruction set first, then fall back to the lower ones
+template <int Isa, typename Op, typename T>
+struct vec_simd_dispatch {
+    typedef typename vec_simd_traits<Isa,
+        typename vec_simd_key<T>::type>::type S;
+    typedef vec_simd_run<S, Op, vec_simd_has_apply<S, Op>::value,
+        vec_simd_has_cmp<S, Op>::value> run;
+
+    static bool arith(T* out, const T* a, const T* b, int n, int shape)
+    {
+        if (vec_simd_isa() >= Isa && run::arith(out, a, b, n, shape))
+            return true;
+        return vec_simd_dispatch<Isa-1, Op, T>::arith(out, a, b, n, shape);
+    }
+
+    template <typename Out>
+    static bool compare(Out* out, const T* a, const T* b, int n, int shape)
+    {
+        if (vec_simd_isa() >= Isa && run::compare(out, a, b, n, shape))
+            return true;
+        return vec_simd_dispatch<Isa-1, Op, T>::compare(out, a, b, n, shape);
+    }
+
+    static bool reduce(const T* a, int n, T init, T& out)
+    {
+        if (vec_simd_isa() >= Isa && run::reduce(a, n, init, out))
+            return true;
+        return vec_simd_dispatch<Isa-1, Op, T>::reduce(a, n, init, out);
+    }
+};
+
+template <typename Op, typename T>
+struct vec_simd_dispatch<VEC_ISA_SCALAR, Op, T> {
+    static bool arith(T*, const T*, const T*, int, int) {return false;};
+    template <typename Out>
+    static bool compare(Out*, const T*, const T*, int, int) {return false;};
+    static bool reduce(const T*, int, T, T&) {return false;};
+};
+
+// Fold `n` items into `out`, accumulating in `Acc`
+template <typename Op, typename Acc, typename T, typename = void>
+struct vec_simd_reduce {
+    static bool run(const T*, int, Acc, Acc&) {return false;};
+};
+
+template <typename Op, typename T>
+struct vec_simd_reduce<Op, T, T, void> {
+    static bool run(const T* a, int n, T init, T& out)
+    {
+        return vec_simd_dispatch<VEC_ISA_AVX512, Op, T>::reduce(a, n, init, out);
+    }
+};
+
+// int32 sums widened to int64
+template <typename Acc, typename T>
+struct vec_simd_reduce<vec_op_add, Acc, T, typename std::enable_if<
+    std::is_same<typename vec_simd_key<Acc>::type, int64_t>::value
+    && std::is_same<typename vec_simd_key<T>::type, int32_t>::value>::type> {
+    static bool run(const T* a, int n, Acc init, Acc& out)
+    {
+#ifdef VEC_SIMD
+        const int32_t* p = reinterpret_cast<const int32_t*>(a);
+        switch (vec_simd_isa()) {
+        case VEC_ISA_AVX512:
+            out = init + vec_avx512_i32::sum_wide(p, n);
+            return true;
+        case VEC_ISA_AVX2:
+            out = init + vec_avx2_i32::sum_wide(p, n);
+            return true;
+        case VEC_ISA_SSE2:
+            out = init + vec_sse2_i32::sum_wide(p, n);
+            return true;
+        }
+#endif
+        (void)a;
+        (void)n;
+        (void)init;
+        (void)out;
+        return false;
+    }
+};
+
+// An operand a kernel can read: a `vec<T, A>`, a view, or an atom that
+//   converts to `T` without changing the result of the operation. ptr()
+//   returns null when the items are not contiguous
+template <typename X, typename T, typename = void>
+struct vec_simd_leaf {enum {ok = 0};};
+
+template <typename T, typename A>
+struct vec_simd_leaf<vec<T, A>, T> {
+    enum {ok = 1, atom = 0};
+    static const T* ptr(const vec<T, A>& v, T&, int begin)
+    {
+        return v.data() + begin;
+    }
+};
+
+template <typename U, typename T>
+struct vec_simd_leaf<vec_view<U>, T, typename std::enable_if<
+    std::is_same<typename std::remove_const<U>::type, T>::value>::type> {
+    enum {ok = 1, atom = 0};
+    static const T* ptr(const vec_view<U>& v, T&, int begin)
+    {
+        return v.stride() == 1 ? v.data() + begin : nullptr;
+    }
+};
+
+template <typename Q, typename T>
+struct vec_simd_leaf<vec_scalar<Q>, T, typename std::enable_if<
+    std::is_arithmetic<Q>::value
+    && std::is_same<typename std::common_type<T, Q>::type, T>::value>::type> {
+    enum {ok = 1, atom = 1};
+    static const T* ptr(const vec_scalar<Q>& s, T& tmp, int)
+    {
+        tmp = static_cast<T>(s.eval(0));
+        return &tmp;
+    }
+};
+
+// The element type of a `vec` or view operand, void for anything else
+template <typename X>
+struct vec_leaf_elem {typedef void type;};
+
+template <typename T, typename A>
+struct vec_leaf_elem<vec<T, A>> {typedef T type;};
+
+template <typename T>
+struct vec_leaf_elem<vec_view<T>> {typedef typename vec_view<T>::value_type type;};
+
+// The element type of the `vec` side of a node, the left one if both are
+template <typename L, typename R>
+struct vec_simd_elem {
+    typedef typename std::conditional<
+        std::is_void<typename vec_leaf_elem<L>::type>::value,
+        typename vec_leaf_elem<R>::type,
+        typename vec_leaf_elem<L>::type>::type type;
+};
+
+template <typename Out, typename Op, typename V, typename L, typename R,
+    typename = void>
+struct vec_simd_binary {
+    static bool run(Out*, const vec_binary_expr<Op, V, L, R>&, int, int)
+    {
+        return false;
+    }
+    static bool bits(uint64_t*, const vec_binary_expr<Op, V, L, R>&, int, int)
+    {
+        return false;
+    }
+};
+
+// Arithmetic: both operands, the node and the output share one type
+template <typename T, typename Op, typename L, typename R>
+struct vec_simd_binary<T, Op, T, L, R, typename std::enable_if<
+    !std::is_same<typename vec_simd_key<T>::type, void>::value
+    && std::is_same<typename vec_simd_elem<L, R>::type, T>::value
+    && vec_simd_leaf<L, T>::ok && vec_simd_leaf<R, T>::ok>::type> {
+    static bool run(T* out, const vec_binary_expr<Op, T, L, R>& e,
+        int begin, int end)
+    {
+        T ta, tb;
+        const T* a = vec_simd_leaf<L, T>::ptr(e.lhs(), ta, begin);
+        const T* b = vec_simd_leaf<R, T>::ptr(e.rhs(), tb, begin);
+        if (!a || !b)
+            return false;
+        const int shape = vec_simd_leaf<L, T>::atom ? 2
+            : vec_simd_leaf<R, T>::atom ? 1 : 0;
+        return vec_simd_dispatch<VEC_ISA_AVX512, Op, T>::arith(
+            out + begin, a, b, end - begin, shape);
+    }
+};
+
+// Comparison: both operands share one type, the output is bool
+template <typename Op, typename L, typename R>
+struct vec_simd_binary<bool, Op, bool, L, R, typename std::enable_if<
+    !std::is_same<typename vec_simd_key<
+        typename vec_simd_elem<L, R>::type>::type, void>::value
+    && vec_simd_leaf<L, typename vec_simd_elem<L, R>::type>::ok
+    && vec_simd_leaf<R, typename vec_simd_elem<L, R>::type>::ok>::type> {
+    static bool run(bool* out, const vec_binary_expr<Op, bool, L, R>& e,
+        int begin, int end)
+    {
+        typedef typename vec_simd_elem<L, R>::type T;
+        T ta, tb;
+        const T* a = vec_simd_leaf<L, T>::ptr(e.lhs(), ta, begin);
+        const T* b = vec_simd_leaf<R, T>::ptr(e.rhs(), tb, begin);
+        if (!a || !b)
+            return false;
+        const int shape = vec_simd_leaf<L, T>::atom ? 2
+            : vec_simd_leaf<R, T>::atom ? 1 : 0;
+        return vec_simd_dispatch<VEC_ISA_AVX512, Op, T>::compare(
+            out + begin, a, b, end - begin, shape);
+    }
+
+    // Packed into 64 bit words starting at `out`
+    static bool bits(uint64_t* out, const vec_binary_expr<Op, bool, L, R>& e,
+        int begin, int end)
+    {
+        typedef typename vec_simd_elem<L, R>::type T;
+        T ta, tb;
+        const T* a = vec_simd_leaf<L, T>::ptr(e.lhs(), ta, begin);
+        const T* b = vec_simd_leaf<R, T>::ptr(e.rhs(), tb, begin);
+        if (!a || !b)
+            return false;
+        const int shape = vec_simd_leaf<L, T>::atom ? 2
+            : vec_simd_leaf<R, T>::atom ? 1 : 0;
+        return vec_simd_dispatch<VEC_ISA_AVX512, Op, T>::compare(
+            out, a, b, end - begin, shape);
+    }
+};
+
+template <typename T, typename Op, typename V, typename L, typename R>
+void vec_materialize(T* out, const vec_binary_expr<Op, V, L, R>& e,
+    int begin, int end)
+{
+    if (vec_simd_binary<T, Op, V, L, R>::run(out, e, begin, end))
+        return;
+
+    for (int i = begin; i < end; i++)
+        out[i] = static_cast<T>(e.eval(i));
+}
+
+// Run math kernel `Fn` over `n` floats or doubles
+template <int Fn, typename T>
+bool vec_simd_math(T* out, const T* a, int n)
+{
+#ifdef VEC_SIMD
+    typedef typename vec_simd_key<T>::type K;
+    switch (vec_simd_isa()) {
+    case VEC_ISA_AVX512:
+        vec_simd_traits<VEC_ISA_AVX512, K>::type::template math<Fn>(out, a, n);
+        return true;
+    case VEC_ISA_AVX2:
+        vec_simd_traits<VEC_ISA_AVX2, K>::type::template math<Fn>(out, a, n);
+        return true;
+    case VEC_ISA_SSE2:
+        vec_simd_traits<VEC_ISA_SSE2, K>::type::template math<Fn>(out, a, n);
+        return true;
+    }
+#endif
+    return false;
+}
+
+template <typename Out, typename Fn, typename V, typename E, typename = void>
+struct vec_simd_unary {
+    static bool run(Out*, const vec_unary_expr<Fn, V, E>&, int, int)
+    {
+        return false;
+    }
+};
+
+// A math function of floats or doubles: the argument is evaluated into
+//   `out` (unless it can be read in place), then the kernel runs over it
+template <typename T, typename Fn, typename E>
+struct vec_simd_unary<T, Fn, T, E, typename std::enable_if<
+    (std::is_same<T, float>::value || std::is_same<T, double>::value)
+    && std::is_same<typename E::value_type, T>::value
+    && vec_math_id<Fn>::value != VEC_MATH_NONE>::type> {
+    static const vec_math_fn id = vec_math_id<Fn>::value;
+
+    static bool run(T* out, const vec_unary_expr<Fn, T, E>& e,
+        int begin, int end)
+    {
+        if (id != VEC_MATH_SQRT && vec_math_mode() != vec_math::fast)
+            return false;
+#ifdef VEC_SIMD
+        if (vec_simd_isa() < VEC_ISA_SSE2)
+            return false;
+        const T* a = leaf(e.arg(), begin);
+        if (!a) {
+            vec_materialize(out, e.arg(), begin, end);
+            a = out + begin;
+        }
+        return vec_simd_math<id>(out + begin, a, end - begin);
+#else
+        (void)out;
+        (void)e;
+        (void)begin;
+        (void)end;
+        return false;
+#endif
+    }
+
+    // The items of a vec or contiguous view, else null
+    template <typename X>
+    static typename std::enable_if<std::is_same<
+        typename vec_leaf_elem<X>::type, T>::value, const T*>::type
+    leaf(const X& x, int begin)
+    {
+        T tmp;
+        return vec_simd_leaf<X, T>::ptr(x, tmp, begin);
+    }
+    template <typename X>
+    static typename std::enable_if<!std::is_same<
+        typename vec_leaf_elem<X>::type, T>::value, const T*>::type
+    leaf(const X&, int)
+    {
+        return nullptr;
+    }
+};
+
+template <typename T, typename Fn, typename V, typename E>
+void vec_materialize(T* out, const vec_unary_expr<Fn, V, E>& e,
+    int begin, int end)
+{
+    if (vec_simd_unary<T, Fn, V, E>::run(out, e, begin, end))
+        return;
+
+    for (int i = begin; i < end; i++)
+        out[i] = static_cast<T>(e.eval(i));
+}
+
+
+
+
+///////////////
+// Bit Masks //
+///////////////
+
+// A boolean vector holding one bit per element, 64 elements per word.
+//   Comparisons and the logical operators (&&, ||, !) are evaluated into
+//   it a word at a time, and take() / apply_to() only visit its set bits:
+//
+//     vec_mask m = v > 3 && !(v == 7);
+//     vec<int> kept = v.take(m);
+//
+// Bits past size() are always 0.
+class vec_mask : public vec_expr<vec_mask> {
+public:
+    typedef bool value_type;
+
+    vec_mask() : size_(0) {}
+    explicit vec_mask(int size);        // `size` false elements
+    vec_mask(std::initializer_list<bool> lst);
+    template <typename E>
+    vec_mask(const vec_expr<E>& e);     // Evaluate a boolean expression
+    template <typename E>
+    vec_mask(vec_exec policy, const vec_expr<E>& e);
+
+    // Utils / Access
+    int size() const {return size_;};
+    bool eval(int i) const {return (words_.eval(i >> 6) >> (i & 63)) & 1;};
+    bool operator[](int i) const;
+    void set(int i, bool b);
+    int count() const;                  // Number of true elements
+    int words() const {return words_.size();};
+    const uint64_t* data() const {return words_.data();};
+
+private:
+    vec<uint64_t> words_;
+    int size_;
+};
+
+inline int vec_popcount(uint64_t w)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(w);
+#else
+    int n = 0;
+    for (; w; w &= w - 1)
+        n++;
+    return n;
+#endif
+}
+
+// Index of the lowest set bit, `w` must not be 0
+inline int vec_ctz(uint64_t w)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(w);
+#else
+    int n = 0;
+    for (; !(w & 1); w >>= 1)
+        n++;
+    return n;
+#endif
+}
+
+// Index of the highest set bit, `w` must not be 0
+inline int vec_msb(uint64_t w)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(w);
+#else
+    int n = 0;
+    for (; w >>= 1;)
+        n++;
+    return n;
+#endif
+}
+
+// Stream compaction: copy the items of `in` whose bit is set in `words`
+//   to the front of `out` and return how many there are. Bits past `n`
+//   must be 0 and nothing is written past the last copied item, so chunks
+//   of one output can be compacted in parallel.
+
+// Branch free write cursor: every item is written, and the cursor only
+//   moves past the selected ones. Stops at the last selected item
+template <typename T>
+int vec_compact_tail(T* out, const T* in, const uint64_t* words,
+    int begin, int n)
+{
+    int w = (n - 1) >> 6;
+    while (w >= 0 && w >= (begin >> 6) && !words[w])
+        w--;
+    if (w < 0 || w < (begin >> 6))
+        return 0;
+    const int last = w * 64 + vec_msb(words[w]);
+
+    int k = 0;
+    if (std::is_trivially_copyable<T>::value) {
+        for (int i = begin; i <= last; i++) {
+            out[k] = in[i];
+            k += (words[i >> 6] >> (i & 63)) & 1;
+        }
+        return k;
+    }
+
+    // Copying is expensive: only visit the selected items
+    for (int i = begin; i <= last; i = (i | 63) + 1) {
+        uint64_t bits = words[i >> 6] & (~uint64_t(0) << (i & 63));
+        for (; bits; bits &= bits - 1)
+            out[k++] = in[(i & ~63) + vec_ctz(bits)];
+    }
+    return k;
+}
+
+#ifdef VEC_SIMD
+
+// Kernels for trivially copyable items of `Size` bytes
+template <int Size>
+struct vec_compact_kernel {
+    enum {ok = 0};
+    static int avx2(char*, const char*, const uint64_t*, int, int& done)
+    {
+        return done = 0;
+    }
+    static int avx512(char*, const char*, const uint64_t*, int) {return 0;};
+};
+
+// 32 bit lanes `0..7` to gather for each 8 bit mask, 3 bits per lane
+struct vec_compact_lut {
+    uint32_t idx[256];
+    vec_compact_lut()
+    {
+        for (int m = 0; m < 256; m++) {
+            idx[m] = 0;
+            for (int j = 0, k = 0; j < 8; j++)
+                if (m & (1 << j))
+                    idx[m] |= j << (3 * k++);
+        }
+    }
+    static const vec_compact_lut& get() {static vec_compact_lut lut; return lut;};
+};
+
+// AVX2: permute the selected lanes to the front with a lookup table, then
+//   store the whole register while it fits in the output. AVX-512: the
+//   compress store does all of it
+#define VEC_COMPACT_KERNEL(SIZE, EPI, MASK)                             \
+template <>                                                             \
+struct vec_compact_kernel<SIZE> {                                       \
+    enum {ok = 1};                                                      \
+                                                                        \
+    static VEC_AVX2 int avx2(char* out, const char* in,                 \
+        const uint64_t* words, int n, int& done)                        \
+    {                                                                   \
+        const int lanes = 32 / SIZE;                                    \
+        const uint32_t* lut = vec_compact_lut::get().idx;               \
+        const __m256i shifts = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21); \
+        int total = 0;                                                  \
+        for (int w = 0; w < (n + 63) / 64; w++)                         \
+            total += vec_popcount(words[w]);                            \
+        int k = 0, i = 0;                                               \
+        for (; i + lanes <= n && k + lanes <= total; i += lanes) {      \
+            const unsigned m = (words[i >> 6] >> (i & 63))              \
+                & ((1u << lanes) - 1);                                  \
+            unsigned m32 = m;   /* One bit per 32 bit lane */           \
+            if (SIZE == 8)                                              \
+                m32 = (m & 1) * 3 | (m & 2) * 6 | (m & 4) * 12 | (m & 8) * 24; \
+            const __m256i idx = _mm256_and_si256(_mm256_srlv_epi32(     \
+                _mm256_set1_epi32(lut[m32]), shifts), _mm256_set1_epi32(7)); \
+            const __m256i v = _mm256_loadu_si256(                       \
+                reinterpret_cast<const __m256i*>(in + i * SIZE));       \
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k * SIZE), \
+                _mm256_permutevar8x32_epi32(v, idx));                   \
+            k += vec_popcount(m);                                       \
+        }                                                               \
+        done = i;                                                       \
+        return k;                                                       \
+    }                                                                   \
+                                                                        \
+    static VEC_AVX512 int avx512(char* out, const char* in,             \
+        const uint64_t* words, int n)                                   \
+    {                                                                   \
+        const int lanes = 64 / SIZE;                                    \
+        int k = 0;                                                      \
+        for (int i = 0; i < n; i += lanes) {                            \
+            const MASK m = static_cast<MASK>(words[i >> 6] >> (i & 63)); \
+            const __m512i v = _mm512_maskz_loadu_##EPI(m, in + i * SIZE); \
+            _mm512_mask_compressstoreu_##EPI(out + k * SIZE, m, v);     \
+            k += vec_popcount(m);                                       \
+        }                                                               \
+        return k;                                                       \
+    }                                                                   \
+};
+
+VEC_COMPACT_KERNEL(4, epi32, __mmask16)
+VEC_COMPACT_KERNEL(8, epi64, __mmask8)
+
+#endif // VEC_SIMD
+
+template <typename T>
+int vec_compact(T* out, const T* in, const uint64_t* words, int n)
+{
+#ifdef VEC_SIMD
+    typedef vec_compact_kernel<std::is_trivially_copyable<T>::value
+        ? static_cast<int>(sizeof(T)) : 0> kernel;
+    if (kernel::ok && vec_simd_isa() >= VEC_ISA_AVX512)
+        return kernel::avx512(reinterpret_cast<char*>(out),
+            reinterpret_cast<const char*>(in), words, n);
+    if (kernel::ok && vec_simd_isa() >= VEC_ISA_AVX2) {
+        int done;
+        const int k = kernel::avx2(reinterpret_cast<char*>(out),
+            reinterpret_cast<const char*>(in), words, n, done);
+        return k + vec_compact_tail(out + k, in, words, done, n);
+    }
+#endif
+    return vec_compact_tail(out, in, words, 0, n);
+}
+
+// Word `w` (elements 64*w .. 64*w+63) of a boolean expression of size `n`.
+//   Bits past `n` may be garbage, the caller clears them.
+template <typename E>
+uint64_t vec_mask_word(const E& e, int w, int n)
+{
+    const int begin = w * 64;
+    const int len = n - begin < 64 ? n - begin : 64;
+    uint64_t word = 0;
+    for (int j = 0; j < len; j++)
+        word |= static_cast<uint64_t>(static_cast<bool>(e.eval(begin + j))) << j;
+    return word;
+}
+
+inline uint64_t vec_mask_word(const vec_mask& m, int w, int)
+{
+    return m.data()[w];
+}
+
+template <typename Q>
+uint64_t vec_mask_word(const vec_scalar<Q>& s, int, int)
+{
+    return s.eval(0) ? ~uint64_t(0) : 0;
+}
+
+template <typename V, typename E>
+uint64_t vec_mask_word(const vec_unary_expr<vec_op_not, V, E>& e, int w, int n)
+{
+    return ~vec_mask_word(e.arg(), w, n);
+}
+
+// && and || combine whole words, comparisons go through the SIMD kernels
+template <typename Op>
+struct vec_mask_binary {
+    template <typename V, typename L, typename R>
+    static uint64_t word(const vec_binary_expr<Op, V, L, R>& e, int w, int n)
+    {
+        const int begin = w * 64;
+        const int end = n - begin < 64 ? n : begin + 64;
+        uint64_t word;
+        if (vec_simd_binary<bool, Op, V, L, R>::bits(&word, e, begin, end))
+            return word;
+        return vec_mask_word<vec_binary_expr<Op, V, L, R>>(e, w, n);
+    }
+};
+
+template <>
+struct vec_mask_binary<vec_op_and> {
+    template <typename V, typename L, typename R>
+    static uint64_t word(const vec_binary_expr<vec_op_and, V, L, R>& e,
+        int w, int n)
+    {
+        return vec_mask_word(e.lhs(), w, n) & vec_mask_word(e.rhs(), w, n);
+    }
+};
+
+template <>
+struct vec_mask_binary<vec_op_or> {
+    template <typename V, typename L, typename R>
+    static uint64_t word(const vec_binary_expr<vec_op_or, V, L, R>& e,
+        int w, int n)
+    {
+        return vec_mask_word(e.lhs(), w, n) | vec_mask_word(e.rhs(), w, n);
+    }
+};
+
+template <typename Op, typename V, typename L, typename R>
+uint64_t vec_mask_word(const vec_binary_expr<Op, V, L, R>& e, int w, int n)
+{
+    return vec_mask_binary<Op>::word(e, w, n);
+}
+
+inline vec_mask::vec_mask(int size) : size_(size)
+{
+    words_.resize((size + 63) / 64, 0);
+}
+
+inline vec_mask::vec_mask(std::initializer_list<bool> lst) : vec_mask(lst.size())
+{
+    int i = 0;
+    for (bool b : lst)
+        set(i++, b);
+}
+
+template <typename E>
+vec_mask::vec_mask(const vec_expr<E>& e) : vec_mask(vec_exec_default(), e) {}
+
+template <typename E>
+vec_mask::vec_mask(vec_exec policy, const vec_expr<E>& e)
+    : size_(e.self().size())
+{
+    const E& x = e.self();
+    const int n = size_;
+    const int nwords = (n + 63) / 64;
+    words_.resize(nwords);
+    uint64_t* out = words_.data();
+
+    const int chunks = vec_par_chunks(policy, n);
+    vec_parallel_for(chunks, [&](int c) {
+        const int end = vec_chunk_begin(nwords, chunks, c+1);
+        for (int w = vec_chunk_begin(nwords, chunks, c); w < end; w++)
+            out[w] = vec_mask_word(x, w, n);
+    });
+
+    if (n % 64)
+        out[nwords - 1] &= (uint64_t(1) << (n % 64)) - 1;
+}
+
+inline bool vec_mask::operator[](int i) const
+{
+    if (i < 0)
+        i = size_ + i;
+
+    if (i >= 0 && i < size_)
+        return eval(i);
+
+    throw std::out_of_range("Invalid position!");
+}
+
+inline void vec_mask::set(int i, bool b)
+{
+    if (i < 0 || i >= size_)
+        throw std::out_of_range("Invalid position!");
+
+    const uint64_t bit = uint64_t(1) << (i & 63);
+    if (b)
+        words_[i >> 6] |= bit;
+    else
+        words_[i >> 6] &= ~bit;
+}
+
+inline int vec_mask::count() const
+{
+    int n = 0;
+    for (int w = 0; w < words_.size(); w++)
+        n += vec_popcount(words_.eval(w));
+    return n;
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::take(const vec_mask& filter) const
+{
+    return take(vec_exec_default(), filter);
+}
+
+// The output is allocated once with the exact size. Under vec_exec::par
+//   the chunks are cut on word boundaries, count their set bits, then copy
+//   their items after the items of the chunks before them
+template <typename T, typename A>
+vec<T, A> vec<T, A>::take(vec_exec policy, const vec_mask& filter) const
+{
+    if (filter.size() != size_)
+        throw std::out_of_range("take: length error");
+
+    VEC_PROFILE_OP("take", size_);
+    const uint64_t* words = filter.data();
+    const int nwords = filter.words();
+    const int chunks = vec_par_chunks(policy, size_);
+
+    std::vector<int> offsets(chunks + 1, 0);
+    vec_parallel_for(chunks, [&](int c) {
+        const int end = vec_chunk_begin(nwords, chunks, c+1);
+        int count = 0;
+        for (int w = vec_chunk_begin(nwords, chunks, c); w < end; w++)
+            count += vec_popcount(words[w]);
+        offsets[c+1] = count;
+    });
+    for (int c = 0; c < chunks; c++)
+        offsets[c+1] += offsets[c];
+
+    vec<T, A> out(offsets[chunks]);
+    vec_parallel_for(chunks, [&](int c) {
+        const int begin = vec_chunk_begin(nwords, chunks, c) * 64;
+        int end = vec_chunk_begin(nwords, chunks, c+1) * 64;
+        end = end < size_ ? end : size_;
+        vec_compact(out.arr_ + offsets[c], arr_ + begin, words + begin / 64,
+            end - begin);
+    });
+    out.size_ = offsets[chunks];
+    return out;
+}
+
+template <typename T, typename A>
+template <typename E>
+vec<T, A> vec<T, A>::take(const vec_expr<E>& filter) const
+{
+    return take(vec_exec_default(), filter);
+}
+
+// The filter is evaluated only once, packed into words (comparisons by
+//   the SIMD kernels) and the items are copied by vec_compact(). Serially
+//   this happens a block at a time into an output large enough for every
+//   item; under vec_exec::par through a vec_mask of the whole filter
+template <typename T, typename A>
+template <typename E>
+vec<T, A> vec<T, A>::take(vec_exec policy, const vec_expr<E>& filter) const
+{
+    const E& f = filter.self();
+    if (f.size() != size_)
+        throw std::out_of_range("take: length error");
+
+    VEC_PROFILE_OP("take", size_);
+    if (vec_par_chunks(policy, size_) > 1)
+        return take(policy, vec_mask(policy, f));
+
+    const int block = 2048;
+    uint64_t words[block / 64];
+    vec<T, A> out(size_);
+    int newsize = 0;
+
+    for (int begin = 0; begin < size_; begin += block) {
+        const int len = size_ - begin < block ? size_ - begin : block;
+        const int nwords = (len + 63) / 64;
+        for (int w = 0; w < nwords; w++)
+            words[w] = vec_mask_word(f, begin / 64 + w, size_);
+        if (len % 64)
+            words[nwords - 1] &= (uint64_t(1) << (len % 64)) - 1;
+        newsize += vec_compact(out.arr_ + newsize, arr_ + begin, words, len);
+    }
+
+    // Give back the unused memory if most items were dropped
+    out.size_ = newsize;
+    if (newsize < size_ / 2)
+        out.shrink_to_fit();
+
+    return out;
+}
+
+template <typename T, typename A>
+vec<T, A>& vec<T, A>::apply_to(const vec_mask& filter, auto fn) {
+    return apply_to(vec_exec_default(), filter, fn);
+}
+
+template <typename T, typename A>
+vec<T, A>& vec<T, A>::apply_to(vec_exec policy, const vec_mask& filter, auto fn) {
+    if (filter.size() != size_)
+        throw std::out_of_range("take: length error");
+
+    const uint64_t* words = filter.data();
+    const int nwords = filter.words();
+    const int chunks = vec_par_chunks(policy, size_);
+    vec_parallel_for(chunks, [&](int c) {
+        const int end = vec_chunk_begin(nwords, chunks, c+1);
+        for (int w = vec_chunk_begin(nwords, chunks, c); w < end; w++)
+            for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+                const int i = w * 64 + vec_ctz(bits);
+                arr_[i] = fn(arr_[i]);
+            }
+    });
+
+    return *this;
+}
+
+
+
+
+
+//////////////////////////
+// Aggregate Operations //
+//////////////////////////
+
+// Fold elements `begin`..`end`-1 of `e` with `Op` using four independent
+//   accumulators, so that consecutive elements do not wait on each other.
+//   `init` must leave the result unchanged (0 for +, 1 for *, any element
+//   for min/max)
+template <typename Op, typename Acc, typename E>
+Acc vec_reduce_loop(const E& e, Acc init, int begin, int end)
+{
+    Acc acc0 = init, acc1 = init, acc2 = init, acc3 = init;
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        acc0 = static_cast<Acc>(Op()(acc0, static_cast<Acc>(e.eval(i))));
+        acc1 = static_cast<Acc>(Op()(acc1, static_cast<Acc>(e.eval(i+1))));
+        acc2 = static_cast<Acc>(Op()(acc2, static_cast<Acc>(e.eval(i+2))));
+        acc3 = static_cast<Acc>(Op()(acc3, static_cast<Acc>(e.eval(i+3))));
+    }
+    for (; i < end; i++)
+        acc0 = static_cast<Acc>(Op()(acc0, static_cast<Acc>(e.eval(i))));
+
+    return static_cast<Acc>(Op()(static_cast<Acc>(Op()(acc0, acc1)),
+        static_cast<Acc>(Op()(acc2, acc3))));
+}
+
+template <typename Op, typename Acc, typename E>
+Acc vec_reduce_range(const E& e, Acc init, int begin, int end)
+{
+    return vec_reduce_loop<Op>(e, init, begin, end);
+}
+
+// A plain `vec` or a contiguous view (`a` is not null) is folded by the
+//   SIMD kernels when there is one
+template <typename Op, typename Acc, typename T, typename E>
+Acc vec_reduce_items(const T* a, const E& e, Acc init, int begin, int end)
+{
+    Acc out;
+    if (a && vec_simd_reduce<Op, Acc, T>::run(a + begin, end - begin,
+            init, out))
+        return out;
+
+    return vec_reduce_loop<Op>(e, init, begin, end);
+}
+
+template <typename Op, typename Acc, typename T, typename A>
+Acc vec_reduce_range(const vec<T, A>& v, Acc init, int begin, int end)
+{
+    return vec_reduce_items<Op>(v.data(), v, init, begin, end);
+}
+
+template <typename Op, typename Acc, typename T>
+Acc vec_reduce_range(const vec_view<T>& v, Acc init, int begin, int end)
+{
+    const typename vec_view<T>::value_type* a = v.data();
+    return vec_reduce_items<Op>(v.stride() == 1 ? a : nullptr, v,
+        init, begin, end);
+}
+
+// Fold all of `e`, in parallel chunks under vec_exec::par
+template <typename Op, typename Acc, typename E>
+Acc vec_reduce(const E& e, Acc init, vec_exec policy)
+{
+    const int size = e.size();
+    const int chunks = vec_par_chunks(policy, size);
+    if (chunks <= 1)
+        return vec_reduce_range<Op>(e, init, 0, size);
+
+    std::vector<Acc> partial(chunks, init);
+    vec_parallel_for(chunks, [&](int c) {
+        partial[c] = vec_reduce_range<Op>(e, init,
+            vec_chunk_begin(size, chunks, c),
+            vec_chunk_begin(size, chunks, c+1));
+    });
+
+    Acc total = partial[0];
+    for (int c = 1; c < chunks; c++)
+        total = static_cast<Acc>(Op()(total, partial[c]));
+    return total;
+}
+
+// Index of the first element `x` in `begin`..`end`-1 for which no other
+//   element `y` satisfies Better(x, y), found in a single pass
+template <typename Better, typename E>
+int vec_arg_reduce_loop(const E& e, int begin, int end)
+{
+    typedef typename E::value_type V;
+    V best = e.eval(begin);
+    int idx = begin;
+    for (int i = begin + 1; i < end; i++) {
+        V x = e.eval(i);
+        if (Better()(best, x)) {
+            best = x;
+            idx = i;
+        }
+    }
+    return idx;
+}
+
+template <typename Better, typename Fold, typename E>
+int vec_arg_reduce_range(const E& e, int begin, int end)
+{
+    return vec_arg_reduce_loop<Better>(e, begin, end);
+}
+
+// For a plain `vec` or a contiguous view (`a` is not null), fold blocks
+//   with the SIMD kernels and only search the block holding the best
+//   value for its position. Each block starts from the best value so far,
+//   so a NaN at the start of a block does not hide the rest of it
+template <typename Better, typename Fold, typename T, typename E>
+int vec_arg_reduce_items(const T* a, const E& v, int begin, int end)
+{
+    const int block = 1024;
+    if (!a)
+        return vec_arg_reduce_loop<Better>(v, begin, end);
+
+    T best = a[begin];
+    int best_start = begin;
+    for (int b = begin; b < end; b += block) {
+        const int len = end - b < block ? end - b : block;
+        T m;
+        if (!vec_simd_reduce<Fold, T, T>::run(a + b, len, best, m))
+            return vec_arg_reduce_loop<Better>(v, begin, end);
+
+        if (Better()(best, m)) {
+            best = m;
+            best_start = b;
+        }
+    }
+
+    const int best_end = end - best_start < block ? end : best_start + block;
+    for (int i = best_start; i < best_end; i++)
+        if (a[i] == best)
+            return i;
+
+    // Unordered values (NaN), search the slow way
+    return vec_arg_reduce_loop<Better>(v, begin, end);
+}
+
+template <typename Better, typename Fold, typename T, typename A>
+int vec_arg_reduce_range(const vec<T, A>& v, int begin, int end)
+{
+    return vec_arg_reduce_items<Better, Fold>(v.data(), v, begin, end);
+}
+
+template <typename Better, typename Fold, typename T>
+int vec_arg_reduce_range(const vec_view<T>& v, int begin, int end)
+{
+    const typename vec_view<T>::value_type* a = v.data();
+    return vec_arg_reduce_items<Better, Fold>(v.stride() == 1 ? a : nullptr,
+        v, begin, end);
+}
+
+// Search all of `e`, in parallel chunks under vec_exec::par. Ties go
+//   to the chunk that comes first
+template <typename Better, typename Fold, typename E>
+int vec_arg_reduce(const E& e, vec_exec policy)
+{
+    const int size = e.size();
+    const int chunks = vec_par_chunks(policy, size);
+    if (chunks <= 1)
+        return vec_arg_reduce_range<Better, Fold>(e, 0, size);
+
+    std::vector<int> partial(chunks);
+    vec_parallel_for(chunks, [&](int c) {
+        int begin = vec_chunk_begin(size, chunks, c);
+        const int end = vec_chunk_begin(size, chunks, c+1);
+
+        // Only a NaN first item of all wins, skip those starting a chunk
+        while (c > 0 && begin + 1 < end && !(e.eval(begin) == e.eval(begin)))
+            begin++;
+        partial[c] = vec_arg_reduce_range<Better, Fold>(e, begin, end);
+    });
+
+    typename E::value_type best = e.eval(partial[0]);
+    int idx = partial[0];
+    for (int c = 1; c < chunks; c++) {
+        typename E::value_type x = e.eval(partial[c]);
+        if (Better()(best, x)) {
+            best = x;
+            idx = partial[c];
+        }
+    }
+    return idx;
+}
+
+template <typename E>
+typename E::value_type sum(vec_exec policy, const vec_expr<E>& v)
+{
+    VEC_PROFILE_OP("sum", v.self().size());
+    typename E::value_type total = 0;
+    return vec_reduce<vec_op_add>(v.self(), total, policy);
+}
+
+template <typename E>
+typename E::value_type sum(const vec_expr<E>& v)
+{
+    return sum(vec_exec_default(), v);
+}
+
+// Sum into a wider accumulator, e.g. sum<int64_t>(v) for a vec<int>
+//   that might overflow
+template <typename Acc, typename E>
+Acc sum(vec_exec policy, const vec_expr<E>& v)
+{
+    VEC_PROFILE_OP("sum", v.self().size());
+    Acc total = 0;
+    return vec_reduce<vec_op_add>(v.self(), total, policy);
+}
+
+template <typename Acc, typename E>
+Acc sum(const vec_expr<E>& v)
+{
+    return sum<Acc>(vec_exec_default(), v);
+}
+
+template <typename E>
+typename E::value_type prod(vec_exec policy, const vec_expr<E>& v)
+{
+    VEC_PROFILE_OP("prod", v.self().size());
+    typename E::value_type total = 1;
+    return vec_reduce<vec_op_mul>(v.self(), total, policy);
+}
+
+template <typename E>
+typename E::value_type prod(const vec_expr<E>& v)
+{
+    return prod(vec_exec_default(), v);
+}
+
+template <typename E>
+typename E::value_type max(vec_exec policy, const vec_expr<E>& v)
+{
+    const E& e = v.self();
+    if (e.size() == 0)
+        throw std::out_of_range("max: empty vector");
+
+    VEC_PROFILE_OP("max", e.size());
+    typename E::value_type first = e.eval(0);
+    return vec_reduce<vec_op_max>(e, first, policy);
+}
+
+template <typename E>
+typename E::value_type max(const vec_expr<E>& v)
+{
+    return max(vec_exec_default(), v);
+}
+
+
+template <typename E>
+typename E::value_type min(vec_exec policy, const vec_expr<E>& v)
+{
+    const E& e = v.self();
+    if (e.size() == 0)
+        throw std::out_of_range("min: empty vector");
+
+    VEC_PROFILE_OP("min", e.size());
+    typename E::value_type first = e.eval(0);
+    return vec_reduce<vec_op_min>(e, first, policy);
+}
+
+template <typename E>
+typename E::value_type min(const vec_expr<E>& v)
+{
+    return min(vec_exec_default(), v);
+}
+
+// Index of the (first) largest element
+template <typename E>
+int argmax(vec_exec policy, const vec_expr<E>& v)
+{
+    if (v.self().size() == 0)
+        throw std::out_of_range("argmax: empty vector");
+
+    VEC_PROFILE_OP("argmax", v.self().size());
+    return vec_arg_reduce<vec_op_lt, vec_op_max>(v.self(), policy);
+}
+
+template <typename E>
+int argmax(const vec_expr<E>& v)
+{
+    return argmax(vec_exec_default(), v);
+}
+
+// Index of the (first) smallest element
+template <typename E>
+int argmin(vec_exec policy, const vec_expr<E>& v)
+{
+    if (v.self().size() == 0)
+        throw std::out_of_range("argmin: empty vector");
+
+    VEC_PROFILE_OP("argmin", v.self().size());
+    return vec_arg_reduce<vec_op_gt, vec_op_min>(v.self(), policy);
+}
+
+template <typename E>
+int argmin(const vec_expr<E>& v)
+{
+    return argmin(vec_exec_default(), v);
+}
+
+
+
+
+
+////////////////////
+// Linear Algebra //
+////////////////////
+
+// BLAS level 1: dot(x, y), axpy(alpha, x, y), scal(alpha, x) and the
+//   norms. Floats and doubles held in a vec or contiguous view go
+//   through the SIMD kernels, anything else through a scalar loop with
+//   four accumulators. Nothing is allocated
+
+template <typename T>
+struct vec_blas_simd : std::integral_constant<bool,
+    std::is_same<T, float>::value || std::is_same<T, double>::value> {};
+
+// Call `fn` with the kernels of the current instruction set
+template <typename T, typename Fn>
+typename std::enable_if<vec_blas_simd<T>::value, bool>::type
+vec_simd_blas(const Fn& fn)
+{
+#ifdef VEC_SIMD
+    switch (vec_simd_isa()) {
+    case VEC_ISA_AVX512:
+        fn(typename vec_simd_traits<VEC_ISA_AVX512, T>::type());
+        return true;
+    case VEC_ISA_AVX2:
+        if (vec_simd_fma()) {
+            fn(typename vec_simd_traits<VEC_ISA_AVX2, T>::type());
+            return true;
+        }
+        fn(typename vec_simd_traits<VEC_ISA_SSE2, T>::type());
+        return true;
+    case VEC_ISA_SSE2:
+        fn(typename vec_simd_traits<VEC_ISA_SSE2, T>::type());
+        return true;
+    }
+#endif
+    (void)fn;
+    return false;
+}
+
+template <typename T, typename Fn>
+typename std::enable_if<!vec_blas_simd<T>::value, bool>::type
+vec_simd_blas(const Fn&)
+{
+    return false;
+}
+
+// The items of a vec or contiguous view of `T` from `begin`, else null
+template <typename T, typename X>
+typename std::enable_if<std::is_same<
+    typename vec_leaf_elem<X>::type, T>::value, const T*>::type
+vec_blas_leaf(const X& x, int begin)
+{
+    T tmp;
+    return vec_simd_leaf<X, T>::ptr(x, tmp, begin);
+}
+
+template <typename T, typename X>
+typename std::enable_if<!std::is_same<
+    typename vec_leaf_elem<X>::type, T>::value, const T*>::type
+vec_blas_leaf(const X&, int)
+{
+    return nullptr;
+}
+
+template <typename Acc, typename L, typename R>
+Acc vec_dot_range(const L& x, const R& y, int begin, int end)
+{
+    const Acc* a = vec_blas_leaf<Acc>(x, begin);
+    const Acc* b = vec_blas_leaf<Acc>(y, begin);
+    Acc out = 0;
+    if (a && b && vec_simd_blas<Acc>([&](auto s) {
+            out = decltype(s)::dot(a, b, end - begin);
+        }))
+        return out;
+
+    Acc acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        acc0 += static_cast<Acc>(x.eval(i)) * static_cast<Acc>(y.eval(i));
+        acc1 += static_cast<Acc>(x.eval(i+1)) * static_cast<Acc>(y.eval(i+1));
+        acc2 += static_cast<Acc>(x.eval(i+2)) * static_cast<Acc>(y.eval(i+2));
+        acc3 += static_cast<Acc>(x.eval(i+3)) * static_cast<Acc>(y.eval(i+3));
+    }
+    for (; i < end; i++)
+        acc0 += static_cast<Acc>(x.eval(i)) * static_cast<Acc>(y.eval(i));
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+// Sum of x[i] * y[i], in parallel chunks under vec_exec::par. The
+//   chunks are added up in order
+template <typename Acc, typename L, typename R>
+Acc vec_dot(const L& x, const R& y, vec_exec policy)
+{
+    const int size = x.size();
+    const int chunks = vec_par_chunks(policy, size);
+    if (chunks <= 1)
+        return vec_dot_range<Acc>(x, y, 0, size);
+
+    std::vector<Acc> partial(chunks);
+    vec_parallel_for(chunks, [&](int c) {
+        partial[c] = vec_dot_range<Acc>(x, y,
+            vec_chunk_begin(size, chunks, c),
+            vec_chunk_begin(size, chunks, c+1));
+    });
+
+    Acc total = partial[0];
+    for (int c = 1; c < chunks; c++)
+        total += partial[c];
+    return total;
+}
+
+template <typename L, typename R>
+typename std::common_type<typename L::value_type,
+    typename R::value_type>::type
+dot(vec_exec policy, const vec_expr<L>& x, const vec_expr<R>& y)
+{
+    typedef typename std::common_type<typename L::value_type,
+        typename R::value_type>::type Acc;
+    if (x.self().size() != y.self().size())
+        throw std::out_of_range("dot: length error");
+
+    VEC_PROFILE_OP("dot", x.self().size());
+    return vec_dot<Acc>(x.self(), y.self(), policy);
+}
+
+template <typename L, typename R>
+typename std::common_type<typename L::value_type,
+    typename R::value_type>::type
+dot(const vec_expr<L>& x, const vec_expr<R>& y)
+{
+    return dot(vec_exec_default(), x, y);
+}
+
+// y += alpha * x, in place. `x` may be any expression of y's size,
+//   including y itself. When it reads y through a view shifted to other
+//   positions it is copied first
+template <typename T, typename A, typename E>
+vec<T, A>& axpy(vec_exec policy, typename vec<T, A>::value_type alpha,
+    const vec_expr<E>& x, vec<T, A>& y)
+{
+    const E& e = x.self();
+    const int size = y.size();
+    if (e.size() != size)
+        throw std::out_of_range("axpy: length error");
+    if (vec_reads_shifted(e, y.data(), size))
+        return axpy(policy, alpha, vec<typename E::value_type>(policy, e), y);
+
+    VEC_PROFILE_OP("axpy", size);
+    T* out = y.data();
+    const int chunks = vec_par_chunks(policy, size);
+    vec_parallel_for(chunks, [&](int c) {
+        const int begin = vec_chunk_begin(size, chunks, c);
+        const int end = vec_chunk_begin(size, chunks, c+1);
+        const T* a = vec_blas_leaf<T>(e, begin);
+        if (a && vec_simd_blas<T>([&](auto s) {
+                decltype(s)::axpy(alpha, a, out + begin, end - begin);
+            }))
+            return;
+
+        for (int i = begin; i < end; i++)
+            out[i] += static_cast<T>(alpha * e.eval(i));
+    });
+    return y;
+}
+
+template <typename T, typename A, typename E>
+vec<T, A>& axpy(typename vec<T, A>::value_type alpha,
+    const vec_expr<E>& x, vec<T, A>& y)
+{
+    return axpy(vec_exec_default(), alpha, x, y);
+}
+
+// x *= alpha, in place
+template <typename T, typename A>
+vec<T, A>& scal(vec_exec policy, typename vec<T, A>::value_type alpha,
+    vec<T, A>& x)
+{
+    const int size = x.size();
+    VEC_PROFILE_OP("scal", size);
+    T* out = x.data();
+    const int chunks = vec_par_chunks(policy, size);
+    vec_parallel_for(chunks, [&](int c) {
+        const int begin = vec_chunk_begin(size, chunks, c);
+        const int end = vec_chunk_begin(size, chunks, c+1);
+        if (vec_simd_blas<T>([&](auto s) {
+                decltype(s)::scal(alpha, out + begin, end - begin);
+            }))
+            return;
+
+        for (int i = begin; i < end; i++)
+            out[i] *= alpha;
+    });
+    return x;
+}
+
+template <typename T, typename A>
+vec<T, A>& scal(typename vec<T, A>::value_type alpha, vec<T, A>& x)
+{
+    return scal(vec_exec_default(), alpha, x);
+}
+
+// What norm1() and norminf() return: the unsigned type for signed
+//   integers, where |INT_MIN| does not fit
+template <typename T, typename = void>
+struct vec_norm_type {typedef T type;};
+
+template <typename T>
+struct vec_norm_type<T, typename std::enable_if<std::is_integral<T>::value
+    && std::is_signed<T>::value>::type> {
+    typedef typename std::make_unsigned<T>::type type;
+};
+
+// |x| as an R, negated in R so that the smallest integer does not overflow
+template <typename R, typename V>
+R vec_abs_as(V x)
+{
+    return x < 0 ? R(R(0) - R(x)) : R(x);
+}
+
+// Sum of |x[i]| (Max = false) or largest |x[i]| (Max = true) of
+//   elements `begin`..`end`-1. A NaN anywhere makes the largest NaN
+template <bool Max, typename R, typename E>
+R vec_norm_range(const E& e, int begin, int end)
+{
+    const R* a = vec_blas_leaf<R>(e, begin);
+    R out = 0;
+    if (a && vec_simd_blas<R>([&](auto s) {
+            out = Max ? decltype(s)::amax(a, end - begin)
+                : decltype(s)::asum(a, end - begin);
+        }))
+        return out;
+
+    R acc0 = 0, acc1 = 0;
+    bool nan = false;
+    for (int i = begin; i < end; i++) {
+        const R ax = vec_abs_as<R>(e.eval(i));
+        if (!Max)
+            ((i & 1) ? acc1 : acc0) += ax;
+        else if (ax > acc0)
+            acc0 = ax;
+        else if (ax != ax)
+            nan = true;
+    }
+    return nan ? std::numeric_limits<R>::quiet_NaN() : acc0 + acc1;
+}
+
+template <bool Max, typename R, typename E>
+R vec_norm(const E& e, vec_exec policy)
+{
+    const int size = e.size();
+    const int chunks = vec_par_chunks(policy, size);
+    if (chunks <= 1)
+        return vec_norm_range<Max, R>(e, 0, size);
+
+    std::vector<R> partial(chunks);
+    vec_parallel_for(chunks, [&](int c) {
+        partial[c] = vec_norm_range<Max, R>(e,
+            vec_chunk_begin(size, chunks, c),
+            vec_chunk_begin(size, chunks, c+1));
+    });
+
+    R total = partial[0];
+    for (int c = 1; c < chunks; c++) {
+        if (!Max)
+            total += partial[c];
+        else if (!(partial[c] <= total))
+            total = total != total ? total : partial[c];
+    }
+    return total;
+}
+
+// Sum of absolute values, unsigned for signed integers
+template <typename E>
+typename vec_norm_type<typename E::value_type>::type
+norm1(vec_exec policy, const vec_expr<E>& v)
+{
+    VEC_PROFILE_OP("norm1", v.self().size());
+    return vec_norm<false, typename vec_norm_type<
+        typename E::value_type>::type>(v.self(), policy);
+}
+
+template <typename E>
+typename vec_norm_type<typename E::value_type>::type
+norm1(const vec_expr<E>& v)
+{
+    return norm1(vec_exec_default(), v);
+}
+
+// Largest absolute value, 0 when empty. Unsigned for signed integers,
+//   so that norminf(vec<int>{INT_MIN}) is 2147483648
+template <typename E>
+typename vec_norm_type<typename E::value_type>::type
+norminf(vec_exec policy, const vec_expr<E>& v)
+{
+    VEC_PROFILE_OP("norminf", v.self().size());
+    return vec_norm<true, typename vec_norm_type<
+        typename E::value_type>::type>(v.self(), policy);
+}
+
+template <typename E>
+typename vec_norm_type<typename E::value_type>::type
+norminf(const vec_expr<E>& v)
+{
+    return norminf(vec_exec_default(), v);
+}
+
+// Euclidean length, a double for integers. The fast sqrt(dot(v, v))
+//   is redone with the elements scaled to about 1 by norminf(v) when
+//   the squares overflow or underflow, in parallel chunks under vec_exec::par
+template <typename E>
+typename std::conditional<std::is_floating_point<typename E::value_type>::value,
+    typename E::value_type, double>::type
+norm2(vec_exec policy, const vec_expr<E>& v)
+{
+    typedef typename std::conditional<
+        std::is_floating_point<typename E::value_type>::value,
+        typename E::value_type, double>::type R;
+    const E& e = v.self();
+    VEC_PROFILE_OP("norm2", e.size());
+    const R ss = vec_dot<R>(e, e, policy);
+    const R r = std::sqrt(ss);
+    if (ss >= std::numeric_limits<R>::min() && r <= std::numeric_limits<R>::max())
+        return r;
+
+    const R m = static_cast<R>(vec_norm<true, R>(e, policy));
+    if (m == 0 || !(m <= std::numeric_limits<R>::max()))
+        return m;
+
+    // Scaling by a power of 2 is exact
+    const int exp = std::ilogb(m);
+    const int size = e.size();
+    const int chunks = vec_par_chunks(policy, size);
+    std::vector<R> partial(chunks, R(0));
+    vec_parallel_for(chunks, [&](int c) {
+        const int end = vec_chunk_begin(size, chunks, c+1);
+        R s = 0;
+        for (int i = vec_chunk_begin(size, chunks, c); i < end; i++) {
+            const R x = std::ldexp(static_cast<R>(e.eval(i)), -exp);
+            s += x * x;
+        }
+        partial[c] = s;
+    });
+
+    R scaled = 0;
+    for (int c = 0; c < chunks; c++)
+        scaled += partial[c];
+    return std::ldexp(std::sqrt(scaled), exp);
+}
+
+template <typename E>
+typename std::conditional<std::is_floating_point<typename E::value_type>::value,
+    typename E::value_type, double>::type
+norm2(const vec_expr<E>& v)
+{
+    return norm2(vec_exec_default(), v);
+}
+
+
+
+
+
+///////////
+// Scans //
+///////////
+
+#ifdef VEC_SIMD
+// Running sums within SSE2 registers: each register is added to itself
+//   shifted by one lane, then by two, which leaves the prefix sums of its
+//   lanes. The total of the registers before it is then added on
+template <typename K>
+struct vec_sse2_scan;
+
+template <>
+struct vec_sse2_scan<float> {
+    typedef __m128 reg;
+    enum {width = 4};
+    static VEC_SSE2 reg load(const float* p) {return _mm_loadu_ps(p);};
+    static VEC_SSE2 void store(float* p, reg a) {_mm_storeu_ps(p, a);};
+    static VEC_SSE2 reg set1(float x) {return _mm_set1_ps(x);};
+    static VEC_SSE2 reg add(reg a, reg b) {return _mm_add_ps(a, b);};
+    template <int Bytes>
+    static VEC_SSE2 reg shift(reg a) {return _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(a), Bytes));};
+    static VEC_SSE2 reg last(reg a) {return _mm_shuffle_ps(a, a, 0xFF);};
+};
+
+template <>
+struct vec_sse2_scan<double> {
+    typedef __m128d reg;
+    enum {width = 2};
+    static VEC_SSE2 reg load(const double* p) {return _mm_loadu_pd(p);};
+    static VEC_SSE2 void store(double* p, reg a) {_mm_storeu_pd(p, a);};
+    static VEC_SSE2 reg set1(double x) {return _mm_set1_pd(x);};
+    static VEC_SSE2 reg add(reg a, reg b) {return _mm_add_pd(a, b);};
+    template <int Bytes>
+    static VEC_SSE2 reg shift(reg a) {return _mm_castsi128_pd(_mm_slli_si128(_mm_castpd_si128(a), Bytes));};
+    static VEC_SSE2 reg last(reg a) {return _mm_unpackhi_pd(a, a);};
+};
+
+template <>
+struct vec_sse2_scan<int32_t> {
+    typedef __m128i reg;
+    enum {width = 4};
+    static VEC_SSE2 reg load(const int32_t* p) {return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));};
+    static VEC_SSE2 void store(int32_t* p, reg a) {_mm_storeu_si128(reinterpret_cast<__m128i*>(p), a);};
+    static VEC_SSE2 reg set1(int32_t x) {return _mm_set1_epi32(x);};
+    static VEC_SSE2 reg add(reg a, reg b) {return _mm_add_epi32(a, b);};
+    template <int Bytes>
+    static VEC_SSE2 reg shift(reg a) {return _mm_slli_si128(a, Bytes);};
+    static VEC_SSE2 reg last(reg a) {return _mm_shuffle_epi32(a, 0xFF);};
+};
+
+template <>
+struct vec_sse2_scan<int64_t> {
+    typedef __m128i reg;
+    enum {width = 2};
+    static VEC_SSE2 reg load(const int64_t* p) {return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));};
+    static VEC_SSE2 void store(int64_t* p, reg a) {_mm_storeu_si128(reinterpret_cast<__m128i*>(p), a);};
+    static VEC_SSE2 reg set1(int64_t x) {return _mm_set1_epi64x(x);};
+    static VEC_SSE2 reg add(reg a, reg b) {return _mm_add_epi64(a, b);};
+    template <int Bytes>
+    static VEC_SSE2 reg shift(reg a) {return _mm_slli_si128(a, Bytes);};
+    static VEC_SSE2 reg last(reg a) {return _mm_unpackhi_epi64(a, a);};
+};
+
+// Scan `n` items after `carry`, returning the new carry. The carry is
+//   only one add away from the previous one, so registers do not wait on
+//   each other's shifts
+template <bool Excl, typename K>
+VEC_SSE2 K vec_sse2_scan_add(K* out, const K* in, int n, K carry)
+{
+    typedef vec_sse2_scan<K> S;
+    typedef typename S::reg reg;
+    reg c = S::set1(carry);
+    int i = 0;
+    for (; i + S::width <= n; i += S::width) {
+        reg x = S::load(in + i);
+        x = S::add(x, S::template shift<sizeof(K)>(x));
+        if (S::width == 4)
+            x = S::add(x, S::template shift<2 * sizeof(K)>(x));
+        S::store(out + i, S::add(c, Excl ? S::template shift<sizeof(K)>(x) : x));
+        c = S::add(c, S::last(x));
+    }
+
+    K lanes[S::width];
+    S::store(lanes, c);
+    carry = lanes[0];
+    for (; i < n; i++) {
+        const K x = in[i];
+        out[i] = Excl ? carry : carry + x;
+        carry += x;
+    }
+    return carry;
+}
+#endif
+
+// Element types with an SSE2 running sum
+template <typename K>
+struct vec_scan_simd {
+    template <bool Excl, typename T>
+    static bool run(T*, const T*, int, T&) {return false;};
+};
+
+#ifdef VEC_SIMD
+template <typename K>
+struct vec_scan_simd_kernel {
+    template <bool Excl, typename T>
+    static bool run(T* out, const T* in, int n, T& carry)
+    {
+        if (vec_simd_isa() < VEC_ISA_SSE2)
+            return false;
+        carry = static_cast<T>(vec_sse2_scan_add<Excl>(reinterpret_cast<K*>(out),
+            reinterpret_cast<const K*>(in), n, static_cast<K>(carry)));
+        return true;
+    }
+};
+
+template <> struct vec_scan_simd<float> : vec_scan_simd_kernel<float> {};
+template <> struct vec_scan_simd<double> : vec_scan_simd_kernel<double> {};
+template <> struct vec_scan_simd<int32_t> : vec_scan_simd_kernel<int32_t> {};
+template <> struct vec_scan_simd<int64_t> : vec_scan_simd_kernel<int64_t> {};
+#endif
+
+// Scan `n` items of `in` into `out` after `carry`, returning the new
+//   carry. Inclusive: out[i] = carry op in[0] op ... op in[i], exclusive
+//   leaves in[i] out. `out` may be `in`
+template <bool Excl, typename T, typename Op>
+T vec_scan_block(T* out, const T* in, int n, const Op& op, T carry)
+{
+    for (int i = 0; i < n; i++) {
+        const T x = in[i];
+        const T next = static_cast<T>(op(carry, x));
+        out[i] = Excl ? carry : next;
+        carry = next;
+    }
+    return carry;
+}
+
+template <bool Excl, typename T>
+T vec_scan_block(T* out, const T* in, int n, const vec_op_add&, T carry)
+{
+    if (vec_scan_simd<typename vec_simd_key<T>::type>::template
+            run<Excl>(out, in, n, carry))
+        return carry;
+
+    for (int i = 0; i < n; i++) {
+        const T x = in[i];
+        const T next = static_cast<T>(carry + x);
+        out[i] = Excl ? carry : next;
+        carry = next;
+    }
+    return carry;
+}
+
+// Fold `n` > 0 items with `op`, by the reduction kernels for + and *
+template <typename T, typename Op>
+T vec_scan_total(const T* in, int n, const Op& op)
+{
+    T total = in[0];
+    for (int i = 1; i < n; i++)
+        total = static_cast<T>(op(total, in[i]));
+    return total;
+}
+
+template <typename T>
+T vec_scan_total(const T* in, int n, const vec_op_add&)
+{
+    return vec_reduce_items<vec_op_add>(in, vec_view<const T>(in, n),
+        static_cast<T>(0), 0, n);
+}
+
+template <typename T>
+T vec_scan_total(const T* in, int n, const vec_op_mul&)
+{
+    return vec_reduce_items<vec_op_mul>(in, vec_view<const T>(in, n),
+        static_cast<T>(1), 0, n);
+}
+
+// Items per chunk and round of a parallel scan
+inline int vec_scan_block_size()
+{
+    return 1 << 15;
+}
+
+// Scan `n` items of `in` into `out`. An inclusive scan ignores `init`.
+//   Under vec_exec::par the items go in rounds of one block per chunk:
+//   the chunks first fold their blocks, the totals are scanned serially,
+//   and the chunks then scan their blocks again starting from those. A
+//   block is still in cache the second time, so the items are read from
+//   memory once. Floating point results may differ in the last bits
+//   from a serial loop, as for sum()
+template <bool Excl, typename T, typename Op>
+void vec_scan(T* out, const T* in, int n, const Op& op, T init,
+    vec_exec policy)
+{
+    if (n == 0)
+        return;
+
+    T carry = init;
+    if (!Excl) {
+        carry = out[0] = in[0];
+        in++;
+        out++;
+        n--;
+    }
+
+    const int chunks = vec_par_chunks(policy, n);
+    if (chunks <= 1) {
+        vec_scan_block<Excl>(out, in, n, op, carry);
+        return;
+    }
+
+    const int block = vec_scan_block_size();
+    std::vector<T> starts(chunks, carry);
+    for (int round = 0; round < n; round += block * chunks) {
+        const int len = n - round < block * chunks ? n - round : block * chunks;
+        const int parts = (len + block - 1) / block;
+        auto range = [&](int c, int& begin, int& end) {
+            begin = round + c * block;
+            end = begin + block < round + len ? begin + block : round + len;
+        };
+
+        vec_parallel_for(parts, [&](int c) {
+            int begin, end;
+            range(c, begin, end);
+            starts[c] = vec_scan_total(in + begin, end - begin, op);
+        });
+        for (int c = 0; c < parts; c++) {
+            const T total = starts[c];
+            starts[c] = carry;
+            carry = static_cast<T>(op(carry, total));
+        }
+        vec_parallel_for(parts, [&](int c) {
+            int begin, end;
+            range(c, begin, end);
+            vec_scan_block<Excl>(out + begin, in + begin, end - begin, op,
+                starts[c]);
+        });
+    }
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::cumsum() const
+{
+    return cumsum(vec_exec_default());
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::cumsum(vec_exec policy) const
+{
+    return scan(policy, vec_op_add());
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::cumprod() const
+{
+    return cumprod(vec_exec_default());
+}
+
+template <typename T, typename A>
+vec<T, A> vec<T, A>::cumprod(vec_exec policy) const
+{
+    return scan(policy, vec_op_mul());
+}
+
+template <typename T, typename A>
+template <typename Op>
+vec<T, A> vec<T, A>::scan(Op op) const
+{
+    return scan(vec_exec_default(), op);
+}
+
+// Under vec_exec::par `op` is called from several threads at once
+template <typename T, typename A>
+template <typename Op>
+vec<T, A> vec<T, A>::scan(vec_exec policy, Op op) const
+{
+    vec<T, A> out(size_);
+    vec_scan<false>(out.arr_, arr_, size_, op, T(), policy);
+    out.size_ = size_;
+    return out;
+}
+
+template <typename T, typename A>
+template <typename Op>
+vec<T, A> vec<T, A>::exclusive_scan(T init, Op op) const
+{
+    return exclusive_scan(vec_exec_default(), init, op);
+}
+
+template <typename T, typename A>
+template <typename Op>
+vec<T, A> vec<T, A>::exclusive_scan(vec_exec policy, T init, Op op) const
+{
+    vec<T, A> out(size_);
+    vec_scan<true>(out.arr_, arr_, size_, op, init, policy);
+    out.size_ = size_;
+    return out;
+}
+
+
 
 
 
+////////////////
+// Statistics //
+////////////////
+
+// Count, mean and sums of the squared and cubed deviations from the mean
+//   of some items, plus their range. Blocks of items are summed twice
+//   while in cache (the mean first, then the deviations from it), and
+//   blocks and chunks are merged with the pairwise formulas of Chan et al.
+//   Unlike the textbook sum of squares this loses no precision when the
+//   mean is large against the spread
+struct vec_moments {
+    double n, mean, m2, m3, min, max;
+
+    vec_moments() : n(0), mean(0), m2(0), m3(0),
+        min(INFINITY), max(-INFINITY) {}
+
+    // Four partial sums each, so that consecutive items do not wait on
+    //   each other
+    void add(const double* x, int len)
+    {
+        double s[4] = {0, 0, 0, 0}, lo = min, hi = max;
+        for (int i = 0; i < len; i++) {
+            s[i & 3] += x[i];
+            lo = x[i] < lo ? x[i] : lo;
+            hi = x[i] > hi ? x[i] : hi;
+        }
+
+        vec_moments b;
+        b.n = len;
+        b.mean = (s[0] + s[1] + s[2] + s[3]) / len;
+        double d2[4] = {0, 0, 0, 0}, d3[4] = {0, 0, 0, 0};
+        for (int i = 0; i < len; i++) {
+            const double d = x[i] - b.mean;
+            d2[i & 3] += d * d;
+            d3[i & 3] += d * d * d;
+        }
+        b.m2 = d2[0] + d2[1] + d2[2] + d2[3];
+        b.m3 = d3[0] + d3[1] + d3[2] + d3[3];
+        b.min = lo;
+        b.max = hi;
+        merge(b);
+    }
+
+    void merge(const vec_moments& b)
+    {
+        if (b.n == 0)
+            return;
+        if (n == 0) {
+            *this = b;
+            return;
+        }
+
+        const double total = n + b.n;
+        const double d = b.mean - mean;
+        const double f = n * b.n / total;
+        m3 += b.m3 + d * d * d * f * (n - b.n) / total
+            + 3 * d * (n * b.m2 - b.n * m2) / total;
+        m2 += b.m2 + d * d * f;
+        mean += d * b.n / total;
+        n = total;
+        min = b.min < min ? b.min : min;
+        max = b.max > max ? b.max : max;
+    }
+};
+
+// Moments of all of `e`, in parallel chunks under vec_exec::par
+template <typename E>
+vec_moments vec_moments_of(const E& e, vec_exec policy, const char* name)
+{
+    const int size = e.size();
+    if (size == 0)
+        throw std::out_of_range(std::string(name) + ": empty vector");
+
+    VEC_PROFILE_OP(name, size);
+    const int chunks = vec_par_chunks(policy, size);
+    std::vector<vec_moments> parts(chunks);
+    vec_parallel_for(chunks, [&](int c) {
+        const int block = 1024;
+        double x[block];
+        const int end = vec_chunk_begin(size, chunks, c+1);
+        for (int b = vec_chunk_begin(size, chunks, c); b < end; b += block) {
+            const int len = end - b < block ? end - b : block;
+            for (int i = 0; i < len; i++)
+                x[i] = static_cast<double>(e.eval(b + i));
+            parts[c].add(x, len);
+        }
+    });
+
+    for (int c = 1; c < chunks; c++)
+        parts[0].merge(parts[c]);
+    return parts[0];
+}
+
+// Quantiles `qs` (ascending, within [0, 1]) of the `n` items of `a`,
+//   interpolated between the two nearest ranks like numpy does. Each rank
+//   is found by nth_element() in the part of `a` not yet known to lie
+//   below it, so the whole set takes O(n) on average. `a` is reordered
+template <typename T>
+void vec_select_quantiles(T* a, int n, const double* qs, int count,
+    double* out)
+{
+    for (int j = 0; j < count; j++)
+        if (!(qs[j] >= 0 && qs[j] <= 1))
+            throw std::invalid_argument("quantile: not within [0, 1]");
+
+    // NaN has no rank
+    for (int i = 0; i < n; i++)
+        if (a[i] != a[i]) {
+            for (int j = 0; j < count; j++)
+                out[j] = NAN;
+            return;
+        }
+
+    int lo = 0;
+    for (int j = 0; j < count; j++) {
+        const double h = (n - 1) * qs[j];
+        const int k = static_cast<int>(h);
+        std::nth_element(a + lo, a + k, a + n);
+        double x = static_cast<double>(a[k]);
+        if (h > k)
+            x += (h - k) * (static_cast<double>(*std::min_element(a + k + 1,
+                a + n)) - x);
+        out[j] = x;
+        lo = k;
+    }
+}
+
+// Hash of the bits of an item
+template <typename T>
+uint64_t vec_hash_bits(const T& x)
+{
+    uint64_t bits = 0;
+    std::memcpy(&bits, &x, sizeof(T) < 8 ? sizeof(T) : 8);
+    return bits * 0x9E3779B97F4A7C15ull;
+}
+
+// Hash of an item for vec_mode(). -0.0 == 0.0, so both hash like 0
+template <typename T>
+uint64_t vec_mode_hash(T x)
+{
+    return vec_hash_bits(x == 0 ? T(0) : x);
+}
 
+// An item with its count and first position
+template <typename T>
+struct vec_mode_slot {
+    T item;
+    int count;
+    int first;
 
-////////////////////////////////
-// Vectorized Function Macros //
-////////////////////////////////
+    // Is this a better mode than `b`?
+    bool beats(const vec_mode_slot& b) const
+    {
+        return count > b.count || (count == b.count && first < b.first);
+    }
+};
 
-// Vectorized functions
-// fn(op) = {fn(op0), fn(op1), ...}
-// sin, abs, sqrt, etc...
-#define VECTORIZE_FN(FN) template <typename T>  \
-vec<T> FN(const vec<T>& v)                      \
-{                                               \
-    vec<T> w(v.size_);                          \
-    w.size_ = v.size_;                          \
-    for (int i = 0; i < v.size_; i++){          \
-        w.arr_[i] = FN(v.arr_[i]);              \
-    }                                           \
-    return w;                                   \
+// Slot of `x` in an open addressing `table` indexed by `bits` bits of the
+//   hash below the top `skip` ones, or the empty slot for it
+template <typename T>
+size_t vec_mode_find(const std::vector<vec_mode_slot<T>>& table, int skip,
+    int bits, T x)
+{
+    const size_t mask = table.size() - 1;
+    size_t h = (vec_mode_hash(x) << skip) >> (64 - bits);
+    while (table[h].count && !(table[h].item == x))
+        h = (h + 1) & mask;
+    return h;
 }
 
-#define VECTORIZE_FN_PROTO(FN) template <typename Y>\
-friend vec<Y> FN(const vec<Y>& v);
-
+// Count the `n` items of `a`, found at positions `pos` of the input (0..n-1
+//   when null), in `table` and update `best`. The table doubles whenever
+//   it gets half full; it is left empty for the next call. Gives up, false,
+//   once it would need more than 2^`max_bits` slots. NaNs are skipped
+template <typename T>
+bool vec_mode_count(const T* a, const int* pos, int n, int skip,
+    int max_bits, std::vector<vec_mode_slot<T>>& table, vec_mode_slot<T>& best)
+{
+    const vec_mode_slot<T> empty = {T(), 0, 0};
+    int bits = 0;
+    while ((size_t(1) << bits) < table.size())
+        bits++;
+    size_t used = 0;
+
+    for (int i = 0; i < n; i++) {
+        const T x = a[i];
+        if (x != x)
+            continue;
+        size_t h = vec_mode_find(table, skip, bits, x);
+        if (table[h].count == 0) {
+            if (2 * (used + 1) > table.size()) {
+                if (bits == max_bits)
+                    return false;
+                std::vector<vec_mode_slot<T>> old(size_t(1) << ++bits, empty);
+                old.swap(table);
+                for (size_t j = 0; j < old.size(); j++)
+                    if (old[j].count)
+                        table[vec_mode_find(table, skip, bits,
+                            old[j].item)] = old[j];
+                h = vec_mode_find(table, skip, bits, x);
+            }
+            table[h].item = x;
+            table[h].first = pos ? pos[i] : i;
+            used++;
+        }
+        table[h].count++;
+    }
 
+    for (size_t h = 0; h < table.size(); h++)
+        if (table[h].count) {
+            if (table[h].beats(best))
+                best = table[h];
+            table[h] = empty;
+        }
+    return true;
+}
 
+// The most frequent of the `n` items of `a`, the one seen first among
+//   equally frequent items, by hashing. Each slot of the table holds the
+//   item with its count and first position, so a lookup touches a single
+//   slot. When too many items are different for a table that fits in
+//   cache, the items are split by the top bits of their hash into parts of
+//   about 8K instead (keeping their order and positions), and each part
+//   is counted on its own. NaNs are skipped, false if nothing else is left
+template <typename T>
+bool vec_mode(const T* a, int n, T& out)
+{
+    static_assert(std::is_arithmetic<T>::value, "mode: items must be numbers");
+
+    const vec_mode_slot<T> empty = {T(), 0, 0};
+    std::vector<vec_mode_slot<T>> table(16, empty);
+    vec_mode_slot<T> best = empty;
+    if (!vec_mode_count<T>(a, nullptr, n, 0, 16, table, best)) {
+        int skip = 1;
+        while (skip < 20 && (n >> skip) > 8192)
+            skip++;
+        const int parts = 1 << skip;
+
+        std::vector<int> offsets(parts + 1, 0);
+        for (int i = 0; i < n; i++)
+            if (a[i] == a[i])
+                offsets[(vec_mode_hash(a[i]) >> (64 - skip)) + 1]++;
+        for (int p = 0; p < parts; p++)
+            offsets[p+1] += offsets[p];
+
+        std::vector<T> items(offsets[parts]);
+        std::vector<int> pos(offsets[parts]);
+        std::vector<int> next(offsets.begin(), offsets.end() - 1);
+        for (int i = 0; i < n; i++)
+            if (a[i] == a[i]) {
+                const int at = next[vec_mode_hash(a[i]) >> (64 - skip)]++;
+                items[at] = a[i];
+                pos[at] = i;
+            }
+
+        // One table for all parts, large enough for most of them
+        table.assign(size_t(1) << 15, empty);
+        best = empty;
+        for (int p = 0; p < parts; p++)
+            vec_mode_count(items.data() + offsets[p], pos.data() + offsets[p],
+                offsets[p+1] - offsets[p], skip, 62, table, best);
+    }
 
+    if (best.count == 0)
+        return false;
+    out = best.item;
+    return true;
+}
 
-////////////////////////////
-// Binary Operator Macros //
-////////////////////////////
+// Everything describe() finds. var and stddev are the population ones
+//   (divided by count); multiply var by count / (count - 1) for the sample
+//   variance
+struct vec_stats {
+    int count;
+    double mean, var, stddev, skew;
+    double min, q25, median, q75, max;
+    double mode;
+};
 
-// A binary operator taking an atom on the left
-//   and a `vec` on the right
-#define BOP_ATM_VEC(OP) template <typename T, typename Q>   \
-vec<T> operator OP(Q n, const vec<T>& v) {                  \
-    const int size = v.size();                              \
-    vec<T> out = vec<T>(size); /* Allocate vector `out` */  \
-    out.size_ = size;                                       \
-    for (int i = 0; i < size; i++) {                        \
-        out[i] = n OP v[i];                                 \
-    }                                                       \
-    return out;                                             \
+template <typename E>
+double mean(vec_exec policy, const vec_expr<E>& v)
+{
+    return vec_moments_of(v.self(), policy, "mean").mean;
 }
 
-// A binary operator taking a `vec` on the left
-//   and an atom on the right
-#define BOP_VEC_ATM(OP) template <typename T, typename Q>   \
-vec<T> operator OP(const vec<T>& v, Q n) {                  \
-    const int size = v.size();                              \
-    vec<T> out(size); /* Allocate a new vector `out` */     \
-    out.size_ = size;                                       \
-    for (int i = 0; i < size; i++) {                        \
-        out[i] = v[i] OP n;                                 \
-    }                                                       \
-    return out;                                             \
+template <typename E>
+double mean(const vec_expr<E>& v)
+{
+    return mean(vec_exec_default(), v);
 }
 
-// A binary operator taking a `vec` on both the right
-//   hand side and the left hand side. Vecs have different types
-#define BOP_VECT_VEC(OP) template <typename T, typename Q>  \
-vec<T> operator OP(const vec<T>& v1, const vec<Q>& v2) {    \
-    if (v1.size() != v2.size()) {                           \
-        throw std::out_of_range("length error");            \
-    }                                                       \
-    const int size = v1.size();                             \
-    vec<T> out(size);                                       \
-    out.size_ = size;                                       \
-    for (int i = 0; i < size; i++) {                        \
-        out[i] = v1[i] OP v2[i];                            \
-    }                                                       \
-    return out;                                             \
+template <typename E>
+double var(vec_exec policy, const vec_expr<E>& v)
+{
+    const vec_moments m = vec_moments_of(v.self(), policy, "var");
+    return m.m2 / m.n;
 }
 
+template <typename E>
+double var(const vec_expr<E>& v)
+{
+    return var(vec_exec_default(), v);
+}
 
+template <typename E>
+double stddev(vec_exec policy, const vec_expr<E>& v)
+{
+    return std::sqrt(var(policy, v));
+}
 
-// Implement all three cases for binary operators
-#define IMPL_BOP( OP ) BOP_VECT_VEC( OP )   \
-BOP_ATM_VEC( OP )                           \
-BOP_VEC_ATM( OP )
+template <typename E>
+double stddev(const vec_expr<E>& v)
+{
+    return stddev(vec_exec_default(), v);
+}
 
+// Skewness m3 / m2^1.5, 0 when all items are equal
+template <typename E>
+double skew(vec_exec policy, const vec_expr<E>& v)
+{
+    const vec_moments m = vec_moments_of(v.self(), policy, "skew");
+    return m.m2 > 0 ? std::sqrt(m.n) * m.m3 / (m.m2 * std::sqrt(m.m2)) : 0;
+}
 
-// Define prototype functions for binary operators
-#define PROTO_BOP(OP) template <typename Y, typename Q>         \
-friend vec<Y> operator OP(const vec<Y>& v, Q n);                \
-template <typename Y, typename Q>                               \
-friend vec<Y> operator OP(Q n, const vec<Y>& v);                \
-template <typename Y, typename Q>                               \
-friend vec<Y> operator OP(const vec<Y>& v1, const vec<Q>& v2);
+template <typename E>
+double skew(const vec_expr<E>& v)
+{
+    return skew(vec_exec_default(), v);
+}
 
+// `q` within [0, 1], e.g. 0.5 for the median. Selects in a copy of the
+//   items instead of sorting them
+template <typename E>
+double quantile(const vec_expr<E>& v, double q)
+{
+    vec<typename E::value_type> items(v.self());
+    if (items.size() == 0)
+        throw std::out_of_range("quantile: empty vector");
 
+    double out;
+    vec_select_quantiles(items.data(), items.size(), &q, 1, &out);
+    return out;
+}
 
-////////////////////////////////
-// Comparison Operator Macros //
-////////////////////////////////
+template <typename E>
+double median(const vec_expr<E>& v)
+{
+    return quantile(v, 0.5);
+}
 
-// A binary operator taking an atom on the left
-//   and a `vec` on the right
-#define COMP_ATM_VEC(OP) template <typename T, typename Q>  \
-vec<bool> operator OP(Q n, const vec<T>& v) {               \
-    const int size = v.size();                              \
-    vec<bool> out(size); /* Allocate vector `out` */        \
-    out.size_ = size;                                       \
-    for (int i = 0; i < size; i++) {                        \
-        out[i] = n OP v[i];                                 \
-    }                                                       \
-    return out;                                             \
+template <typename T, typename A>
+T mode(const vec<T, A>& v)
+{
+    T out;
+    if (v.size() == 0 || !vec_mode(v.data(), v.size(), out))
+        throw std::out_of_range("mode: empty vector");
+    return out;
 }
 
-// A binary operator taking a `vec` on the left
-//   and an atom on the right
-#define COMP_VEC_ATM(OP) template <typename T, typename Q>  \
-vec<bool> operator OP(const vec<T>& v, Q n) {               \
-    const int size = v.size();                              \
-    vec<bool> out(size); /* Allocate a new vector `out` */  \
-    out.size_ = size;                                       \
-    for (int i = 0; i < size; i++) {                        \
-        out[i] = v[i] OP n;                                 \
-    }                                                       \
-    return out;                                             \
+template <typename E>
+typename E::value_type mode(const vec_expr<E>& v)
+{
+    const vec<typename E::value_type> items(v.self());
+    return mode(items);
 }
 
-// A binary operator taking a `vec` on both the right
-//   hand side and the left hand side. Vecs have different types
-#define COMP_VECT_VEC(OP) template <typename T, typename Q> \
-vec<bool> operator OP(const vec<T>& v1, const vec<Q>& v2) { \
-    if (v1.size() != v2.size()) {                           \
-        throw std::out_of_range("length error");            \
-    }                                                       \
-    const int size = v1.size();                             \
-    vec<bool> out(size);                                    \
-    out.size_ = size;                                       \
-    for (int i = 0; i < size; i++) {                        \
-        out[i] = v1[i] OP v2[i];                            \
-    }                                                       \
-    return out;                                             \
+// The items are copied once, then the moments are taken from the copy,
+//   the quartiles selected in it and the mode found by hashing it
+template <typename E>
+vec_stats describe(vec_exec policy, const vec_expr<E>& v)
+{
+    typedef typename E::value_type T;
+    vec<T> items(policy, v.self());
+    const vec_moments m = vec_moments_of(items, policy, "describe");
+
+    vec_stats s;
+    s.count = items.size();
+    s.mean = m.mean;
+    s.var = m.m2 / m.n;
+    s.stddev = std::sqrt(s.var);
+    s.skew = m.m2 > 0 ? std::sqrt(m.n) * m.m3 / (m.m2 * std::sqrt(m.m2)) : 0;
+    s.min = m.min;
+    s.max = m.max;
+    T mode;
+    s.mode = vec_mode(items.data(), items.size(), mode)
+        ? static_cast<double>(mode) : NAN;
+
+    const double qs[] = {0.25, 0.5, 0.75};
+    double out[3];
+    vec_select_quantiles(items.data(), items.size(), qs, 3, out);
+    s.q25 = out[0];
+    s.median = out[1];
+    s.q75 = out[2];
+    return s;
 }
 
+template <typename E>
+vec_stats describe(const vec_expr<E>& v)
+{
+    return describe(vec_exec_default(), v);
+}
 
+// Count, means and sums of squared deviations of paired items, plus the
+//   sum of the products of their deviations, taken in the same blocks and
+//   merged the same way as vec_moments. Both passes over a block run in
+//   the SIMD comoments() kernel when there is one
+struct vec_comoments {
+    double n, mx, my, m2x, m2y, cxy;
 
-// Implement all three cases for binary operators
-#define IMPL_COMP(OP) COMP_VECT_VEC( OP )   \
-COMP_ATM_VEC( OP )                          \
-COMP_VEC_ATM( OP )
+    vec_comoments() : n(0), mx(0), my(0), m2x(0), m2y(0), cxy(0) {}
 
+    void add(const double* x, const double* y, int len)
+    {
+        double s[5];
+        if (!vec_simd_blas<double>([&](auto k) {
+                decltype(k)::comoments(x, y, len, s);
+            })) {
+            double sx[4] = {0, 0, 0, 0}, sy[4] = {0, 0, 0, 0};
+            for (int i = 0; i < len; i++) {
+                sx[i & 3] += x[i];
+                sy[i & 3] += y[i];
+            }
+            s[0] = (sx[0] + sx[1] + sx[2] + sx[3]) / len;
+            s[1] = (sy[0] + sy[1] + sy[2] + sy[3]) / len;
+            double dxx[4] = {0, 0, 0, 0}, dyy[4] = {0, 0, 0, 0};
+            double dxy[4] = {0, 0, 0, 0};
+            for (int i = 0; i < len; i++) {
+                const double dx = x[i] - s[0];
+                const double dy = y[i] - s[1];
+                dxx[i & 3] += dx * dx;
+                dyy[i & 3] += dy * dy;
+                dxy[i & 3] += dx * dy;
+            }
+            s[2] = dxx[0] + dxx[1] + dxx[2] + dxx[3];
+            s[3] = dyy[0] + dyy[1] + dyy[2] + dyy[3];
+            s[4] = dxy[0] + dxy[1] + dxy[2] + dxy[3];
+        }
 
-// Define prototype functions for binary operators
-#define PROTO_COMP(OP) template <typename Y, typename Q>            \
-friend vec<bool> operator OP(const vec<Y>& v, Q n);                 \
-template <typename Y, typename Q>                                   \
-friend vec<bool> operator OP(Q n, const vec<Y>& v);                 \
-template <typename Y, typename Q>                                   \
-friend vec<bool> operator OP(const vec<Y>& v1, const vec<Q>& v2);
+        vec_comoments b;
+        b.n = len;
+        b.mx = s[0];
+        b.my = s[1];
+        b.m2x = s[2];
+        b.m2y = s[3];
+        b.cxy = s[4];
+        merge(b);
+    }
 
+    void merge(const vec_comoments& b)
+    {
+        if (b.n == 0)
+            return;
+        if (n == 0) {
+            *this = b;
+            return;
+        }
 
+        const double total = n + b.n;
+        const double dx = b.mx - mx;
+        const double dy = b.my - my;
+        const double f = n * b.n / total;
+        m2x += b.m2x + dx * dx * f;
+        m2y += b.m2y + dy * dy * f;
+        cxy += b.cxy + dx * dy * f;
+        mx += dx * b.n / total;
+        my += dy * b.n / total;
+        n = total;
+    }
+};
 
+// Co-moments of all of `x` and `y`, in parallel chunks under vec_exec::par
+template <typename L, typename R>
+vec_comoments vec_comoments_of(const L& x, const R& y, vec_exec policy,
+    const char* name)
+{
+    const int size = x.size();
+    if (y.size() != size)
+        throw std::out_of_range(std::string(name) + ": length error");
+    if (size == 0)
+        throw std::out_of_range(std::string(name) + ": empty vector");
+
+    VEC_PROFILE_OP(name, size);
+    const int chunks = vec_par_chunks(policy, size);
+    std::vector<vec_comoments> parts(chunks);
+    vec_parallel_for(chunks, [&](int c) {
+        const int block = 1024;
+        double bx[block], by[block];
+        const int end = vec_chunk_begin(size, chunks, c+1);
+        for (int b = vec_chunk_begin(size, chunks, c); b < end; b += block) {
+            const int len = end - b < block ? end - b : block;
+            // Doubles in a vec or contiguous view are read in place
+            const double* px = vec_blas_leaf<double>(x, b);
+            const double* py = vec_blas_leaf<double>(y, b);
+            for (int i = 0; !px && i < len; i++)
+                bx[i] = static_cast<double>(x.eval(b + i));
+            for (int i = 0; !py && i < len; i++)
+                by[i] = static_cast<double>(y.eval(b + i));
+            parts[c].add(px ? px : bx, py ? py : by, len);
+        }
+    });
 
+    for (int c = 1; c < chunks; c++)
+        parts[0].merge(parts[c]);
+    return parts[0];
+}
 
-/////////////////////
-// The `vec` Class //
-/////////////////////
+// Least squares line y = slope * x + intercept and its coefficient of
+//   determination. All three are NaN when every x is the same, and r2 is
+//   also NaN when every y is
+struct vec_fit {
+    double slope, intercept, r2;
+};
 
+// Population covariance, divided by the count like var()
+template <typename L, typename R>
+double cov(vec_exec policy, const vec_expr<L>& x, const vec_expr<R>& y)
+{
+    const vec_comoments m = vec_comoments_of(x.self(), y.self(), policy, "cov");
+    return m.cxy / m.n;
+}
 
-template <typename T>
-class vec {
-public:
-    // Constructor / Destructors
-    vec();                              // Default Constructor
-    vec(int size);                      // Preallocated memory constructor
-    vec(std::initializer_list<T> lst);  // initializer_list constructor
-    vec(const vec& other);              // Copy constructor
-    vec(vec<T>&& v);                    // Move constructor
-    ~vec() {if (allocsize_ > 0) delete[] arr_;};            // Destructor
-    vec& operator=(const vec& v);
+template <typename L, typename R>
+double cov(const vec_expr<L>& x, const vec_expr<R>& y)
+{
+    return cov(vec_exec_default(), x, y);
+}
 
-    // Utils / Access
-    int size() const {return size_;};
-    T& operator[](int i);
-    const T& operator[](int i) const;
+// Pearson correlation, NaN when x or y are all the same
+template <typename L, typename R>
+double corr(vec_exec policy, const vec_expr<L>& x, const vec_expr<R>& y)
+{
+    const vec_comoments m = vec_comoments_of(x.self(), y.self(), policy,
+        "corr");
+    return m.cxy / std::sqrt(m.m2x * m.m2y);
+}
 
+template <typename L, typename R>
+double corr(const vec_expr<L>& x, const vec_expr<R>& y)
+{
+    return corr(vec_exec_default(), x, y);
+}
 
-    // Resource Mgmt.
-    void realloc(int s);
-    void resize(int size, T dflt);
-    void resize(int size);
-    void clear();
+template <typename L, typename R>
+vec_fit regression(vec_exec policy, const vec_expr<L>& x,
+    const vec_expr<R>& y)
+{
+    const vec_comoments m = vec_comoments_of(x.self(), y.self(), policy,
+        "regression");
+    vec_fit fit;
+    if (m.m2x == 0) {
+        fit.slope = fit.intercept = fit.r2 = NAN;
+        return fit;
+    }
+    fit.slope = m.cxy / m.m2x;
+    fit.intercept = m.my - fit.slope * m.mx;
+    fit.r2 = m.cxy / m.m2x * m.cxy / m.m2y;
+    return fit;
+}
 
-    // Aggregate Operations
-    template <typename Y>
-    friend Y sum(const vec<Y>& v);
-
-    template <typename Y>
-    friend Y prod(const vec<Y>& v);
-    //vec cumsum() const;
-    //vec cummprod() const;
-    //double mean() const;
-    //int median() const;
-    //int mode() const;
-    template <typename Y>
-    friend Y max(const vec<Y>& v);
-
-    template <typename Y>
-    friend Y min(const vec<Y>& v);
-
-    // Output
-    template <typename Y>
-    friend std::ostream& operator<<(std::ostream&, const vec<Y>&);
+template <typename L, typename R>
+vec_fit regression(const vec_expr<L>& x, const vec_expr<R>& y)
+{
+    return regression(vec_exec_default(), x, y);
+}
 
-    std::string str() const;
 
-    // Modification
-    void append(T x);
-    void append(const vec<T>& v);
-    void swap(int i, int j);
-    void reverse();
 
-    // Sublists
-    T head() const;
-    vec<T> head(int items) const;
-    vec<T> head(int items, T overtake) const;
-    T tail() const;
-    vec<T> tail(int items) const;
-    vec<T> tail(int items, T overtake) const;
 
-    void pop();
-    void pop(int n);
 
-    vec<T> take(vec<bool> filter) const;
+/////////////
+// Sorting //
+/////////////
 
-    // Functional
-    vec<T> apply(auto fn);
-    vec<T> apply_to(vec<bool> filter, auto fn);
+// Numbers are sorted by an LSD radix sort, one byte of their keys per
+//   pass: a pass counts the bytes, then moves each item to the next free
+//   slot for its byte, so equal keys keep their order and the sort takes
+//   O(n) for any input. The counts of every byte are taken in a single
+//   read before the first pass, and passes where all keys share the byte
+//   are skipped (small integers need one or two). Under vec_exec::par each
+//   chunk counts its own items and moves them into its own part of every
+//   slot, which keeps the sort stable.
+//
+// Other types are sorted by std::sort, or std::stable_sort for
+//   vec_sort::stable. Under vec_exec::par the chunks are sorted on the
+//   pool and then merged pairwise, also on the pool.
 
-    //Generators
-    static vec<T> range(T i);
-    static vec<T> range(T a, T b);
-    static vec<T> range(T a, T b, T inc);
-
-    // Statistics
-    //double regression(const vec& a, const vec& b);
-
-
-
-    // Operators
-    PROTO_BOP(+)
-    PROTO_BOP(-)
-    PROTO_BOP(*)
-    PROTO_BOP(/)
-    PROTO_BOP(%)
-    PROTO_BOP(&&)
-    PROTO_BOP(||)
-    PROTO_BOP(&)
-    PROTO_BOP(|)
-
-    // Comparison
-    PROTO_COMP(>)
-    PROTO_COMP(<)
-    PROTO_COMP(<=)
-    PROTO_COMP(>=)
-    PROTO_COMP(==)
-    PROTO_COMP(!=)
-
-    friend vec<bool> operator!(const vec<bool>& v);
-
-
-
-    // Math
-    //sin, cos, etc...
-    //static int dot_prod(const vec &v1, const vec &v2) const;
-    VECTORIZE_FN_PROTO(sin);
-    VECTORIZE_FN_PROTO(cos);
-    VECTORIZE_FN_PROTO(tan);
-    VECTORIZE_FN_PROTO(acos);
-    VECTORIZE_FN_PROTO(asin);
-    VECTORIZE_FN_PROTO(atan);
-    VECTORIZE_FN_PROTO(atan2);
-    VECTORIZE_FN_PROTO(cosh);
-    VECTORIZE_FN_PROTO(sinh);
-    VECTORIZE_FN_PROTO(tanh);
-    VECTORIZE_FN_PROTO(acosh);
-    VECTORIZE_FN_PROTO(asinh);
-    VECTORIZE_FN_PROTO(atanh);
-    VECTORIZE_FN_PROTO(exp);
-    VECTORIZE_FN_PROTO(log);
-    VECTORIZE_FN_PROTO(log10);
-    VECTORIZE_FN_PROTO(log2);
-    VECTORIZE_FN_PROTO(sqrt);
-    VECTORIZE_FN_PROTO(cbrt);
-    VECTORIZE_FN_PROTO(ceil);
-    VECTORIZE_FN_PROTO(floor);
-    VECTORIZE_FN_PROTO(abs);
-
-    vec<T> power(T i);
+// Unsigned keys ordered like the numbers. Negative floats have all their
+//   bits flipped and positive ones the sign bit, which puts NaNs with the
+//   sign bit set first and other NaNs last
+template <typename T, typename = void>
+struct vec_radix_key {enum {value = false};};
 
+template <typename T>
+struct vec_radix_key<T, typename std::enable_if<std::is_integral<T>::value
+    && !std::is_same<T, bool>::value>::type> {
+    enum {value = true};
+    typedef typename std::make_unsigned<T>::type bits;
+    static bits get(T x)
+    {
+        const bits sign = std::is_signed<T>::value
+            ? bits(bits(1) << (8 * sizeof(T) - 1)) : bits(0);
+        return static_cast<bits>(static_cast<bits>(x) ^ sign);
+    }
+};
 
-private:
-    T* arr_;
-    int size_;
-    int allocsize_;
+template <typename T>
+struct vec_radix_key<T, typename std::enable_if<std::is_same<T, float>::value
+    || std::is_same<T, double>::value>::type> {
+    enum {value = true};
+    typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type
+        bits;
+    static bits get(T x)
+    {
+        bits b;
+        std::memcpy(&b, &x, sizeof(T));
+        const bits sign = bits(1) << (8 * sizeof(T) - 1);
+        return b & sign ? ~b : b | sign;
+    }
 };
 
+// Sort the `n` items of `a` by their keys, moving `idx` (unless null) with
+//   them
+template <typename T>
+void vec_radix_sort(T* a, int* idx, int n, vec_exec policy)
+{
+    typedef vec_radix_key<T> K;
+    const int digits = sizeof(T);
+
+    // Few items are not worth the counting
+    if (n < 256) {
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](int i, int j) {
+            return K::get(a[i]) < K::get(a[j]);
+        });
+        std::vector<T> items(a, a + n);
+        std::vector<int> pos;
+        if (idx)
+            pos.assign(idx, idx + n);
+        for (int i = 0; i < n; i++) {
+            a[i] = items[order[i]];
+            if (idx)
+                idx[i] = pos[order[i]];
+        }
+        return;
+    }
 
+    // counts[c][d][b]: items of chunk `c` with byte `b` at digit `d`
+    const int chunks = vec_par_chunks(policy, n);
+    std::vector<int> counts(size_t(chunks) * digits * 256, 0);
+    vec_parallel_for(chunks, [&](int c) {
+        int* cnt = &counts[size_t(c) * digits * 256];
+        const int end = vec_chunk_begin(n, chunks, c+1);
+        for (int i = vec_chunk_begin(n, chunks, c); i < end; i++) {
+            const typename K::bits k = K::get(a[i]);
+            for (int d = 0; d < digits; d++)
+                cnt[d * 256 + ((k >> (8 * d)) & 255)]++;
+        }
+    });
+
+    std::vector<T> tmp(n);
+    std::vector<int> tmpidx(idx ? n : 0);
+    T* src = a;
+    T* dst = tmp.data();
+    int* isrc = idx;
+    int* idst = tmpidx.data();
+    std::vector<int> offsets(size_t(chunks) * 256);
+    bool moved = false;
+
+    for (int d = 0; d < digits; d++) {
+        const int shift = 8 * d;
+        bool trivial = false;
+        for (int b = 0; b < 256 && !trivial; b++) {
+            int total = 0;
+            for (int c = 0; c < chunks; c++)
+                total += counts[(size_t(c) * digits + d) * 256 + b];
+            trivial = total == n;
+        }
+        if (trivial)
+            continue;
+
+        // The chunks hold other items once they have been moved
+        if (moved && chunks > 1)
+            vec_parallel_for(chunks, [&](int c) {
+                int* cnt = &counts[(size_t(c) * digits + d) * 256];
+                std::fill(cnt, cnt + 256, 0);
+                const int end = vec_chunk_begin(n, chunks, c+1);
+                for (int i = vec_chunk_begin(n, chunks, c); i < end; i++)
+                    cnt[(K::get(src[i]) >> shift) & 255]++;
+            });
+
+        int next = 0;
+        for (int b = 0; b < 256; b++)
+            for (int c = 0; c < chunks; c++) {
+                offsets[size_t(c) * 256 + b] = next;
+                next += counts[(size_t(c) * digits + d) * 256 + b];
+            }
+
+        vec_parallel_for(chunks, [&](int c) {
+            int* off = &offsets[size_t(c) * 256];
+            const int end = vec_chunk_begin(n, chunks, c+1);
+            for (int i = vec_chunk_begin(n, chunks, c); i < end; i++) {
+                const int at = off[(K::get(src[i]) >> shift) & 255]++;
+                dst[at] = src[i];
+                if (idx)
+                    idst[at] = isrc[i];
+            }
+        });
+        std::swap(src, dst);
+        std::swap(isrc, idst);
+        moved = true;
+    }
 
+    if (src != a)
+        vec_parallel_for(chunks, [&](int c) {
+            const int begin = vec_chunk_begin(n, chunks, c);
+            const int len = vec_chunk_begin(n, chunks, c+1) - begin;
+            std::memcpy(a + begin, src + begin, len * sizeof(T));
+            if (idx)
+                std::memcpy(idx + begin, isrc + begin, len * sizeof(int));
+        });
+}
 
+// Sort `n` items with `less`, see above
+template <typename T, typename Less>
+void vec_merge_sort(T* a, int n, const Less& less, vec_sort kind,
+    vec_exec policy)
+{
+    const int chunks = vec_par_chunks(policy, n);
+    vec_parallel_for(chunks, [&](int c) {
+        T* begin = a + vec_chunk_begin(n, chunks, c);
+        T* end = a + vec_chunk_begin(n, chunks, c+1);
+        if (kind == vec_sort::stable)
+            std::stable_sort(begin, end, less);
+        else
+            std::sort(begin, end, less);
+    });
+    if (chunks <= 1)
+        return;
 
+    // Runs of `width` chunks are merged in pairs until one is left
+    std::vector<T> tmp(n);
+    T* src = a;
+    T* dst = tmp.data();
+    for (int width = 1; width < chunks; width *= 2) {
+        const int pairs = (chunks + 2 * width - 1) / (2 * width);
+        vec_parallel_for(pairs, [&](int p) {
+            const int c = 2 * width * p;
+            const int begin = vec_chunk_begin(n, chunks, c);
+            const int mid = vec_chunk_begin(n, chunks, std::min(c + width, chunks));
+            const int end = vec_chunk_begin(n, chunks,
+                std::min(c + 2 * width, chunks));
+            std::merge(std::make_move_iterator(src + begin),
+                std::make_move_iterator(src + mid),
+                std::make_move_iterator(src + mid),
+                std::make_move_iterator(src + end), dst + begin, less);
+        });
+        std::swap(src, dst);
+    }
 
+    if (src != a)
+        std::move(src, src + n, a);
+}
 
-//////////////////
-// Constructors //
-//////////////////
+template <typename T>
+void vec_sort_items(T* a, int n, vec_sort, vec_exec policy, std::true_type)
+{
+    vec_radix_sort(a, static_cast<int*>(nullptr), n, policy);
+}
 
-template<typename T>
-vec<T>::vec() : allocsize_{0}, size_{0}, arr_{new T[0]}
-{}
+template <typename T>
+void vec_sort_items(T* a, int n, vec_sort kind, vec_exec policy,
+    std::false_type)
+{
+    vec_merge_sort(a, n, std::less<T>(), kind, policy);
+}
 
+// Positions 0..n-1 of `a` into `idx`, in the order of their items
 template <typename T>
-vec<T>::vec(int size) : allocsize_(0), size_(0)
+void vec_argsort_items(const T* a, int n, int* idx, vec_sort, vec_exec policy,
+    std::true_type)
 {
-    realloc(size);
+    std::vector<T> keys(a, a + n);
+    vec_radix_sort(keys.data(), idx, n, policy);
 }
 
 template <typename T>
-vec<T>::vec(std::initializer_list<T> lst) : allocsize_(0), size_(0)
+void vec_argsort_items(const T* a, int n, int* idx, vec_sort kind,
+    vec_exec policy, std::false_type)
 {
-    realloc(lst.size());
-    std::copy(lst.begin(), lst.end(), arr_);
-    size_ = lst.size();
+    vec_merge_sort(idx, n, [a](int i, int j) {return a[i] < a[j];}, kind,
+        policy);
 }
 
+template <typename T, typename A>
+vec<T, A>& vec<T, A>::sort()
+{
+    return sort(vec_exec_default());
+}
 
-//Copy constructor
-template <typename T>
-vec<T>::vec(const vec<T>& other) :allocsize_(0), size_(0)
+template <typename T, typename A>
+vec<T, A>& vec<T, A>::sort(vec_exec policy, vec_sort kind)
 {
-    realloc(other.allocsize_);
-    size_ = other.size_;
+    vec_sort_items(arr_, size_, kind, policy,
+        std::integral_constant<bool, vec_radix_key<T>::value>());
+    return *this;
+}
+
+template <typename T, typename A>
+vec<int> vec<T, A>::argsort() const
+{
+    return argsort(vec_exec_default());
+}
 
+template <typename T, typename A>
+vec<int> vec<T, A>::argsort(vec_exec policy, vec_sort kind) const
+{
+    vec<int> idx(size_);
+    idx.resize(size_);
+    int* p = idx.data();
     for (int i = 0; i < size_; i++)
-        arr_[i] = other.arr_[i];
+        p[i] = i;
+    vec_argsort_items(arr_, size_, p, kind, policy,
+        std::integral_constant<bool, vec_radix_key<T>::value>());
+    return idx;
 }
 
-//Move Constructor
-template <typename T>
-vec<T>::vec(vec<T>&& v)
-    :allocsize_{v.allocsize_},  // Grab the elements from v
-    size_{v.size_},
-    arr_{v.arr_}
+template <typename T, typename A>
+template <typename K, typename KA>
+vec<T, A>& vec<T, A>::sort_by_key(const vec<K, KA>& keys)
 {
-    v.arr_ = nullptr;  // Now v has no elements
-    v.size_ = 0;
-    v.allocsize_ = 0;
+    return sort_by_key(vec_exec_default(), keys);
 }
 
-template <typename T>
-vec<T>& vec<T>::operator=(const vec<T>& v)
+template <typename T, typename A>
+template <typename K, typename KA>
+vec<T, A>& vec<T, A>::sort_by_key(vec_exec policy, const vec<K, KA>& keys,
+    vec_sort kind)
 {
-  T* p = new T[v.size()];
-  for (int i = 0; i < v.size(); i++)
-  {
-    p[i] = v.arr_[i];
-  }
-  delete arr_;
-  arr_ = p;
-  size_ = v.size_;
-  allocsize_ = v.allocsize_;
-  return *this;
+    if (keys.size() != size_)
+        throw std::out_of_range("sort_by_key: length error");
+
+    *this = gather(policy, keys.argsort(policy, kind));
+    return *this;
 }
 
+template <typename T, typename A>
+vec<T, A> vec<T, A>::gather(const vec<int>& positions) const
+{
+    return gather(vec_exec_default(), positions);
+}
 
+// Negative positions count from the end, as for operator[]
+template <typename T, typename A>
+vec<T, A> vec<T, A>::gather(vec_exec policy, const vec<int>& positions) const
+{
+    const int n = positions.size();
+    const int* pos = positions.data();
+    vec<T, A> out(n);
+    const int chunks = vec_par_chunks(policy, n);
+    std::vector<char> bad(chunks, 0);
+    vec_parallel_for(chunks, [&](int c) {
+        const int end = vec_chunk_begin(n, chunks, c+1);
+        for (int i = vec_chunk_begin(n, chunks, c); i < end; i++) {
+            int p = pos[i];
+            p = p < 0 ? p + size_ : p;
+            if (static_cast<unsigned>(p) >= static_cast<unsigned>(size_)) {
+                bad[c] = 1;
+                return;
+            }
+            out.arr_[i] = arr_[p];
+        }
+    });
+    for (int c = 0; c < chunks; c++)
+        if (bad[c])
+            throw std::out_of_range("gather: invalid position");
 
-/////////////////////////
-// Resource Management //
-/////////////////////////
+    out.size_ = n;
+    return out;
+}
 
 
-template <typename T>
-void vec<T>::realloc(int s) {
 
-    //No change in array size
-    if (s == allocsize_)
-        return;
 
-    T* newarr = new T[s];
 
-    //We are making the array smaller
-    if (s < allocsize_)
-    {
-        for (int i = 0; i < s; i++)
-            newarr[i] = arr_[i];
+///////////////
+// Pipelines //
+///////////////
 
-        size_ = s;
-    }
+// v.pipe().map(f).filter(p).reduce(op) and the like run all the steps in
+//   one loop over the source, without a vec in between. Each step gets an
+//   item and passes zero or one items on to the next one; the steps are
+//   nested functors, so the compiler sees a single loop body. A pipe holds
+//   its source like an expression does (leaf vecs by reference). Under
+//   vec_exec::par the source is split into chunks and the functions are
+//   called from several threads at once.
 
-    //We are making the array bigger
-    else
-    {
-        // Copy the existing elements
-        for (int i = 0; i < allocsize_; i++)
-            newarr[i] = arr_[i];
+// First step, passes the items of the source on
+struct vec_pipe_source {
+    template <typename In>
+    struct result {typedef In type;};
+
+    template <typename X, typename K>
+    void operator()(const X& x, const K& next) const {next(x);};
+};
 
-        // Leave newly allocated space uninitilized
+template <typename Prev, typename Fn>
+struct vec_pipe_map {
+    template <typename In>
+    struct result {
+        typedef typename std::decay<decltype(std::declval<const Fn&>()(
+            std::declval<typename Prev::template result<In>::type>()))>::type
+            type;
+    };
+
+    template <typename X, typename K>
+    void operator()(const X& x, const K& next) const
+    {
+        prev(x, [&](const auto& y) {next(fn(y));});
     }
 
-    //If there is data in the array, free the memory
-    if (allocsize_ > 0)
-        delete[] arr_;
+    Prev prev;
+    Fn fn;
+};
 
-    allocsize_ = s;
-    arr_ = newarr;
-}
+template <typename Prev, typename Pred>
+struct vec_pipe_filter {
+    template <typename In>
+    struct result {typedef typename Prev::template result<In>::type type;};
 
+    template <typename X, typename K>
+    void operator()(const X& x, const K& next) const
+    {
+        prev(x, [&](const auto& y) {if (pred(y)) next(y);});
+    }
 
+    Prev prev;
+    Pred pred;
+};
 
-template <typename T>
-void vec<T>::resize(int size, T dflt)
-{
-    // Same size, do nothing
-    if (size == size_)
-        return;
+template <typename E, typename Step>
+class vec_pipe {
+public:
+    typedef typename Step::template result<typename E::value_type>::type
+        value_type;
 
-    //Making it smaller
-    else if (size < size_)
-        realloc(size);
+    vec_pipe(const E& e, const Step& step, vec_exec policy)
+        : e_(e), step_(step), policy_(policy) {}
 
-    //Making it bigger
-    else
+    // Add a step
+    template <typename Fn>
+    vec_pipe<E, vec_pipe_map<Step, Fn>> map(Fn fn) const
     {
-        int oldsize = size_;
-        realloc(size);
-
-        for (int i = oldsize; i < size; i++)
-            arr_[i] = dflt;
-
-        size_ = size;
+        return vec_pipe<E, vec_pipe_map<Step, Fn>>(e_,
+            vec_pipe_map<Step, Fn>{step_, fn}, policy_);
     }
-}
-
-template <typename T>
-void vec<T>::resize(int size)
-{
-    realloc(size);
-    size_ = size;
-}
 
-template <typename T>
-void vec<T>::clear()
-{
-    realloc(0);
-}
+    template <typename Pred>
+    vec_pipe<E, vec_pipe_filter<Step, Pred>> filter(Pred pred) const
+    {
+        return vec_pipe<E, vec_pipe_filter<Step, Pred>>(e_,
+            vec_pipe_filter<Step, Pred>{step_, pred}, policy_);
+    }
 
+    // Run the pipe
+    template <typename Fn>
+    void for_each(Fn fn) const;
 
+    template <typename Acc, typename Op>
+    Acc reduce(Acc init, Op op) const;
+    template <typename Op>
+    value_type reduce(Op op) const;     // Throws if no item is left
 
+    value_type sum() const;
+    int count() const;
+    vec<value_type> collect() const;
 
-/////////////////////
-// Utils. / Access //
-/////////////////////
+private:
+    // Feed items `begin`..`end`-1 of the source through the steps
+    template <typename K>
+    void run(int begin, int end, const K& sink) const
+    {
+        for (int i = begin; i < end; i++)
+            step_(e_.eval(i), sink);
+    }
 
-template <typename T>
-T& vec<T>::operator[](int i)
-{
-    if (i < 0)
-        i = size_ + i;
+    // Run every chunk into part(c), see reduce()
+    template <typename Part>
+    int run_chunks(const Part& part) const;
 
-    if (i <= size_)
-        return arr_[i];
+    typename vec_operand<E>::type e_;
+    Step step_;
+    vec_exec policy_;
+};
 
-    throw std::out_of_range("Invalid position!");
+template <typename E>
+vec_pipe<E, vec_pipe_source> vec_expr<E>::pipe() const
+{
+    return pipe(vec_exec_default());
 }
 
-template <typename T>
-const T& vec<T>::operator[](int i) const
+template <typename E>
+vec_pipe<E, vec_pipe_source> vec_expr<E>::pipe(vec_exec policy) const
 {
-    if (i <= size_)
-        return arr_[i];
-
-    throw std::out_of_range("Invalid position!");
+    return vec_pipe<E, vec_pipe_source>(self(), vec_pipe_source(), policy);
 }
 
-
-
-//////////////////////////
-// Aggregate Operations //
-//////////////////////////
-
-template <typename T>
-T sum(const vec<T>& v)
+template <typename E, typename Step>
+template <typename Part>
+int vec_pipe<E, Step>::run_chunks(const Part& part) const
 {
-    T total = 0;
-    for (int i = 0; i < v.size_; i++) {
-        total += v.
-        arr_[i];
-    }
-    return total;
+    const int size = e_.size();
+    const int chunks = vec_par_chunks(policy_, size);
+    vec_parallel_for(chunks, [&](int c) {
+        run(vec_chunk_begin(size, chunks, c),
+            vec_chunk_begin(size, chunks, c+1), part(c));
+    });
+    return chunks;
 }
 
-template <typename T>
-T prod(const vec<T>& v)
+template <typename E, typename Step>
+template <typename Fn>
+void vec_pipe<E, Step>::for_each(Fn fn) const
 {
-    T total = 1;
-    for (int i = 0; i < v.size_; i++) {
-        total *= v.arr_[i];
-    }
-    return total;
+    run_chunks([&](int) {return [&](const value_type& x) {fn(x);};});
 }
 
-template <typename T>
-T max(const vec<T>& v)
+// Items are folded left to right from `init`. Under vec_exec::par each
+//   chunk is folded from its first item and the results of the chunks are
+//   then folded in order, so `op` must be associative and also take two
+//   accumulators
+template <typename E, typename Step>
+template <typename Acc, typename Op>
+Acc vec_pipe<E, Step>::reduce(Acc init, Op op) const
 {
-    T cur_max;
-    if (v.size_ > 0)
-        cur_max = v.arr_[0];
-    else
-        throw std::out_of_range("max: empty vector");
+    if (vec_par_chunks(policy_, e_.size()) == 1) {
+        Acc acc = init;
+        run(0, e_.size(), [&](const value_type& x) {acc = op(acc, x);});
+        return acc;
+    }
 
-    for (int i = 1; i < v.size_; i++)
-        cur_max = cur_max < v.arr_[i] ? v.arr_[i] : cur_max;
+    const int most = vec_par_chunks(policy_, e_.size());
+    std::vector<Acc> parts(most, init);
+    std::vector<char> found(most, 0);
+    const int chunks = run_chunks([&](int c) {
+        return [&, c](const value_type& x) {
+            parts[c] = found[c] ? static_cast<Acc>(op(parts[c], x))
+                : static_cast<Acc>(x);
+            found[c] = 1;
+        };
+    });
+
+    Acc acc = init;
+    for (int c = 0; c < chunks; c++)
+        if (found[c])
+            acc = op(acc, parts[c]);
+    return acc;
+}
 
-    return cur_max;
+template <typename E, typename Step>
+template <typename Op>
+typename vec_pipe<E, Step>::value_type vec_pipe<E, Step>::reduce(Op op) const
+{
+    const int most = vec_par_chunks(policy_, e_.size());
+    std::vector<value_type> parts(most);
+    std::vector<char> found(most, 0);
+    const int chunks = run_chunks([&](int c) {
+        return [&, c](const value_type& x) {
+            parts[c] = found[c] ? static_cast<value_type>(op(parts[c], x)) : x;
+            found[c] = 1;
+        };
+    });
+
+    int first = 0;
+    while (first < chunks && !found[first])
+        first++;
+    if (first == chunks)
+        throw std::out_of_range("reduce: empty pipe");
+
+    value_type acc = parts[first];
+    for (int c = first + 1; c < chunks; c++)
+        if (found[c])
+            acc = op(acc, parts[c]);
+    return acc;
 }
 
+template <typename E, typename Step>
+typename vec_pipe<E, Step>::value_type vec_pipe<E, Step>::sum() const
+{
+    value_type zero = 0;
+    return reduce(zero, vec_op_add());
+}
 
-template <typename T>
-T min(const vec<T>& v)
+template <typename E, typename Step>
+int vec_pipe<E, Step>::count() const
 {
-    T cur_min;
-    if (v.size_ > 0)
-        cur_min = v.arr_[0];
-    else
-        throw std::out_of_range("min: empty vector");
+    std::vector<int> counts(vec_par_chunks(policy_, e_.size()), 0);
+    run_chunks([&](int c) {
+        return [&, c](const value_type&) {counts[c]++;};
+    });
+
+    int total = 0;
+    for (size_t c = 0; c < counts.size(); c++)
+        total += counts[c];
+    return total;
+}
 
-    for (int i = 1; i < v.size_; i++)
-        cur_min = cur_min > v.arr_[i] ? v.arr_[i] : cur_min;
+// Serially the items go into one vec sized for the whole source, under
+//   vec_exec::par into a vec per chunk that are joined at the end
+template <typename E, typename Step>
+vec<typename vec_pipe<E, Step>::value_type> vec_pipe<E, Step>::collect() const
+{
+    const int chunks = vec_par_chunks(policy_, e_.size());
+    std::vector<vec<value_type>> parts(chunks);
+    if (chunks == 1)
+        parts[0].reserve(e_.size());
+    run_chunks([&](int c) {
+        return [&, c](const value_type& x) {parts[c].append(x);};
+    });
+    if (chunks == 1) {
+        if (parts[0].size() < e_.size() / 2)
+            parts[0].shrink_to_fit();
+        return std::move(parts[0]);
+    }
 
-    return cur_min;
+    int total = 0;
+    for (int c = 0; c < chunks; c++)
+        total += parts[c].size();
+    vec<value_type> out;
+    out.reserve(total);
+    for (int c = 0; c < chunks; c++)
+        out.append(parts[c]);
+    return out;
 }
 
 
 
 
 
-////////////
-// Output //
-////////////
+///////////////
+// Streaming //
+///////////////
 
-template <typename T>
-std::string vec<T>::str() const {
-    std::stringstream s;
-    s << "<";
+// A sequence of items read a chunk at a time, for data that does not fit
+//   in memory: a file written by save(), a generator or a callback. map(),
+//   take() and apply() add a step run on each chunk, and for_each(),
+//   collect(), save() and the reductions (sum, prod, max, min) run the
+//   steps over the whole stream. Only two chunks per step are in memory:
+//   the next one is read (and its steps run) on another thread while the
+//   current one is being used.
+//
+//     vec_stream<double> s = vec_stream<double>::open("big.vec");
+//     double total = sum(s.map([](const vec<double>& c) {return c * 2;}));
+//
+// Every pass starts over from the beginning of the source, except for
+//   callbacks, which are simply called again.
 
-    for (int i = 0; i < size_; i++) {
-        s << arr_[i];
-        if (i < size_-1)
-            s << ", ";
-    }
-    s << ">";
-    //s += " (allocsize_: " + std::to_string(allocsize_);
-    //s += "; size_: " + std::to_string(size_) + ")";
-    return s.str();
+// Items per chunk of new streams
+inline int& vec_stream_chunk()
+{
+    static int chunk = 1 << 20;
+    return chunk;
 }
 
 template <typename T>
-std::ostream& operator<<(std::ostream& strm, const vec<T>& v) {
-    return strm << v.str();
-}
-
-
-
-
+class vec_stream {
+public:
+    typedef T value_type;
+
+    // Replaces `out` with the next chunk, false once the stream is over.
+    //   Chunks may be empty
+    typedef std::function<bool(vec<T>& out)> reader;
+    typedef std::function<reader()> source;  // Starts a new pass
+
+    explicit vec_stream(source src, int chunk = vec_stream_chunk())
+        : src_(src), chunk_(chunk) {}
+
+    // Sources
+    static vec_stream open(const std::string& path,
+        int chunk = vec_stream_chunk());
+    template <typename Fn>
+    static vec_stream generate(int64_t n, Fn fn,  // fn(i) for i in 0..n-1
+        int chunk = vec_stream_chunk());
+    template <typename Fn>
+    static vec_stream callback(Fn fill,       // int fill(T* out, int max)
+        int chunk = vec_stream_chunk());
+
+    // Steps, `fn` gets each chunk as a `const vec<T>&`
+    template <typename Fn>
+    auto map(Fn fn) const               // A vec or expression of the chunk
+        -> vec_stream<typename std::decay<
+            decltype(fn(std::declval<const vec<T>&>()))>::type::value_type>;
+    template <typename Fn>
+    vec_stream take(Fn filter) const;   // A boolean expression of the chunk
+    template <typename Fn>
+    vec_stream apply(Fn fn) const;      // Applied to each item
+
+    // Run the stream
+    template <typename Fn>
+    void for_each(Fn fn) const;         // fn(const vec<T>& chunk)
+    vec<T> collect() const;
+    void save(const std::string& path) const;
+
+    int chunk_size() const {return chunk_;};
 
-//////////////////
-// Modification //
-//////////////////
+private:
+    source src_;
+    int chunk_;
+};
 
+// Reads the items of a save() file, which may hold more than INT_MAX
 template <typename T>
-void vec<T>::append(T x)  {
-    //Do we need to increase the vector array size?
-    if (size_+1 > allocsize_) {
-        realloc(size_+1);
-    }
-
-    arr_[size_] = x;
-    size_++;
+vec_stream<T> vec_stream<T>::open(const std::string& path, int chunk)
+{
+    static_assert(vec_type_tag<T>::value != VEC_TYPE_NONE,
+        "vec_stream::open(): only numbers and bools can be stored");
+
+    return vec_stream([path, chunk]() -> reader {
+        std::shared_ptr<FILE> f(fopen(path.c_str(), "rb"),
+            [](FILE* p) {if (p) fclose(p);});
+        if (!f)
+            throw std::runtime_error("vec_stream::open(): cannot open " + path);
+
+        vec_file_header h;
+        const bool ok = fread(&h, sizeof h, 1, f.get()) == 1
+            && fseek(f.get(), 0, SEEK_END) == 0;
+        const long bytes = ok ? ftell(f.get()) : 0;
+        const char* err = ok ? h.error(vec_type_tag<T>::value, sizeof(T),
+            bytes, UINT64_MAX) : "not a vec file";
+        if (err || fseek(f.get(), sizeof h, SEEK_SET) != 0)
+            throw std::runtime_error("vec_stream::open(): " + path + " "
+                + (err ? err : "cannot be read"));
+
+        std::shared_ptr<uint64_t> left = std::make_shared<uint64_t>(h.count);
+        return [f, left, chunk, path](vec<T>& out) {
+            if (*left == 0)
+                return false;
+            const int n = *left < uint64_t(chunk) ? int(*left) : chunk;
+            out.resize(n);
+            if (fread(out.data(), sizeof(T), n, f.get()) != size_t(n))
+                throw std::runtime_error("vec_stream: cannot read " + path);
+            *left -= n;
+            return true;
+        };
+    }, chunk);
 }
 
 template <typename T>
-void vec<T>::append(const vec<T>& v)
+template <typename Fn>
+vec_stream<T> vec_stream<T>::generate(int64_t n, Fn fn, int chunk)
 {
-    int newsize = size_ + v.size_;
-
-    realloc(newsize);
-
-    // Copy the items
-    for (int i = size_, j = 0; i < newsize; i++, j++)
-        arr_[i] = v.arr_[j];
-
-    size_ = newsize;
+    return vec_stream([n, fn, chunk]() -> reader {
+        std::shared_ptr<int64_t> next = std::make_shared<int64_t>(0);
+        return [n, fn, chunk, next](vec<T>& out) {
+            if (*next >= n)
+                return false;
+            const int len = n - *next < chunk ? int(n - *next) : chunk;
+            out.resize(len);
+            T* p = out.data();
+            for (int i = 0; i < len; i++)
+                p[i] = fn(*next + i);
+            *next += len;
+            return true;
+        };
+    }, chunk);
 }
 
+// The stream ends the first time `fill` returns 0
 template <typename T>
-void vec<T>::swap(int i, int j) {
-    //Bounds check
-    if (!(i >= 0 && i < size_ && j >= 0 && j < size_)) {
-        throw std::out_of_range("vec::swap() bounds error");
-    }
-
-    int tmp = arr_[i];
-    arr_[i] = arr_[j];
-    arr_[j] = tmp;
+template <typename Fn>
+vec_stream<T> vec_stream<T>::callback(Fn fill, int chunk)
+{
+    return vec_stream([fill, chunk]() -> reader {
+        return [fill, chunk](vec<T>& out) {
+            out.resize(chunk);
+            const int n = fill(out.data(), chunk);
+            if (n <= 0)
+                return false;
+            out.pop(chunk - n);
+            return true;
+        };
+    }, chunk);
 }
 
 template <typename T>
-void vec<T>::reverse() {
-    int i = 0;
-    int j = size_-1;
-    while (i < j) {
-        swap(i++, j--);
-    }
+template <typename Fn>
+auto vec_stream<T>::map(Fn fn) const
+    -> vec_stream<typename std::decay<
+        decltype(fn(std::declval<const vec<T>&>()))>::type::value_type>
+{
+    typedef typename std::decay<
+        decltype(fn(std::declval<const vec<T>&>()))>::type::value_type R;
+    source src = src_;
+    return vec_stream<R>([src, fn]() -> typename vec_stream<R>::reader {
+        reader in = src();
+        std::shared_ptr<vec<T>> buf = std::make_shared<vec<T>>();
+        return [in, buf, fn](vec<R>& out) {
+            if (!in(*buf))
+                return false;
+            out = fn(static_cast<const vec<T>&>(*buf));
+            return true;
+        };
+    }, chunk_);
 }
 
-
-
-
-
-
-//////////////
-// Sublists //
-//////////////
-
 template <typename T>
-T vec<T>::head() const
+template <typename Fn>
+vec_stream<T> vec_stream<T>::take(Fn filter) const
 {
-    if (size_ == 0)
-        throw std::out_of_range("head(): vec has no elements");
-
-    return arr_[0];
+    source src = src_;
+    return vec_stream([src, filter]() -> reader {
+        reader in = src();
+        std::shared_ptr<vec<T>> buf = std::make_shared<vec<T>>();
+        return [in, buf, filter](vec<T>& out) {
+            if (!in(*buf))
+                return false;
+            out = buf->take(filter(static_cast<const vec<T>&>(*buf)));
+            return true;
+        };
+    }, chunk_);
 }
 
 template <typename T>
-vec<T> vec<T>::head(int items) const
+template <typename Fn>
+vec_stream<T> vec_stream<T>::apply(Fn fn) const
 {
-    return head(items, 0);
+    source src = src_;
+    return vec_stream([src, fn]() -> reader {
+        reader in = src();
+        return [in, fn](vec<T>& out) {
+            if (!in(out))
+                return false;
+            out.apply(fn);
+            return true;
+        };
+    }, chunk_);
 }
 
+// Double buffered: while `fn` works on one chunk, the next one is read
+//   into the other buffer on a separate thread
 template <typename T>
-vec<T> vec<T>::head(int items, T overtake) const
+template <typename Fn>
+void vec_stream<T>::for_each(Fn fn) const
 {
-    vec v = vec<T>(items);
-    v.size_ = items;
-
-    //Overtake
-    if (items > size_) {
-        for (int i = 0; i < size_; i++) {
-            v.arr_[i] = arr_[i];
-        }
-        for (int i = size_; i < items; i++) {
-            v.arr_[i] = overtake;
-        }
-    } else {
-        for (int i = 0; i < items; i++) {
-            v.arr_[i] = arr_[i];
+    reader in = src_();
+    vec<T> buf[2];
+    int curr = 0;
+    bool more = in(buf[curr]);
+
+    while (more) {
+        bool next = false;
+        std::exception_ptr err;
+        std::thread ahead([&]() {
+            try {
+                next = in(buf[1 - curr]);
+            } catch (...) {
+                err = std::current_exception();
+            }
+        });
+
+        try {
+            fn(static_cast<const vec<T>&>(buf[curr]));
+        } catch (...) {
+            ahead.join();
+            throw;
         }
-    }
+        ahead.join();
+        if (err)
+            std::rethrow_exception(err);
 
-    return v;
+        curr = 1 - curr;
+        more = next;
+    }
 }
 
 template <typename T>
-T vec<T>::tail() const
+vec<T> vec_stream<T>::collect() const
 {
-    if (size_ == 0)
-        throw std::out_of_range("tail(): vec has no elements");
-
-    return arr_[size_-1];
+    vec<T> out;
+    for_each([&](const vec<T>& c) {out.append(c);});
+    return out;
 }
 
+// Write a save() file one chunk at a time, the item count is filled in
+//   at the end
 template <typename T>
-vec<T> vec<T>::tail(int items) const
+void vec_stream<T>::save(const std::string& path) const
 {
-    return tail(items, 0);
+    static_assert(vec_type_tag<T>::value != VEC_TYPE_NONE,
+        "vec_stream::save(): only numbers and bools can be stored");
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f)
+        throw std::runtime_error("vec_stream::save(): cannot open " + path);
+
+    uint64_t count = 0;
+    bool ok = fseek(f, sizeof(vec_file_header), SEEK_SET) == 0;
+    try {
+        for_each([&](const vec<T>& c) {
+            ok = ok && (c.size() == 0
+                || fwrite(c.data(), sizeof(T), c.size(), f) == size_t(c.size()));
+            count += c.size();
+        });
+    } catch (...) {
+        fclose(f);
+        throw;
+    }
+
+    const vec_file_header h = vec_file_header::make(vec_type_tag<T>::value,
+        sizeof(T), count);
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof h, 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        throw std::runtime_error("vec_stream::save(): cannot write " + path);
 }
 
-template <typename T>
-vec<T> vec<T>::tail(int items, T overtake) const
+// Reductions fold each chunk, then the results of the chunks.
+//   sum<Acc>(s) sums into a wider accumulator like sum<Acc>(v)
+template <typename Acc = void, typename T,
+    typename R = typename std::conditional<std::is_void<Acc>::value,
+        T, Acc>::type>
+R sum(const vec_stream<T>& s)
 {
-    vec v = vec<T>(items);
-    v.size_ = items;
-    //Overtake
-    if (items > size_)
-    {
-        int start = items-size_;
-        // overtake
-        for (int i = 0; i < start; i++)
-            v.arr_[i] = overtake;
-
-        // copy in the back of the array
-        for (int i = start, j = 0; i < items; i++, j++)
-            v.arr_[i] = arr_[j];
-
-    } else {
-        int start = size_ - items;
-        for (int i = start, j = 0; j < items; j++, i++)
-            v.arr_[j] = arr_[i];
-    }
-
-    return v;
+    R total = 0;
+    s.for_each([&](const vec<T>& c) {total += sum<R>(c);});
+    return total;
 }
 
 template <typename T>
-void vec<T>::pop()
+T prod(const vec_stream<T>& s)
 {
-    size_ -= 1;
+    T total = 1;
+    s.for_each([&](const vec<T>& c) {total *= prod(c);});
+    return total;
 }
 
 template <typename T>
-void vec<T>::pop(int n)
+T max(const vec_stream<T>& s)
 {
-    size_ -= n;
-
-    if (size_ < 0)
-        size_ = 0;
+    bool any = false;
+    T best = T();
+    s.for_each([&](const vec<T>& c) {
+        if (c.size() == 0)
+            return;
+        const T m = max(c);
+        best = any ? vec_op_max()(best, m) : m;
+        any = true;
+    });
+    if (!any)
+        throw std::out_of_range("max: empty stream");
+    return best;
 }
 
 template <typename T>
-vec<T> vec<T>::take(vec<bool> filter) const
+T min(const vec_stream<T>& s)
 {
-    if (filter.size() != size_)
-        throw std::out_of_range("take: length error");
+    bool any = false;
+    T best = T();
+    s.for_each([&](const vec<T>& c) {
+        if (c.size() == 0)
+            return;
+        const T m = min(c);
+        best = any ? vec_op_min()(best, m) : m;
+        any = true;
+    });
+    if (!any)
+        throw std::out_of_range("min: empty stream");
+    return best;
+}
 
-    const int size = filter.size();
-    int newsize = 0;
 
-    // Count the length of items
-    for (int i = 0; i < size; i++)
-        newsize += filter[i] ? 1 : 0;
 
-    // Initilize the new vec
-    vec<T> out(newsize);
-    out.size_ = newsize;
 
 
-    // Add the items
-    for (int i = 0, curr_idx = 0; i < size; i++)
-    {
-        if (filter[i])
-        {
-            out[curr_idx] = arr_[i];
-            curr_idx++;
-        }
-    }
+//////////////////
+// Text Parsing //
+//////////////////
 
-    return out;
+// parse() finds the numbers 64 bytes at a time: a SIMD compare turns each
+//   block into a bitmask of separators, and numbers are found by counting
+//   zero bits, without looking at each char. Under vec_exec::par the text
+//   is cut into chunks parsed on the pool; a number belongs to the chunk
+//   holding its first char.
+
+// Whitespace, control chars and ','
+inline bool vec_is_delim(char c)
+{
+    return static_cast<unsigned char>(c) <= ' ' || c == ',';
 }
 
+#ifdef VEC_SIMD
 
+inline VEC_SSE2 uint64_t vec_delim_bits_sse2(const char* p)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i comma = _mm_set1_epi8(',');
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const __m128i d = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(v, space), v), _mm_cmpeq_epi8(v, comma));
+        bits |= uint64_t(uint16_t(_mm_movemask_epi8(d))) << i;
+    }
+    return bits;
+}
 
+inline VEC_AVX2 uint64_t vec_delim_bits_avx2(const char* p)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+    const __m256i dlo = _mm256_or_si256(_mm256_cmpeq_epi8(
+        _mm256_min_epu8(lo, space), lo), _mm256_cmpeq_epi8(lo, comma));
+    const __m256i dhi = _mm256_or_si256(_mm256_cmpeq_epi8(
+        _mm256_min_epu8(hi, space), hi), _mm256_cmpeq_epi8(hi, comma));
+    return uint32_t(_mm256_movemask_epi8(dlo))
+        | uint64_t(uint32_t(_mm256_movemask_epi8(dhi))) << 32;
+}
 
+#endif // VEC_SIMD
 
-////////////////
-// Functional //
-////////////////
+// Bit i set when p[i] is a separator, for the `n` <= 64 chars at `p`.
+//   Bits past `n` are set too
+inline uint64_t vec_delim_bits(const char* p, size_t n)
+{
+#ifdef VEC_SIMD
+    if (n == 64 && vec_simd_isa() >= VEC_ISA_AVX2)
+        return vec_delim_bits_avx2(p);
+    if (n == 64 && vec_simd_isa() >= VEC_ISA_SSE2)
+        return vec_delim_bits_sse2(p);
+#endif
+    uint64_t bits = n < 64 ? ~uint64_t(0) << n : 0;
+    for (size_t i = 0; i < n; i++)
+        bits |= uint64_t(vec_is_delim(p[i])) << i;
+    return bits;
+}
 
-template <typename T>
-vec<T> vec<T>::apply(auto fn) {
-    for (int i = 0; i < size_; i++)
-        arr_[i] = fn(arr_[i]);
-    return *this;
+// Read the `n` chars at `p` as a number into `out`, false if they are not
+//   one. Parsing never depends on the locale
+inline bool vec_parse_item(const char* p, size_t n, bool& out)
+{
+    if (n != 1 || (*p != '0' && *p != '1'))
+        return false;
+    out = *p == '1';
+    return true;
 }
 
 template <typename T>
-vec<T> vec<T>::apply_to(vec<bool> filter, auto fn) {
-    if (filter.size() != size_)
-        throw std::out_of_range("take: length error");
+typename std::enable_if<std::is_integral<T>::value, bool>::type
+vec_parse_item(const char* p, size_t n, T& out)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    const bool neg = n > 0 && *p == '-';
+    if (n > 0 && (*p == '-' || *p == '+')) {
+        p++;
+        n--;
+    }
+    if (n == 0 || (neg && !std::is_signed<T>::value))
+        return false;
+
+    const U limit = neg ? U(U(std::numeric_limits<T>::max()) + 1)
+        : U(std::numeric_limits<T>::max());
+    U x = 0;
+    for (size_t i = 0; i < n; i++) {
+        const unsigned d = static_cast<unsigned char>(p[i]) - '0';
+        if (d > 9 || x > (limit - d) / 10)
+            return false;
+        x = x * 10 + d;
+    }
+    out = neg ? T(U(0) - x) : T(x);
+    return true;
+}
 
-    for (int i = 0; i < size_; i++)
-        if (filter[i])
-            arr_[i] = fn(arr_[i]);
+// strtod() on a copy of the `n` chars at `p`, in the "C" locale
+template <typename T>
+bool vec_parse_strtod(const char* p, size_t n, T& out)
+{
+    char buf[64];
+    std::string big;
+    char* s = buf;
+    if (n >= sizeof buf) {
+        big.assign(p, n);
+        s = &big[0];
+    } else {
+        memcpy(buf, p, n);
+        buf[n] = 0;
+    }
+    char* end;
+#ifdef VEC_C_LOCALE
+    const locale_t c = vec_c_locale();
+    if (c) {
+        out = std::is_same<T, float>::value ? T(strtof_l(s, &end, c))
+            : std::is_same<T, double>::value ? T(strtod_l(s, &end, c))
+            : T(strtold_l(s, &end, c));
+        return n > 0 && end == s + n;
+    }
+#endif
+    out = std::is_same<T, float>::value ? T(strtof(s, &end))
+        : std::is_same<T, double>::value ? T(strtod(s, &end))
+        : T(strtold(s, &end));
+    return n > 0 && end == s + n;
+}
 
-    return *this;
+// True when the `n` chars at `p` spell inf, infinity or nan, optionally
+//   followed by (chars), in any case
+inline bool vec_parse_special(const char* p, size_t n)
+{
+    auto is = [&](const char* word, size_t len) {
+        if (n < len)
+            return false;
+        for (size_t i = 0; i < len; i++)
+            if ((p[i] | 0x20) != word[i])
+                return false;
+        return true;
+    };
+    if (is("infinity", 8))
+        return n == 8;
+    if (is("inf", 3))
+        return n == 3;
+    if (!is("nan", 3))
+        return false;
+    if (n == 3)
+        return true;
+    if (p[3] != '(' || p[n-1] != ')')
+        return false;
+    for (size_t i = 4; i + 1 < n; i++)
+        if (!isalnum(static_cast<unsigned char>(p[i])) && p[i] != '_')
+            return false;
+    return true;
 }
 
+// Numbers of up to 19 digits that are exact in T, times an exact power of
+//   ten, are computed with one rounding (Clinger's fast path). Anything
+//   else goes through strtod(). Too large numbers become infinities.
+//   Without from_chars the same forms are accepted: decimal numbers, inf
+//   and nan, but not hex floats
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+vec_parse_item(const char* p, size_t n, T& out)
+{
+#if __cplusplus >= 201703L
+    const char* s = n > 1 && *p == '+' && p[1] != '-' ? p + 1 : p;
+    const std::from_chars_result r = std::from_chars(s, p + n, out);
+    if (r.ec == std::errc::result_out_of_range && r.ptr == p + n)
+        return vec_parse_strtod(p, n, out);
+    return r.ec == std::errc() && r.ptr == p + n;
+#else
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+        1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+        1e19, 1e20, 1e21, 1e22};
+    const bool fast_type = std::is_same<T, double>::value
+        || std::is_same<T, float>::value;
+    const int max_pow = std::is_same<T, float>::value ? 10 : 22;
+
+    size_t i = 0;
+    const bool neg = n > 0 && *p == '-';
+    if (n > 0 && (*p == '-' || *p == '+'))
+        i++;
+
+    uint64_t m = 0;
+    int digits = 0, exp = 0;
+    bool any = false, exact = true;
+    for (; i < n && unsigned(p[i] - '0') <= 9; i++, any = true) {
+        if (digits < 19) {
+            m = m * 10 + (p[i] - '0');
+            digits += m != 0;
+        } else {
+            exp++;
+            exact &= p[i] == '0';
+        }
+    }
+    if (i < n && p[i] == '.') {
+        for (i++; i < n && unsigned(p[i] - '0') <= 9; i++, any = true) {
+            if (digits < 19) {
+                m = m * 10 + (p[i] - '0');
+                digits += m != 0;
+                exp--;
+            } else {
+                exact &= p[i] == '0';
+            }
+        }
+    }
+    if (i < n && (p[i] == 'e' || p[i] == 'E') && any) {
+        size_t j = i + 1;
+        const bool eneg = j < n && p[j] == '-';
+        if (j < n && (p[j] == '-' || p[j] == '+'))
+            j++;
+        int e = 0;
+        bool edigits = false;
+        for (; j < n && unsigned(p[j] - '0') <= 9; j++, edigits = true)
+            e = e < 10000 ? e * 10 + (p[j] - '0') : e;
+        if (edigits) {
+            exp += eneg ? -e : e;
+            i = j;
+        }
+    }
 
-////////////////
-// Operators  //
-////////////////
+    if (fast_type && any && exact && i == n
+        && m <= (uint64_t(1) << std::numeric_limits<T>::digits)
+        && exp >= -max_pow && exp <= max_pow) {
+        T x = T(m);
+        x = exp < 0 ? x / T(pow10[-exp]) : x * T(pow10[exp]);
+        out = neg ? -x : x;
+        return true;
+    }
 
+    // Long mantissas, large exponents, inf and nan
+    const size_t sign = n > 0 && (*p == '-' || *p == '+');
+    if (!(any && i == n) && !vec_parse_special(p + sign, n - sign))
+        return false;
+    return vec_parse_strtod(p, n, out);
+#endif
+}
 
-IMPL_BOP(+);
-IMPL_BOP(-);
-IMPL_BOP(*);
-IMPL_BOP(/);
-IMPL_BOP(%);
-IMPL_BOP(&&);
-IMPL_BOP(||);
-IMPL_BOP(&);
-IMPL_BOP(|);
+// Append to `out` the numbers starting in [begin, end) of the `n` chars at
+//   `p`. `begin` must not be in the middle of a number
+template <typename T, typename A>
+void vec_parse_range(const char* p, size_t n, size_t begin, size_t end,
+    vec<T, A>& out)
+{
+    T x;
+    auto item = [&](size_t at, size_t len) {
+        if (!vec_parse_item(p + at, len, x))
+            throw std::invalid_argument("parse(): not a number: "
+                + std::string(p + at, len < 40 ? len : 40));
+        out.append(x);
+    };
+
+    size_t i = begin;
+    while (i < end) {
+        const size_t len = n - i < 64 ? n - i : 64;
+        const uint64_t delims = vec_delim_bits(p + i, len);
+        uint64_t starts = ~delims;
+        size_t next = i + len;
+
+        while (starts) {
+            const int s = vec_ctz(starts);
+            if (i + s >= end)
+                return;
+            const uint64_t after = delims & (~uint64_t(0) << s);
+            if (after) {
+                const int t = vec_ctz(after);
+                item(i + s, t - s);
+                starts &= ~uint64_t(0) << t;
+                continue;
+            }
+
+            // Runs past the block
+            size_t j = i + len;
+            while (j < n) {
+                const size_t l = n - j < 64 ? n - j : 64;
+                const uint64_t d = vec_delim_bits(p + j, l);
+                if (d) {
+                    j += vec_ctz(d);
+                    break;
+                }
+                j += l;
+            }
+            item(i + s, j - i - s);
+            next = j;
+            break;
+        }
+        i = next;
+    }
+}
 
-IMPL_COMP(<);
-IMPL_COMP(>);
-IMPL_COMP(<=);
-IMPL_COMP(>=);
-IMPL_COMP(==);
-IMPL_COMP(!=);
+#if __cplusplus >= 201703L
+template <typename T, typename A>
+vec<T, A> vec<T, A>::parse(std::string_view text)
+{
+    return parse(vec_exec_default(), text.data(), text.size());
+}
 
+template <typename T, typename A>
+vec<T, A> vec<T, A>::parse(vec_exec policy, std::string_view text)
+{
+    return parse(policy, text.data(), text.size());
+}
+#else
+template <typename T, typename A>
+vec<T, A> vec<T, A>::parse(const std::string& text)
+{
+    return parse(vec_exec_default(), text.data(), text.size());
+}
 
-vec<bool> operator!(const vec<bool>& v)
+template <typename T, typename A>
+vec<T, A> vec<T, A>::parse(vec_exec policy, const std::string& text)
 {
-    const int size = v.size();
-    vec<bool> out(size);
-    out.size_ = size;
+    return parse(policy, text.data(), text.size());
+}
+#endif
 
-    for (int i = 0; i < size; i++)
-    {
-        out[i] = !v[i];
+template <typename T, typename A>
+vec<T, A> vec<T, A>::parse(vec_exec policy, const char* text, size_t n)
+{
+    static_assert(std::is_arithmetic<T>::value,
+        "parse(): only numbers and bools can be parsed");
+
+    // Assume numbers of about 8 chars to size the chunks
+    const size_t guess = n / 8 < size_t(INT_MAX) ? n / 8 : size_t(INT_MAX);
+    const int chunks = vec_par_chunks(policy, static_cast<int>(guess));
+    if (chunks == 1) {
+        vec<T, A> v;
+        vec_parse_range(text, n, 0, n, v);
+        return v;
     }
 
-    return out;
+    std::vector<vec<T, A>> parts(chunks);
+    vec_parallel_for(chunks, [&](int c) {
+        size_t begin = n / chunks * c;
+        const size_t end = c == chunks - 1 ? n : n / chunks * (c + 1);
+        while (begin > 0 && begin < end && !vec_is_delim(text[begin - 1]))
+            begin++;
+        vec_parse_range(text, n, begin, end, parts[c]);
+    });
+
+    int64_t total = 0;
+    for (int c = 0; c < chunks; c++)
+        total += parts[c].size();
+    if (total > INT_MAX)
+        throw std::length_error("parse(): too many items");
+
+    vec<T, A> v;
+    v.reserve(static_cast<int>(total));
+    for (int c = 0; c < chunks; c++)
+        v.append(parts[c]);
+    return v;
 }
 
+template <typename T, typename A>
+vec<T, A> vec<T, A>::load_text(const std::string& path)
+{
+    return load_text(vec_exec_default(), path);
+}
+
+// The file is mapped rather than read when possible
+template <typename T, typename A>
+vec<T, A> vec<T, A>::load_text(vec_exec policy, const std::string& path)
+{
+#ifdef VEC_MMAP
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("load_text(): cannot open " + path);
+
+    struct stat st;
+    const bool ok = fstat(fd, &st) == 0;
+    void* p = ok && st.st_size > 0
+        ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (!ok || p == MAP_FAILED)
+        throw std::runtime_error("load_text(): cannot map " + path);
+    if (!p)
+        return vec<T, A>();
+
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    try {
+        vec<T, A> v = parse(policy, static_cast<const char*>(p), st.st_size);
+        munmap(p, st.st_size);
+        return v;
+    } catch (...) {
+        munmap(p, st.st_size);
+        throw;
+    }
+#else
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        throw std::runtime_error("load_text(): cannot open " + path);
+
+    std::string text;
+    char buf[65536];
+    size_t got;
+    while ((got = fread(buf, 1, sizeof buf, f)) > 0)
+        text.append(buf, got);
+    const bool ok = !ferror(f);
+    fclose(f);
+    if (!ok)
+        throw std::runtime_error("load_text(): cannot read " + path);
+    return parse(policy, text.data(), text.size());
+#endif
+}
+
+
+
+
 
 ////////////////
 // VECTORIZED //
@@ -852,24 +7846,37 @@ VECTORIZE_FN(ceil);
 VECTORIZE_FN(floor);
 VECTORIZE_FN(abs);
 
+// Functions with a SIMD kernel, see vec_math_mode()
+template <> struct vec_math_id<vec_fn_sqrt> {static const vec_math_fn value = VEC_MATH_SQRT;};
+template <> struct vec_math_id<vec_fn_exp> {static const vec_math_fn value = VEC_MATH_EXP;};
+template <> struct vec_math_id<vec_fn_log> {static const vec_math_fn value = VEC_MATH_LOG;};
+template <> struct vec_math_id<vec_fn_log2> {static const vec_math_fn value = VEC_MATH_LOG2;};
+template <> struct vec_math_id<vec_fn_log10> {static const vec_math_fn value = VEC_MATH_LOG10;};
+template <> struct vec_math_id<vec_fn_sin> {static const vec_math_fn value = VEC_MATH_SIN;};
+template <> struct vec_math_id<vec_fn_cos> {static const vec_math_fn value = VEC_MATH_COS;};
+template <> struct vec_math_id<vec_fn_tan> {static const vec_math_fn value = VEC_MATH_TAN;};
+template <> struct vec_math_id<vec_fn_tanh> {static const vec_math_fn value = VEC_MATH_TANH;};
+template <> struct vec_math_id<vec_fn_atan> {static const vec_math_fn value = VEC_MATH_ATAN;};
+template <> struct vec_math_id<vec_fn_cbrt> {static const vec_math_fn value = VEC_MATH_CBRT;};
+
 ////////////////
 // Generators //
 ////////////////
 
 
-template <typename T>
-vec<T> vec<T>::range(T n)
+template <typename T, typename A>
+vec<T, A> vec<T, A>::range(T n)
 {
     if (n > 0)
-        return vec<T>::range(0, n-1, 1);
+        return vec<T, A>::range(0, n-1, 1);
     else if (n < 0)
-        return vec<T>::range(0, n+1, -1);
+        return vec<T, A>::range(0, n+1, -1);
     else
-        return vec<T>(0);
+        return vec<T, A>(0);
 }
 
-template <typename T>
-vec<T> vec<T>::range(T a, T b)
+template <typename T, typename A>
+vec<T, A> vec<T, A>::range(T a, T b)
 {
     // If a < b, count up, else count down
     T inc = 0;
@@ -879,11 +7886,11 @@ vec<T> vec<T>::range(T a, T b)
         inc = -1;
     }
 
-    return vec<T>::range(a, b, inc);
+    return vec<T, A>::range(a, b, inc);
 }
 
-template <typename T>
-vec<T> vec<T>::range(T a, T b, T inc)
+template <typename T, typename A>
+vec<T, A> vec<T, A>::range(T a, T b, T inc)
 {
     // Invalid arguments
     // a will never become b with the given inc
@@ -894,7 +7901,7 @@ vec<T> vec<T>::range(T a, T b, T inc)
     }
 
     T cur = a; // current
-    vec<T> v(abs(a-b) / abs(inc));
+    vec<T, A> v(static_cast<int>(abs(a-b) / abs(inc)) + 1);
 
     if (a < b)
     {
@@ -923,61 +7930,54 @@ vec<T> vec<T>::range(T a, T b, T inc)
 }
 
 
-template <typename T>
-vec<T> pow(const vec<T>& v, T n)
-{
-    const int size = v.size();
-
-    vec<T> w(size);
-    w.resize(size);
-
-    for (int i = 0; i < size; i++)
-        w[i] = pow(v[i], n);
+struct vec_fn_pow {
+    static const char* name() {return "pow";};
+    template <typename A, typename B>
+    auto operator()(const A& a, const B& b) const -> decltype(pow(a, b))
+    {
+        return pow(a, b);
+    }
+};
 
-    return w;
+template <typename L, typename Q,
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type>
+vec_binary_expr<vec_fn_pow, typename L::value_type, L, vec_scalar<Q>>
+pow(const vec_expr<L>& v, Q n)
+{
+    return vec_binary_expr<vec_fn_pow, typename L::value_type,
+        L, vec_scalar<Q>>(v.self(), n, v.self().size());
 }
 
-template <typename T>
-vec<T> pow(T n, const vec<T>& v)
+template <typename Q, typename R,
+    typename = typename std::enable_if<!is_vec_expr<Q>::value>::type>
+vec_binary_expr<vec_fn_pow, typename R::value_type, vec_scalar<Q>, R>
+pow(Q n, const vec_expr<R>& v)
 {
-    const int size = v.size();
-
-    vec<T> w(size);
-    w.resize(size);
-
-    for (int i = 0; i < size; i++)
-        w[i] = pow(n, v[i]);
-
-    return w;
+    return vec_binary_expr<vec_fn_pow, typename R::value_type,
+        vec_scalar<Q>, R>(n, v.self(), v.self().size());
 }
 
 
-template <typename T>
-vec<T> pow(const vec<T>& a, const vec<T>& b)
+template <typename L, typename R>
+vec_binary_expr<vec_fn_pow, typename L::value_type, L, R>
+pow(const vec_expr<L>& a, const vec_expr<R>& b)
 {
-    if (a.size() != b.size())
+    if (a.self().size() != b.self().size())
         throw std::out_of_range("size mismatch");
 
-    const int size = a.size();
-
-    vec<T> w(size);
-    w.resize(size);
-
-    for (int i = 0; i < size; i++)
-        w[i] = pow(a[i], b[i]);
-
-    return w;
+    return vec_binary_expr<vec_fn_pow, typename L::value_type,
+        L, R>(a.self(), b.self(), a.self().size());
 }
 
 
-template <typename T>
-T* begin(vec<T>& v)
+template <typename T, typename A>
+T* begin(vec<T, A>& v)
 {
     return v.size() ? &v[0] : nullptr;
 }
 
-template <typename T>
-T* end(vec<T>& v)
+template <typename T, typename A>
+T* end(vec<T, A>& v)
 {
     return begin(v) + v.size();
 }